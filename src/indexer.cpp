@@ -1,6 +1,7 @@
 // indexer.cpp
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <map>
 #include <vector>
@@ -10,11 +11,282 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <filesystem> // Include filesystem library
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <string_view>
+#include <charconv>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 namespace fs = std::filesystem; // Alias for convenience
 using namespace std;
 
-const int MAX_BLOCK_SIZE = 100 * 1024 * 1024; // 100 MB per block
+const int MAX_BLOCK_SIZE = 100 * 1024 * 1024; // At most 100 MB of tracked memory per block
+const size_t READ_CHUNK_SIZE = 4 * 1024 * 1024; // 4 MB of whole lines per reader chunk
+const size_t RUN_WRITE_BUFFER_SIZE = 1 << 20; // Binary runs are written in aligned 1 MB pages
+const char RUN_FILE_MAGIC[8] = {'W', 'S', 'E', 'R', 'U', 'N', '0', '1'};
+const char POSITIONAL_RUN_FILE_MAGIC[8] = {'W', 'S', 'E', 'R', 'U', 'N', 'P', '1'};
+const size_t DECOMPRESS_RING_SIZE = 8 * 1024 * 1024; // Decompressed bytes buffered ahead of the reader
+const uint32_t POSTINGS_PER_BLOCK = 64;      // Postings per block of the final index, as the merger writes them
+const char PAGE_TABLE_MAGIC[8] = {'W', 'S', 'E', 'P', 'A', 'G', 'E', '1'};
+const uint16_t NO_DOCUMENT = 0xFFFF;        // Page table slot of a docID without a document
+const uint16_t MAX_PAGE_LENGTH = 0xFFFE;    // Longer documents are stored with this length
+
+// Settings of one indexing pass
+struct IndexerOptions {
+    int numWorkers;     // Tokenizer threads
+    int numInverters;   // Threads that build and write blocks
+    bool useMmap;       // Parse the collection in place from a read-only mapping
+    bool binaryRuns;    // Write intermediate files as binary runs instead of text
+    bool positions;     // Record the token positions of every posting
+    bool resume;        // Continue from the checkpoint in the output directory
+    bool sortInverter;  // Invert blocks by radix sorting posting triples instead of into a BlockIndex
+    int sortThreads;    // Threads each inverter sorts a block with
+};
+
+// Function to read the resident set size of this process from /proc
+size_t residentBytes() {
+    ifstream statm("/proc/self/statm");
+    size_t totalPages = 0;
+    size_t residentPages = 0;
+    statm >> totalPages >> residentPages;
+    return residentPages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Bytes held by the indexer's own allocators (term dictionary, parsed documents,
+// input chunks, block arenas), checked against --memory-budget. A limit of 0 means
+// no budget. Threads waiting for memory are woken whenever bytes are released.
+class MemoryBudget {
+public:
+    MemoryBudget() : limitBytes(0), used(0), peak(0) {}
+
+    void setLimit(size_t bytes) {
+        limitBytes = bytes;
+    }
+
+    size_t limit() const {
+        return limitBytes;
+    }
+
+    void charge(size_t bytes) {
+        size_t now = used.fetch_add(bytes) + bytes;
+        size_t previousPeak = peak.load();
+        while (now > previousPeak && !peak.compare_exchange_weak(previousPeak, now)) {
+        }
+    }
+
+    void release(size_t bytes) {
+        used.fetch_sub(bytes);
+        lock_guard<mutex> lock(mtx);
+        released.notify_all();
+    }
+
+    // Moves a charge from oldBytes to newBytes for an allocator that reports its size
+    void update(size_t& charged, size_t newBytes) {
+        if (newBytes > charged) {
+            charge(newBytes - charged);
+        } else if (newBytes < charged) {
+            release(charged - newBytes);
+        }
+        charged = newBytes;
+    }
+
+    size_t bytesUsed() const {
+        return used.load();
+    }
+
+    size_t peakBytes() const {
+        return peak.load();
+    }
+
+    // True when tracked bytes or, as a backstop for untracked heap, the RSS exceed the limit
+    bool exceeded() const {
+        return limitBytes > 0 && (used.load() > limitBytes || residentBytes() > limitBytes);
+    }
+
+    void waitForRelease() {
+        unique_lock<mutex> lock(mtx);
+        released.wait_for(lock, chrono::milliseconds(50));
+    }
+
+private:
+    size_t limitBytes;
+    atomic<size_t> used;
+    atomic<size_t> peak;
+    mutex mtx;
+    condition_variable released;
+};
+
+MemoryBudget memoryBudget;
+
+// Per-stage throughput and latency counters for read, tokenize, count, invert and flush.
+// Each stage adds up its time (summed over the threads that run it), how often it ran,
+// the items it handled and the bytes in and out, with relaxed atomic adds made once per
+// chunk or block, not per token. A reporter thread can append a JSON snapshot to a file
+// at a fixed interval; report() prints the totals.
+class Metrics {
+public:
+    struct StageInfo {
+        const char* name;
+        const char* unit; // What the stage's items are
+    };
+
+    Metrics(const char* program, vector<StageInfo> stageInfo)
+        : program(program), info(move(stageInfo)), stages(info.size()), start(chrono::steady_clock::now()),
+          stopping(false) {}
+
+    ~Metrics() {
+        stopReporter();
+    }
+
+    void record(size_t stage, chrono::steady_clock::duration elapsed, uint64_t items,
+                uint64_t bytesIn = 0, uint64_t bytesOut = 0) {
+        Totals& totals = stages[stage];
+        totals.nanos.fetch_add(chrono::duration_cast<chrono::nanoseconds>(elapsed).count(), memory_order_relaxed);
+        totals.calls.fetch_add(1, memory_order_relaxed);
+        add(stage, items, bytesIn, bytesOut);
+    }
+
+    // Counts items or bytes without timing anything
+    void add(size_t stage, uint64_t items, uint64_t bytesIn = 0, uint64_t bytesOut = 0) {
+        Totals& totals = stages[stage];
+        totals.items.fetch_add(items, memory_order_relaxed);
+        totals.bytesIn.fetch_add(bytesIn, memory_order_relaxed);
+        totals.bytesOut.fetch_add(bytesOut, memory_order_relaxed);
+    }
+
+    // Function to render the counters as one line of JSON
+    string snapshot(bool final) const {
+        ostringstream json;
+        json << "{\"program\":\"" << program << "\",\"elapsed_seconds\":" << elapsedSeconds()
+             << ",\"final\":" << (final ? "true" : "false") << ",\"stages\":[";
+        for (size_t i = 0; i < stages.size(); ++i) {
+            double seconds = stages[i].nanos.load(memory_order_relaxed) / 1e9;
+            uint64_t items = stages[i].items.load(memory_order_relaxed);
+            json << (i ? "," : "") << "{\"stage\":\"" << info[i].name << "\",\"unit\":\"" << info[i].unit
+                 << "\",\"seconds\":" << seconds
+                 << ",\"calls\":" << stages[i].calls.load(memory_order_relaxed)
+                 << ",\"items\":" << items
+                 << ",\"bytes_in\":" << stages[i].bytesIn.load(memory_order_relaxed)
+                 << ",\"bytes_out\":" << stages[i].bytesOut.load(memory_order_relaxed)
+                 << ",\"items_per_second\":" << (seconds > 0 ? static_cast<uint64_t>(items / seconds) : 0) << "}";
+        }
+        json << "]}";
+        return json.str();
+    }
+
+    // Function to append a snapshot to path every intervalSeconds until stopReporter()
+    void startReporter(const string& path, double intervalSeconds) {
+        reportFile.open(path, ios::app);
+        if (!reportFile.is_open()) {
+            throw runtime_error("Failed to open metrics file for writing: " + path);
+        }
+        reporter = thread([this, intervalSeconds] {
+            unique_lock<mutex> lock(mtx);
+            while (!wake.wait_for(lock, chrono::duration<double>(intervalSeconds), [&] { return stopping; })) {
+                reportFile << snapshot(false) << endl;
+            }
+        });
+    }
+
+    // Function to stop the reporter and append the final snapshot
+    void stopReporter() {
+        if (!reporter.joinable()) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        reporter.join();
+        reportFile << snapshot(true) << endl;
+        reportFile.close();
+    }
+
+    // Function to print the totals per stage and the stage that took the most time
+    void report(ostream& out) const {
+        out << "Stage metrics after " << elapsedSeconds() << " seconds (busy time summed over threads):" << endl;
+        size_t busiest = 0;
+        for (size_t i = 0; i < stages.size(); ++i) {
+            double seconds = stages[i].nanos.load(memory_order_relaxed) / 1e9;
+            uint64_t items = stages[i].items.load(memory_order_relaxed);
+            out << "  " << info[i].name << ": " << seconds << " s, " << stages[i].calls.load(memory_order_relaxed)
+                << " calls, " << items << " " << info[i].unit << " ("
+                << (seconds > 0 ? static_cast<uint64_t>(items / seconds) : 0) << "/sec), "
+                << stages[i].bytesIn.load(memory_order_relaxed) / (1024 * 1024) << " MB in, "
+                << stages[i].bytesOut.load(memory_order_relaxed) / (1024 * 1024) << " MB out" << endl;
+            if (stages[i].nanos.load(memory_order_relaxed) > stages[busiest].nanos.load(memory_order_relaxed)) {
+                busiest = i;
+            }
+        }
+        out << "Busiest stage: " << info[busiest].name << endl;
+    }
+
+private:
+    struct Totals {
+        atomic<uint64_t> nanos{0};
+        atomic<uint64_t> calls{0};
+        atomic<uint64_t> items{0};
+        atomic<uint64_t> bytesIn{0};
+        atomic<uint64_t> bytesOut{0};
+    };
+
+    double elapsedSeconds() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    const char* program;
+    vector<StageInfo> info;
+    vector<Totals> stages;
+    chrono::steady_clock::time_point start;
+    ofstream reportFile;
+    bool stopping;
+    mutex mtx;
+    condition_variable wake;
+    thread reporter;
+};
+
+// Stages of the indexing pipeline, in the order a document passes through them
+enum IndexerStage : size_t { STAGE_READ, STAGE_TOKENIZE, STAGE_COUNT, STAGE_INVERT, STAGE_FLUSH };
+
+Metrics metrics("indexer", {{"read", "chunks"}, {"tokenize", "tokens"}, {"count", "documents"},
+                            {"invert", "postings"}, {"flush", "postings"}});
+
+// Function to parse a byte count such as 256M, 2G or 4096
+size_t parseByteSize(const string& text) {
+    char* end = nullptr;
+    double value = strtod(text.c_str(), &end);
+    size_t multiplier = 1;
+    if (*end == 'K' || *end == 'k') multiplier = size_t(1) << 10;
+    if (*end == 'M' || *end == 'm') multiplier = size_t(1) << 20;
+    if (*end == 'G' || *end == 'g') multiplier = size_t(1) << 30;
+    if (end == text.c_str() || value < 0) {
+        throw runtime_error("Invalid size: " + text);
+    }
+    return static_cast<size_t>(value * multiplier);
+}
 
 // Posting structure: docID and term frequency
 struct Posting {
@@ -22,140 +294,3191 @@ struct Posting {
     int termFreq;
 };
 
-// Function to tokenize text ASCII check
-vector<std::string> tokenize(const string& text) {
-    std::vector<std::string> tokens;
-    std::string token;
-    auto isASCII = [](const string& token) -> bool {
-        for (char c : token) {
-            if (static_cast<unsigned char>(c) > 127) return false;
+// A document after tokenizing and counting, waiting to be inverted
+struct ParsedDocument {
+    int docID;                              // Dense docID, assigned in input order
+    int64_t externalID;                     // DocID given in the collection
+    size_t inputEnd;                        // Collection text offset just past the document's line
+    size_t length;                          // Number of tokens, for the page table
+    vector<uint8_t> termFreqs;              // Distinct term IDs and their frequencies, as varbyte pairs
+    vector<uint32_t> positions;             // Token positions of each term in termFreqs order, if recorded
+    size_t bytes;                           // Heap bytes this document holds, charged to the budget
+};
+
+// A line-aligned slice of the collection, numbered in input order.
+// In mmap mode the text is a view into the mapping, otherwise the chunk owns it.
+struct InputChunk {
+    size_t sequence;
+    size_t offset; // Collection text offset of the chunk's first byte
+    string storage;
+    string_view mapped;
+
+    string_view text() const {
+        return mapped.data() ? mapped : string_view(storage);
+    }
+};
+
+struct ParsedChunk {
+    size_t sequence;
+    vector<ParsedDocument> docs;
+};
+
+// A contiguous range of documents that is inverted into one intermediate file
+struct Block {
+    int blockID;
+    vector<ParsedDocument> docs;
+    size_t bytes; // Sum of the documents' charged bytes
+};
+
+// Function to append a varbyte, low 7 bits first, with 0 taking one byte
+inline void appendVarByte(vector<uint8_t>& bytes, uint32_t value) {
+    while (value > 0x7F) {
+        bytes.push_back(static_cast<uint8_t>(value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
+}
+
+// Function to decode a varbyte written by appendVarByte and move past it
+inline uint32_t readVarByte(const uint8_t*& p) {
+    uint32_t value = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        value |= static_cast<uint32_t>(*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    return value | static_cast<uint32_t>(*p++) << shift;
+}
+
+// Function to hash a term for interning, eight bytes at a time
+inline uint64_t hashTerm(string_view term) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ term.size();
+    size_t i = 0;
+    for (; i + 8 <= term.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, term.data() + i, 8);
+        h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, term.data() + i, term.size() - i);
+    h = (h ^ tail) * 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 29;
+    return h;
+}
+
+// Shared term dictionary: interns every distinct token once into a dense term ID.
+// Open addressing with linear probing, split into shards with their own lock so
+// tokenizer threads rarely contend. Term bytes and the ID -> term table never move,
+// so term() needs no lock for any ID that has already been handed out.
+class TermDictionary {
+public:
+    TermDictionary() : nextID(0), chunks(new atomic<string_view*>[MAX_CHUNKS]()) {
+        for (auto& shard : shards) {
+            shard.slots.assign(1024, Slot{0, EMPTY_SLOT});
+        }
+        charge(MAX_CHUNKS * sizeof(atomic<string_view*>) + (1 << SHARD_BITS) * 1024 * sizeof(Slot));
+    }
+
+    ~TermDictionary() {
+        for (size_t i = 0; i < MAX_CHUNKS; ++i) {
+            delete[] chunks[i].load();
+        }
+        memoryBudget.release(reserved.load());
+    }
+
+    TermDictionary(const TermDictionary&) = delete;
+    TermDictionary& operator=(const TermDictionary&) = delete;
+
+    uint32_t intern(string_view token, uint64_t hash) {
+        Shard& shard = shards[hash >> (64 - SHARD_BITS)];
+        lock_guard<mutex> lock(shard.mtx);
+        size_t mask = shard.slots.size() - 1;
+        size_t i = hash & mask;
+        for (; shard.slots[i].termID != EMPTY_SLOT; i = (i + 1) & mask) {
+            const Slot& slot = shard.slots[i];
+            if (slot.hash == hash && term(slot.termID) == token) {
+                return slot.termID;
+            }
+        }
+
+        uint32_t termID = nextID.fetch_add(1);
+        if (termID == EMPTY_SLOT) {
+            throw runtime_error("Term dictionary is full");
+        }
+        storeTerm(termID, copyTermBytes(shard, token));
+        shard.slots[i] = Slot{hash, termID};
+        if (++shard.used * 2 > shard.slots.size()) {
+            grow(shard);
+        }
+        return termID;
+    }
+
+    string_view term(uint32_t termID) const {
+        return chunks[termID / TERMS_PER_CHUNK].load(memory_order_acquire)[termID % TERMS_PER_CHUNK];
+    }
+
+    uint32_t size() const {
+        return nextID.load();
+    }
+
+    size_t bytesReserved() const {
+        return reserved.load();
+    }
+
+private:
+    static constexpr int SHARD_BITS = 6;
+    static constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
+    static constexpr size_t TERMS_PER_CHUNK = 1 << 16;
+    static constexpr size_t MAX_CHUNKS = (size_t(1) << 32) / TERMS_PER_CHUNK;
+    static constexpr size_t TERM_PAGE_SIZE = 1 << 16;
+
+    struct Slot {
+        uint64_t hash;
+        uint32_t termID;
+    };
+
+    struct Shard {
+        mutex mtx;
+        vector<Slot> slots; // Power of two sized
+        size_t used = 0;
+        vector<unique_ptr<char[]>> pages; // Term bytes, never moved once written
+        size_t pageUsed = TERM_PAGE_SIZE;
+    };
+
+    void charge(size_t bytes) {
+        reserved += bytes;
+        memoryBudget.charge(bytes);
+    }
+
+    string_view copyTermBytes(Shard& shard, string_view token) {
+        // A term longer than a page gets its own allocation, kept in front of the
+        // partly filled page so that later terms still go into that one
+        if (token.size() > TERM_PAGE_SIZE) {
+            charge(token.size());
+            char* dest = new char[token.size()];
+            shard.pages.emplace(shard.pages.empty() ? shard.pages.end() : prev(shard.pages.end()), dest);
+            memcpy(dest, token.data(), token.size());
+            return string_view(dest, token.size());
+        }
+        if (shard.pageUsed + token.size() > TERM_PAGE_SIZE) {
+            charge(TERM_PAGE_SIZE);
+            shard.pages.emplace_back(new char[TERM_PAGE_SIZE]);
+            shard.pageUsed = 0;
+        }
+        char* dest = shard.pages.back().get() + shard.pageUsed;
+        memcpy(dest, token.data(), token.size());
+        shard.pageUsed += token.size();
+        return string_view(dest, token.size());
+    }
+
+    void storeTerm(uint32_t termID, string_view termBytes) {
+        atomic<string_view*>& chunk = chunks[termID / TERMS_PER_CHUNK];
+        string_view* entries = chunk.load(memory_order_acquire);
+        if (!entries) {
+            lock_guard<mutex> lock(chunkMutex);
+            entries = chunk.load(memory_order_acquire);
+            if (!entries) {
+                charge(TERMS_PER_CHUNK * sizeof(string_view));
+                entries = new string_view[TERMS_PER_CHUNK];
+                chunk.store(entries, memory_order_release);
+            }
+        }
+        entries[termID % TERMS_PER_CHUNK] = termBytes;
+    }
+
+    void grow(Shard& shard) {
+        charge(shard.slots.size() * sizeof(Slot));
+        vector<Slot> slots(shard.slots.size() * 2, Slot{0, EMPTY_SLOT});
+        size_t mask = slots.size() - 1;
+        for (const Slot& slot : shard.slots) {
+            if (slot.termID != EMPTY_SLOT) {
+                size_t i = slot.hash & mask;
+                while (slots[i].termID != EMPTY_SLOT) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = slot;
+            }
+        }
+        shard.slots.swap(slots);
+    }
+
+    Shard shards[1 << SHARD_BITS];
+    atomic<uint32_t> nextID;
+    atomic<size_t> reserved{0}; // Bytes charged to the memory budget
+    unique_ptr<atomic<string_view*>[]> chunks; // ID -> term, allocated a chunk at a time
+    mutex chunkMutex;
+};
+
+// Direct-mapped cache in front of the shared dictionary, one per tokenizer thread.
+// Frequent terms resolve here without touching a shard lock.
+class TermIDCache {
+public:
+    explicit TermIDCache(TermDictionary& dictionary)
+        : dictionary(dictionary), entries(CACHE_SIZE, Entry{0, {}, 0}) {}
+
+    uint32_t lookup(string_view token) {
+        uint64_t hash = hashTerm(token);
+        Entry& entry = entries[hash & (CACHE_SIZE - 1)];
+        if (entry.hash == hash && entry.term == token && !token.empty()) {
+            return entry.termID;
+        }
+        uint32_t termID = dictionary.intern(token, hash);
+        entry = Entry{hash, dictionary.term(termID), termID};
+        return termID;
+    }
+
+private:
+    static constexpr size_t CACHE_SIZE = 1 << 16;
+
+    struct Entry {
+        uint64_t hash;
+        string_view term; // Points into the dictionary's term bytes
+        uint32_t termID;
+    };
+
+    TermDictionary& dictionary;
+    vector<Entry> entries;
+};
+
+// Per-thread term frequency counter for one document at a time. Open addressing
+// keyed by term ID; the slots touched by a document are remembered so clear()
+// costs O(distinct terms) and the table is never reallocated once it is large enough.
+class TermCounter {
+public:
+    TermCounter() : slots(INITIAL_SLOTS, Slot{EMPTY_SLOT, 0}), mask(INITIAL_SLOTS - 1) {}
+
+    void add(uint32_t termID) {
+        size_t i = slotOf(termID);
+        while (slots[i].termID != termID) {
+            if (slots[i].termID == EMPTY_SLOT) {
+                if ((touched.size() + 1) * 2 > slots.size()) {
+                    grow();
+                    add(termID);
+                    return;
+                }
+                slots[i].termID = termID;
+                touched.push_back(static_cast<uint32_t>(i));
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        slots[i].count++;
+    }
+
+    // Append the (term ID, frequency) pairs in first-occurrence order
+    void appendTo(vector<pair<uint32_t, int>>& termFreqs) const {
+        termFreqs.reserve(termFreqs.size() + touched.size());
+        for (uint32_t i : touched) {
+            termFreqs.emplace_back(slots[i].termID, slots[i].count);
+        }
+    }
+
+    // Append the pairs as varbytes, the form documents keep them in
+    void encodeTo(vector<uint8_t>& bytes) const {
+        for (uint32_t i : touched) {
+            appendVarByte(bytes, slots[i].termID);
+            appendVarByte(bytes, slots[i].count);
+        }
+    }
+
+    void clear() {
+        for (uint32_t i : touched) {
+            slots[i] = Slot{EMPTY_SLOT, 0};
+        }
+        touched.clear();
+    }
+
+private:
+    static constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
+    static constexpr size_t INITIAL_SLOTS = 1 << 10;
+
+    struct Slot {
+        uint32_t termID;
+        int count;
+    };
+
+    size_t slotOf(uint32_t termID) const {
+        // Fibonacci hashing; term IDs are dense so the low bits alone would cluster
+        return (termID * 0x9E3779B97F4A7C15ull >> 32) & mask;
+    }
+
+    void grow() {
+        vector<Slot> old;
+        old.swap(slots);
+        vector<uint32_t> oldTouched;
+        oldTouched.swap(touched);
+        slots.assign(old.size() * 2, Slot{EMPTY_SLOT, 0});
+        mask = slots.size() - 1;
+        for (uint32_t j : oldTouched) {
+            size_t i = slotOf(old[j].termID);
+            while (slots[i].termID != EMPTY_SLOT) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = old[j];
+            touched.push_back(static_cast<uint32_t>(i));
+        }
+    }
+
+    vector<Slot> slots;
+    size_t mask;
+    vector<uint32_t> touched; // Occupied slots, in first-occurrence order
+};
+
+// Bump allocator for the postings of one block. Pages are kept across blocks and
+// reset() releases everything at once by rewinding to the first page.
+class PostingArena {
+public:
+    PostingArena() : currentPage(0), pageOffset(0) {}
+
+    void* allocate(size_t bytes) {
+        bytes = (bytes + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+        while (currentPage < pages.size() && pageOffset + bytes > PAGE_SIZE) {
+            currentPage++;
+            pageOffset = 0;
+        }
+        if (currentPage == pages.size()) {
+            pages.emplace_back(new char[PAGE_SIZE]);
+            pageOffset = 0;
+        }
+        void* ptr = pages[currentPage].get() + pageOffset;
+        pageOffset += bytes;
+        return ptr;
+    }
+
+    void reset() {
+        currentPage = 0;
+        pageOffset = 0;
+    }
+
+    // Frees every page, for when memory is short and pages should not be kept
+    void release() {
+        pages.clear();
+        reset();
+    }
+
+    size_t bytesReserved() const {
+        return pages.size() * PAGE_SIZE;
+    }
+
+private:
+    static constexpr size_t PAGE_SIZE = 1 << 20;
+
+    vector<unique_ptr<char[]>> pages;
+    size_t currentPage;
+    size_t pageOffset;
+};
+
+// Fixed-size run of encoded bytes for one term, linked to the term's next slab.
+// Slabs double from MIN_SLAB_BYTES up to MAX_SLAB_BYTES as a list grows,
+// so rare terms waste at most a few bytes.
+struct ArenaSlab {
+    static constexpr uint32_t MIN_SLAB_BYTES = 16;
+    static constexpr uint32_t MAX_SLAB_BYTES = 2048;
+
+    ArenaSlab* next;
+    uint32_t capacity;
+    uint32_t count;
+
+    uint8_t* bytes() {
+        return reinterpret_cast<uint8_t*>(this + 1);
+    }
+    const uint8_t* bytes() const {
+        return reinterpret_cast<const uint8_t*>(this + 1);
+    }
+};
+
+// Head and tail of one slab list
+struct SlabList {
+    ArenaSlab* head;
+    ArenaSlab* tail;
+};
+
+// Postings of one term in a block, kept compressed in the layout of a binary run:
+// varbyte (docID gap, termFreq) pairs and, if recorded, varbyte position gaps that
+// restart from 0 at each posting
+struct TermPostings {
+    SlabList postings;
+    SlabList positions;
+    uint32_t lastDocID;     // Base of the next docID gap
+    uint32_t count;         // Postings
+    uint32_t postingBytes;  // Bytes in the postings list
+    uint32_t positionBytes; // Bytes in the positions list
+};
+
+// In-memory inverted index of one block, keyed by term ID.
+// Postings are delta + varbyte coded into arena slabs as they arrive, about a third
+// of the size of raw Posting structs, and a binary run copies the bytes out as they
+// are. Only the terms a block touches are reset, and term strings are looked at
+// once, when the block is sorted for writing.
+class BlockIndex {
+public:
+    // Adds a posting; positions, if given, holds its posting.termFreq token positions.
+    // Postings of a term must come in increasing docID order.
+    void addPosting(uint32_t termID, Posting posting, const uint32_t* positions = nullptr) {
+        if (termID >= slotOfTerm.size()) {
+            slotOfTerm.resize(max<size_t>(termID + 1, slotOfTerm.size() * 2), NO_SLOT);
+        }
+        uint32_t slot = slotOfTerm[termID];
+        if (slot == NO_SLOT) {
+            slot = termIDs.size();
+            slotOfTerm[termID] = slot;
+            termIDs.push_back(termID);
+            lists.push_back(TermPostings{{nullptr, nullptr}, {nullptr, nullptr}, 0, 0, 0, 0});
+        }
+        TermPostings& list = lists[slot];
+        uint32_t docID = static_cast<uint32_t>(posting.docID);
+        list.postingBytes += appendVarByte(list.postings, docID - list.lastDocID);
+        list.postingBytes += appendVarByte(list.postings, posting.termFreq);
+        list.lastDocID = docID;
+        list.count++;
+        postings++;
+        if (positions) {
+            uint32_t previous = 0;
+            for (int i = 0; i < posting.termFreq; ++i) {
+                list.positionBytes += appendVarByte(list.positions, positions[i] - previous);
+                previous = positions[i];
+            }
+        }
+    }
+
+    bool empty() const {
+        return termIDs.empty();
+    }
+
+    size_t postingCount() const {
+        return postings;
+    }
+
+    // Slots in lexicographic order of their terms
+    vector<uint32_t> sortedSlots(const TermDictionary& dictionary) const {
+        vector<uint32_t> order(termIDs.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return dictionary.term(termIDs[a]) < dictionary.term(termIDs[b]);
+        });
+        return order;
+    }
+
+    uint32_t termID(uint32_t slot) const {
+        return termIDs[slot];
+    }
+
+    const TermPostings& postingsOf(uint32_t slot) const {
+        return lists[slot];
+    }
+
+    // Calls f on each posting of a slot in docID order, decoding them
+    template <typename F>
+    void forEachPosting(uint32_t slot, F f) const {
+        SlabReader reader(lists[slot].postings);
+        Posting posting{0, 0};
+        for (uint32_t i = 0; i < lists[slot].count; ++i) {
+            posting.docID += static_cast<int>(reader.next());
+            posting.termFreq = static_cast<int>(reader.next());
+            f(static_cast<const Posting&>(posting));
+        }
+    }
+
+    // Calls f(data, length) on each slab of encoded bytes in a list, in order
+    template <typename F>
+    static void forEachSlab(const SlabList& list, F f) {
+        for (const ArenaSlab* slab = list.head; slab; slab = slab->next) {
+            f(slab->bytes(), slab->count);
+        }
+    }
+
+    // Bytes held by the slot tables and the arena, which keeps its pages between blocks
+    size_t bytesReserved() const {
+        return slotOfTerm.capacity() * sizeof(uint32_t) + termIDs.capacity() * sizeof(uint32_t)
+             + lists.capacity() * sizeof(TermPostings) + arena.bytesReserved();
+    }
+
+    // Drops every posting in O(1); only the slot table entries of touched terms are reset
+    void clear() {
+        for (uint32_t termID : termIDs) {
+            slotOfTerm[termID] = NO_SLOT;
+        }
+        termIDs.clear();
+        lists.clear();
+        arena.reset();
+        postings = 0;
+    }
+
+    // Drops every posting and frees the memory clear() keeps for the next block
+    void release() {
+        slotOfTerm = vector<uint32_t>();
+        termIDs = vector<uint32_t>();
+        lists = vector<TermPostings>();
+        arena.release();
+        postings = 0;
+    }
+
+private:
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    // Varbyte decoder over a slab list; a value may straddle two slabs
+    class SlabReader {
+    public:
+        explicit SlabReader(const SlabList& list) : slab(list.head), offset(0) {}
+
+        uint32_t next() {
+            uint32_t value = 0;
+            int shift = 0;
+            while (true) {
+                if (offset == slab->count) {
+                    slab = slab->next;
+                    offset = 0;
+                }
+                uint8_t byte = slab->bytes()[offset++];
+                value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    return value;
+                }
+                shift += 7;
+            }
+        }
+
+    private:
+        const ArenaSlab* slab;
+        uint32_t offset;
+    };
+
+    // Function to append a varbyte to a list, low 7 bits first; returns its length
+    uint32_t appendVarByte(SlabList& list, uint32_t value) {
+        if (list.tail && list.tail->capacity - list.tail->count >= 5) {
+            // Room for the longest varbyte: write it in place
+            uint8_t* out = list.tail->bytes() + list.tail->count;
+            uint32_t length = 0;
+            while (value > 0x7F) {
+                out[length++] = static_cast<uint8_t>(value & 0x7F) | 0x80;
+                value >>= 7;
+            }
+            out[length++] = static_cast<uint8_t>(value);
+            list.tail->count += length;
+            return length;
+        }
+        uint8_t bytes[5];
+        uint32_t length = 0;
+        while (value > 0x7F) {
+            bytes[length++] = static_cast<uint8_t>(value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+        bytes[length++] = static_cast<uint8_t>(value);
+        for (uint32_t i = 0; i < length; ++i) {
+            if (!list.tail || list.tail->count == list.tail->capacity) {
+                uint32_t capacity = list.tail ? min(list.tail->capacity * 2, ArenaSlab::MAX_SLAB_BYTES)
+                                              : ArenaSlab::MIN_SLAB_BYTES;
+                ArenaSlab* slab = static_cast<ArenaSlab*>(arena.allocate(sizeof(ArenaSlab) + capacity));
+                *slab = ArenaSlab{nullptr, capacity, 0};
+                if (list.tail) {
+                    list.tail->next = slab;
+                } else {
+                    list.head = slab;
+                }
+                list.tail = slab;
+            }
+            list.tail->bytes()[list.tail->count++] = bytes[i];
+        }
+        return length;
+    }
+
+    vector<uint32_t> slotOfTerm;  // Term ID -> slot, NO_SLOT if not in this block
+    vector<uint32_t> termIDs;     // Slot -> term ID
+    vector<TermPostings> lists;   // Slot -> compressed postings and positions
+    PostingArena arena;
+    size_t postings = 0;          // Postings added since the last clear
+};
+
+// Sort-based alternative to BlockIndex (--sort-inverter). Postings are appended as
+// (term ID, docID, frequency) triples to one flat array, and sortPostings() orders
+// them by term ID with an LSD radix sort whose passes are split over sortThreads
+// threads. Each pass is stable and a block's documents arrive in docID order, so every
+// term's postings stay in docID order and one linear scan finds where each term starts.
+// Positions are not recorded.
+class SortedBlockIndex {
+public:
+    explicit SortedBlockIndex(int sortThreads = 1) : sortThreads(max(1, sortThreads)) {}
+
+    // Adds a posting; postings of a term must come in increasing docID order
+    void addPosting(uint32_t termID, Posting posting, const uint32_t* = nullptr) {
+        triples.push_back(TermPosting{termID, static_cast<uint32_t>(posting.docID),
+                                      static_cast<uint32_t>(posting.termFreq)});
+        maxTermID = max(maxTermID, termID);
+    }
+
+    // Function to make room for more postings in the posting array and the sort's second
+    // array, so neither is grown by doubling
+    void reserve(size_t morePostings) {
+        triples.reserve(triples.size() + morePostings);
+        scratch.reserve(triples.size() + morePostings);
+    }
+
+    // Bytes the arrays hold after reserve(morePostings), to charge before allocating them
+    size_t bytesAfterReserve(size_t morePostings) const {
+        size_t postings = triples.size() + morePostings;
+        return (max(triples.capacity(), postings) + max(scratch.capacity(), postings)) * sizeof(TermPosting) +
+               ranges.capacity() * sizeof(TermRange);
+    }
+
+    // Function to sort the postings added since the last clear by term ID and find the
+    // terms' ranges; called once per block, before it is written
+    void sortPostings() {
+        scratch.resize(triples.size());
+        for (int shift = 0; shift < 32 && (maxTermID >> shift) != 0; shift += RADIX_BITS) {
+            radixPass(shift);
+            triples.swap(scratch);
+        }
+        ranges.clear();
+        for (uint32_t i = 0; i < triples.size(); ++i) {
+            if (i == 0 || triples[i].termID != triples[i - 1].termID) {
+                ranges.push_back(TermRange{triples[i].termID, i});
+            }
+        }
+    }
+
+    bool empty() const {
+        return triples.empty();
+    }
+
+    size_t postingCount() const {
+        return triples.size();
+    }
+
+    // Slots in lexicographic order of their terms; a slot is one term's range of postings
+    vector<uint32_t> sortedSlots(const TermDictionary& dictionary) const {
+        vector<uint32_t> order(ranges.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return dictionary.term(ranges[a].termID) < dictionary.term(ranges[b].termID);
+        });
+        return order;
+    }
+
+    uint32_t termID(uint32_t slot) const {
+        return ranges[slot].termID;
+    }
+
+    uint32_t postingCountOf(uint32_t slot) const {
+        return end(slot) - ranges[slot].begin;
+    }
+
+    // Calls f on each posting of a slot in docID order
+    template <typename F>
+    void forEachPosting(uint32_t slot, F f) const {
+        for (uint32_t i = ranges[slot].begin; i < end(slot); ++i) {
+            f(Posting{static_cast<int>(triples[i].docID), static_cast<int>(triples[i].termFreq)});
+        }
+    }
+
+    // Bytes held by the posting array, the sort's second array and the term ranges
+    size_t bytesReserved() const {
+        return (triples.capacity() + scratch.capacity()) * sizeof(TermPosting) + ranges.capacity() * sizeof(TermRange);
+    }
+
+    // Drops every posting, keeping the arrays for the next block
+    void clear() {
+        triples.clear();
+        ranges.clear();
+        maxTermID = 0;
+    }
+
+    // Drops every posting and frees the memory clear() keeps for the next block
+    void release() {
+        triples = vector<TermPosting>();
+        scratch = vector<TermPosting>();
+        ranges = vector<TermRange>();
+        maxTermID = 0;
+    }
+
+private:
+    static constexpr int RADIX_BITS = 11;
+    static constexpr size_t BUCKETS = size_t(1) << RADIX_BITS;
+    static constexpr size_t MIN_POSTINGS_PER_THREAD = 1 << 16;
+
+    struct TermPosting {
+        uint32_t termID;
+        uint32_t docID;
+        uint32_t termFreq;
+    };
+
+    struct TermRange {
+        uint32_t termID;
+        uint32_t begin; // Index of its first posting; it ends where the next range begins
+    };
+
+    uint32_t end(uint32_t slot) const {
+        return slot + 1 < ranges.size() ? ranges[slot + 1].begin : static_cast<uint32_t>(triples.size());
+    }
+
+    // Function to scatter triples into scratch by the RADIX_BITS bits of the term ID at
+    // shift. Each thread counts its own slice, then writes it behind the same bucket of
+    // the slices before it, which keeps the pass stable.
+    void radixPass(int shift) {
+        size_t n = triples.size();
+        int threads = static_cast<int>(min<size_t>(sortThreads, max<size_t>(1, n / MIN_POSTINGS_PER_THREAD)));
+        vector<vector<size_t>> offsets(threads, vector<size_t>(BUCKETS, 0));
+        auto forEachSlice = [&](auto f) {
+            vector<thread> helpers;
+            for (int t = 1; t < threads; ++t) {
+                helpers.emplace_back(f, t, n * t / threads, n * (t + 1) / threads);
+            }
+            f(0, 0, n / threads);
+            for (auto& helper : helpers) {
+                helper.join();
+            }
+        };
+
+        forEachSlice([&](int t, size_t begin, size_t end) {
+            vector<size_t>& counts = offsets[t];
+            for (size_t i = begin; i < end; ++i) {
+                counts[(triples[i].termID >> shift) & (BUCKETS - 1)]++;
+            }
+        });
+        size_t offset = 0;
+        for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            for (int t = 0; t < threads; ++t) {
+                size_t count = offsets[t][bucket];
+                offsets[t][bucket] = offset;
+                offset += count;
+            }
+        }
+        forEachSlice([&](int t, size_t begin, size_t end) {
+            vector<size_t>& next = offsets[t];
+            for (size_t i = begin; i < end; ++i) {
+                scratch[next[(triples[i].termID >> shift) & (BUCKETS - 1)]++] = triples[i];
+            }
+        });
+    }
+
+    int sortThreads;
+    vector<TermPosting> triples; // In arrival order until sorted, then by term ID
+    vector<TermPosting> scratch; // Target of each radix pass
+    vector<TermRange> ranges;    // Terms in term ID order, after sortPostings
+    uint32_t maxTermID = 0;
+};
+
+// Read-only mapping of the whole collection file
+class MappedFile {
+public:
+    explicit MappedFile(const string& filepath) : data(nullptr), size(0) {
+        int fd = open(filepath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Failed to open collection file: " + filepath);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error("Failed to stat collection file: " + filepath);
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size > 0) {
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("Failed to mmap collection file: " + filepath);
+            }
+            data = static_cast<const char*>(addr);
+            madvise(addr, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data) {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    string_view view() const {
+        return string_view(data, size);
+    }
+
+private:
+    const char* data;
+    size_t size;
+};
+
+// Blocking FIFO with a fixed capacity shared by the pipeline stages.
+// close() wakes every waiter; pop() keeps draining until the queue is empty.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    bool push(T item) {
+        unique_lock<mutex> lock(mtx);
+        notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        unique_lock<mutex> lock(mtx);
+        notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    mutex mtx;
+    condition_variable notFull;
+    condition_variable notEmpty;
+};
+
+// Keeps the first exception thrown by any pipeline thread so main can report it
+class PipelineError {
+public:
+    void set(exception_ptr error) {
+        lock_guard<mutex> lock(mtx);
+        if (!first) {
+            first = error;
+        }
+    }
+
+    void rethrowIfSet() {
+        lock_guard<mutex> lock(mtx);
+        if (first) {
+            rethrow_exception(first);
+        }
+    }
+
+private:
+    mutex mtx;
+    exception_ptr first;
+};
+
+mutex logMutex; // Serializes progress messages from the pipeline threads
+
+// Tokenizer kernels. A token is a maximal run of ASCII letters and digits, lowercased;
+// every other byte, including any byte of a non-ASCII character, separates tokens,
+// which is what isalnum/tolower give in the C locale. So a token can never hold a
+// non-ASCII byte and classification alone rejects them. Each kernel lowercases
+// text in place and appends views of its tokens; all kernels give identical output.
+typedef void (*TokenizerKernel)(char* text, size_t length, vector<string_view>& tokens);
+
+inline bool isTokenChar(unsigned char c) {
+    return static_cast<unsigned char>((c | 0x20) - 'a') < 26 || static_cast<unsigned char>(c - '0') < 10;
+}
+
+// Scalar tail shared by all kernels: continue from tokenStart (or -1 outside a token)
+inline void tokenizeScalarRange(char* text, size_t begin, size_t length, ptrdiff_t& tokenStart,
+                                vector<string_view>& tokens) {
+    for (size_t i = begin; i < length; ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (isTokenChar(c)) {
+            if (static_cast<unsigned char>((c | 0x20) - 'a') < 26) {
+                text[i] = static_cast<char>(c | 0x20);
+            }
+            if (tokenStart < 0) {
+                tokenStart = i;
+            }
+        } else if (tokenStart >= 0) {
+            tokens.emplace_back(text + tokenStart, i - tokenStart);
+            tokenStart = -1;
+        }
+    }
+}
+
+void tokenizeScalar(char* text, size_t length, vector<string_view>& tokens) {
+    ptrdiff_t tokenStart = -1;
+    tokenizeScalarRange(text, 0, length, tokenStart, tokens);
+    if (tokenStart >= 0) {
+        tokens.emplace_back(text + tokenStart, length - tokenStart);
+    }
+}
+
+#if defined(__x86_64__)
+// Walk the set bits of transitions, which alternate between token starts and ends
+inline void emitTokenBoundaries(char* text, size_t base, uint64_t transitions, ptrdiff_t& tokenStart,
+                                vector<string_view>& tokens) {
+    while (transitions) {
+        size_t pos = base + __builtin_ctzll(transitions);
+        if (tokenStart < 0) {
+            tokenStart = pos;
+        } else {
+            tokens.emplace_back(text + tokenStart, pos - tokenStart);
+            tokenStart = -1;
+        }
+        transitions &= transitions - 1;
+    }
+}
+
+__attribute__((target("avx2")))
+void tokenizeAVX2(char* text, size_t length, vector<string_view>& tokens) {
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    // Unsigned range checks via the signed compare: bias so the range starts at -128
+    const __m256i alphaBias = _mm256_set1_epi8(static_cast<char>(0x80 - 'a'));
+    const __m256i alphaLimit = _mm256_set1_epi8(static_cast<char>(0x80 + 26));
+    const __m256i digitBias = _mm256_set1_epi8(static_cast<char>(0x80 - '0'));
+    const __m256i digitLimit = _mm256_set1_epi8(static_cast<char>(0x80 + 10));
+
+    ptrdiff_t tokenStart = -1;
+    uint64_t previousBit = 0; // Whether the byte before this step was a token byte
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+        __m256i folded = _mm256_or_si256(bytes, caseBit);
+        __m256i isAlpha = _mm256_cmpgt_epi8(alphaLimit, _mm256_add_epi8(folded, alphaBias));
+        __m256i isDigit = _mm256_cmpgt_epi8(digitLimit, _mm256_add_epi8(bytes, digitBias));
+        __m256i lowered = _mm256_or_si256(bytes, _mm256_and_si256(isAlpha, caseBit));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(text + i), lowered);
+
+        uint64_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(isAlpha, isDigit)));
+        uint64_t transitions = (mask ^ ((mask << 1) | previousBit)) & 0xFFFFFFFFull;
+        emitTokenBoundaries(text, i, transitions, tokenStart, tokens);
+        previousBit = mask >> 31;
+    }
+    tokenizeScalarRange(text, i, length, tokenStart, tokens);
+    if (tokenStart >= 0) {
+        tokens.emplace_back(text + tokenStart, length - tokenStart);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void tokenizeAVX512(char* text, size_t length, vector<string_view>& tokens) {
+    const __m512i caseBit = _mm512_set1_epi8(0x20);
+    const __m512i alphaStart = _mm512_set1_epi8('a');
+    const __m512i alphaSpan = _mm512_set1_epi8(25);
+    const __m512i digitStart = _mm512_set1_epi8('0');
+    const __m512i digitSpan = _mm512_set1_epi8(9);
+
+    ptrdiff_t tokenStart = -1;
+    uint64_t previousBit = 0;
+    for (size_t i = 0; i < length; i += 64) {
+        // The last step loads only the remaining bytes, so there is no scalar tail
+        __mmask64 valid = (length - i >= 64) ? ~0ull : ((1ull << (length - i)) - 1);
+        __m512i bytes = _mm512_maskz_loadu_epi8(valid, text + i);
+        __m512i folded = _mm512_or_si512(bytes, caseBit);
+        __mmask64 isAlpha = _mm512_cmple_epu8_mask(_mm512_sub_epi8(folded, alphaStart), alphaSpan) & valid;
+        __mmask64 isDigit = _mm512_cmple_epu8_mask(_mm512_sub_epi8(bytes, digitStart), digitSpan) & valid;
+        _mm512_mask_storeu_epi8(text + i, isAlpha, folded);
+
+        uint64_t mask = isAlpha | isDigit;
+        uint64_t transitions = mask ^ ((mask << 1) | previousBit);
+        emitTokenBoundaries(text, i, transitions, tokenStart, tokens);
+        previousBit = mask >> 63;
+    }
+    if (tokenStart >= 0) {
+        tokens.emplace_back(text + tokenStart, length - tokenStart);
+    }
+}
+#endif
+
+// Function to pick a tokenizer kernel by name; "auto" takes the widest one the CPU supports
+TokenizerKernel selectTokenizerKernel(const string& name) {
+#if defined(__x86_64__)
+    bool hasAVX2 = __builtin_cpu_supports("avx2");
+    bool hasAVX512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    if (name == "avx512" && hasAVX512) return tokenizeAVX512;
+    if (name == "avx2" && hasAVX2) return tokenizeAVX2;
+    if (name == "auto") {
+        if (hasAVX512) return tokenizeAVX512;
+        if (hasAVX2) return tokenizeAVX2;
+    }
+#endif
+    if (name == "scalar" || name == "auto") return tokenizeScalar;
+    throw runtime_error("Tokenizer kernel not supported on this machine: " + name);
+}
+
+TokenizerKernel tokenizerKernel = tokenizeScalar;
+
+// Function to tokenize text.
+// The passage is appended to tokenBytes, lowercased there, and tokens are returned as
+// views into it, which stay valid until tokenBytes is next modified.
+void tokenize(string_view text, string& tokenBytes, vector<string_view>& tokens) {
+    size_t start = tokenBytes.size();
+    tokenBytes.append(text);
+    tokenizerKernel(tokenBytes.data() + start, text.size(), tokens);
+}
+
+// Function to write intermediate posting file in text format, from a BlockIndex or a
+// SortedBlockIndex
+template <typename Index>
+void writeTextPostingFile(const string& filename,
+                          const Index& invertedIndex,
+                          const TermDictionary& dictionary) {
+    ofstream outfile(filename);
+    if (!outfile.is_open()) {
+        throw runtime_error("Failed to open text intermediate file for writing: " + filename);
+    }
+
+    for (uint32_t slot : invertedIndex.sortedSlots(dictionary)) {
+        // Write the term
+        outfile << dictionary.term(invertedIndex.termID(slot));
+
+        // Write each posting as docID:termFreq separated by space
+        invertedIndex.forEachPosting(slot, [&](const Posting& posting) {
+            outfile << " " << posting.docID << ":" << posting.termFreq;
+        });
+
+        // End the line for the current term
+        outfile << "\n";
+    }
+    outfile.close();
+}
+
+// Buffered writer for binary runs: fills page-aligned buffers and writes them whole
+class RunFileWriter {
+public:
+    explicit RunFileWriter(const string& filename)
+        : filename(filename),
+          buffer(static_cast<uint8_t*>(aligned_alloc(4096, RUN_WRITE_BUFFER_SIZE)), free),
+          used(0) {
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !buffer) {
+            throw runtime_error("Failed to open binary intermediate file for writing: " + filename);
+        }
+    }
+
+    ~RunFileWriter() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    RunFileWriter(const RunFileWriter&) = delete;
+    RunFileWriter& operator=(const RunFileWriter&) = delete;
+
+    void write(const void* data, size_t length) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        while (length > 0) {
+            size_t n = min(length, RUN_WRITE_BUFFER_SIZE - used);
+            memcpy(buffer.get() + used, bytes, n);
+            used += n;
+            bytes += n;
+            length -= n;
+            if (used == RUN_WRITE_BUFFER_SIZE) {
+                flush();
+            }
+        }
+    }
+
+    void writeUint32(uint32_t value) {
+        write(&value, sizeof(value));
+    }
+
+    void close() {
+        flush();
+        if (::close(fd) != 0) {
+            fd = -1;
+            throw runtime_error("Failed to close binary intermediate file: " + filename);
+        }
+        fd = -1;
+    }
+
+private:
+    void flush() {
+        size_t offset = 0;
+        while (offset < used) {
+            ssize_t n = ::write(fd, buffer.get() + offset, used - offset);
+            if (n < 0) {
+                throw runtime_error("Failed to write binary intermediate file: " + filename);
+            }
+            offset += n;
+        }
+        used = 0;
+    }
+
+    string filename;
+    int fd;
+    unique_ptr<uint8_t, void (*)(void*)> buffer;
+    size_t used;
+};
+
+// Function to write intermediate posting file in binary format.
+// After an 8-byte magic, each term is stored as
+//   uint32 termLength, term bytes, uint32 postingCount, uint32 payloadBytes,
+//   payload: varbyte(docID gap) varbyte(termFreq) per posting
+// Gaps are taken from the previous posting of the term, starting from 0, modulo 2^32.
+// Positional runs (POSITIONAL_RUN_FILE_MAGIC) follow the payload of each term with
+//   uint32 positionBytes, varbyte positions: termFreq per posting, each the gap
+//   from the previous position of the same posting, the first one as is
+void writeBinaryPostingFile(const string& filename,
+                            const BlockIndex& invertedIndex,
+                            const TermDictionary& dictionary,
+                            bool withPositions) {
+    RunFileWriter outfile(filename);
+    outfile.write(withPositions ? POSITIONAL_RUN_FILE_MAGIC : RUN_FILE_MAGIC, sizeof(RUN_FILE_MAGIC));
+
+    // The block index holds each term's payload in this layout already
+    for (uint32_t slot : invertedIndex.sortedSlots(dictionary)) {
+        string_view term = dictionary.term(invertedIndex.termID(slot));
+        const TermPostings& list = invertedIndex.postingsOf(slot);
+        outfile.writeUint32(term.size());
+        outfile.write(term.data(), term.size());
+        outfile.writeUint32(list.count);
+        outfile.writeUint32(list.postingBytes);
+        BlockIndex::forEachSlab(list.postings, [&](const uint8_t* bytes, size_t length) {
+            outfile.write(bytes, length);
+        });
+        if (withPositions) {
+            outfile.writeUint32(list.positionBytes);
+            BlockIndex::forEachSlab(list.positions, [&](const uint8_t* bytes, size_t length) {
+                outfile.write(bytes, length);
+            });
+        }
+    }
+    outfile.close();
+}
+
+// Function to write a sorted block as a binary run in the layout above. Its postings
+// are raw, so each term's payload is encoded here.
+void writeBinaryPostingFile(const string& filename,
+                            const SortedBlockIndex& invertedIndex,
+                            const TermDictionary& dictionary,
+                            bool withPositions) {
+    if (withPositions) {
+        throw runtime_error("Sort-based blocks hold no positions: " + filename);
+    }
+    RunFileWriter outfile(filename);
+    outfile.write(RUN_FILE_MAGIC, sizeof(RUN_FILE_MAGIC));
+
+    vector<uint8_t> payload;
+    for (uint32_t slot : invertedIndex.sortedSlots(dictionary)) {
+        string_view term = dictionary.term(invertedIndex.termID(slot));
+        payload.clear();
+        uint32_t previousDocID = 0;
+        invertedIndex.forEachPosting(slot, [&](const Posting& posting) {
+            appendVarByte(payload, static_cast<uint32_t>(posting.docID) - previousDocID);
+            appendVarByte(payload, static_cast<uint32_t>(posting.termFreq));
+            previousDocID = static_cast<uint32_t>(posting.docID);
+        });
+        outfile.writeUint32(term.size());
+        outfile.write(term.data(), term.size());
+        outfile.writeUint32(invertedIndex.postingCountOf(slot));
+        outfile.writeUint32(payload.size());
+        outfile.write(payload.data(), payload.size());
+    }
+    outfile.close();
+}
+
+// Compression of a collection, recognized from its first bytes
+enum class Compression { None, Gzip, Zstd };
+
+// Raw bytes of the collection file, or of stdin for "-". The first bytes are read
+// ahead to recognize the compression and are handed out again by read().
+class RawInput {
+public:
+    explicit RawInput(const string& inputFilePath) : fd(0), ownsFd(false), prefixPos(0) {
+        if (inputFilePath != "-") {
+            fd = open(inputFilePath.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw runtime_error("Failed to open collection file: " + inputFilePath);
+            }
+            ownsFd = true;
+        }
+        char magic[4];
+        size_t magicBytes = readFd(magic, sizeof(magic));
+        prefix.assign(magic, magicBytes);
+    }
+
+    ~RawInput() {
+        if (ownsFd) {
+            close(fd);
+        }
+    }
+
+    RawInput(const RawInput&) = delete;
+    RawInput& operator=(const RawInput&) = delete;
+
+    Compression compression() const {
+        if (prefix.size() >= 2 && uint8_t(prefix[0]) == 0x1F && uint8_t(prefix[1]) == 0x8B) {
+            return Compression::Gzip;
+        }
+        if (prefix.size() >= 4 && uint8_t(prefix[0]) == 0x28 && uint8_t(prefix[1]) == 0xB5
+            && uint8_t(prefix[2]) == 0x2F && uint8_t(prefix[3]) == 0xFD) {
+            return Compression::Zstd;
+        }
+        return Compression::None;
+    }
+
+    // Bytes read from the file or pipe so far, before any decompression
+    size_t bytesRead() const {
+        return bytesFromFd;
+    }
+
+    // Reads up to length bytes; returns 0 at end of input
+    size_t read(char* buffer, size_t length) {
+        if (prefixPos < prefix.size()) {
+            size_t count = min(length, prefix.size() - prefixPos);
+            memcpy(buffer, prefix.data() + prefixPos, count);
+            prefixPos += count;
+            return count;
+        }
+        return readFd(buffer, length);
+    }
+
+    // Skips length bytes, seeking when the input is a file and reading through them otherwise
+    void skip(size_t length) {
+        size_t fromPrefix = min(length, prefix.size() - prefixPos);
+        prefixPos += fromPrefix;
+        length -= fromPrefix;
+        if (length > 0 && lseek(fd, static_cast<off_t>(length), SEEK_CUR) >= 0) {
+            bytesFromFd += length;
+            return;
+        }
+        vector<char> buffer(min<size_t>(length, 1 << 20));
+        while (length > 0) {
+            size_t count = read(buffer.data(), min(length, buffer.size()));
+            if (count == 0) {
+                break;
+            }
+            length -= count;
+        }
+    }
+
+private:
+    size_t readFd(char* buffer, size_t length) {
+        size_t total = 0;
+        while (total < length) {
+            ssize_t count = ::read(fd, buffer + total, length - total);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                throw runtime_error(string("Failed to read collection: ") + strerror(errno));
+            }
+            if (count == 0) {
+                break;
+            }
+            total += count;
+        }
+        bytesFromFd += total;
+        return total;
+    }
+
+    int fd;
+    bool ownsFd;
+    string prefix;
+    size_t prefixPos;
+    atomic<size_t> bytesFromFd{0}; // Read by the reader while the decompressor thread reads input
+};
+
+// Bounded ring of bytes between the decompression thread and the chunk reader.
+// write() waits for room, read() waits for data; an error set by the writer is
+// rethrown to the reader once the bytes before it are consumed.
+class ByteRing {
+public:
+    explicit ByteRing(size_t capacity) : buffer(capacity), head(0), used(0), closed(false) {
+        memoryBudget.charge(capacity);
+    }
+
+    ~ByteRing() {
+        memoryBudget.release(buffer.size());
+    }
+
+    // Returns false if the reader has gone away
+    bool write(const char* data, size_t length) {
+        while (length > 0) {
+            unique_lock<mutex> lock(mtx);
+            notFull.wait(lock, [&] { return closed || used < buffer.size(); });
+            if (closed) {
+                return false;
+            }
+            size_t tail = (head + used) % buffer.size();
+            size_t count = min({length, buffer.size() - used, buffer.size() - tail});
+            memcpy(buffer.data() + tail, data, count);
+            used += count;
+            data += count;
+            length -= count;
+            notEmpty.notify_one();
+        }
+        return true;
+    }
+
+    size_t read(char* data, size_t length) {
+        unique_lock<mutex> lock(mtx);
+        notEmpty.wait(lock, [&] { return closed || used > 0; });
+        if (used == 0) {
+            if (error) {
+                rethrow_exception(error);
+            }
+            return 0;
+        }
+        size_t count = min({length, used, buffer.size() - head});
+        memcpy(data, buffer.data() + head, count);
+        head = (head + count) % buffer.size();
+        used -= count;
+        notFull.notify_one();
+        return count;
+    }
+
+    void close(exception_ptr failure = nullptr) {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        error = failure;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    vector<char> buffer;
+    size_t head;
+    size_t used;
+    bool closed;
+    exception_ptr error;
+    mutex mtx;
+    condition_variable notFull;
+    condition_variable notEmpty;
+};
+
+// Function to inflate gzip input into the ring. Concatenated gzip members, as
+// written by pigz or by appending .gz files, are inflated one after another.
+void inflateGzip(RawInput& input, ByteRing& ring) {
+    z_stream stream{};
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+        throw runtime_error("Failed to initialize gzip decompression");
+    }
+    unique_ptr<z_stream, int (*)(z_stream*)> guard(&stream, inflateEnd);
+
+    vector<char> in(1 << 20);
+    vector<char> out(1 << 20);
+    int status = Z_OK;
+    while (true) {
+        if (stream.avail_in == 0) {
+            stream.avail_in = input.read(in.data(), in.size());
+            stream.next_in = reinterpret_cast<Bytef*>(in.data());
+            if (stream.avail_in == 0) {
+                break;
+            }
+        }
+        if (status == Z_STREAM_END) {
+            inflateReset(&stream);
+        }
+        stream.next_out = reinterpret_cast<Bytef*>(out.data());
+        stream.avail_out = out.size();
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) {
+            throw runtime_error(string("Corrupt gzip collection: ") + (stream.msg ? stream.msg : "inflate failed"));
+        }
+        if (!ring.write(out.data(), out.size() - stream.avail_out)) {
+            return;
+        }
+    }
+    if (status != Z_STREAM_END) {
+        throw runtime_error("Truncated gzip collection");
+    }
+}
+
+#ifdef WITH_ZSTD
+// Function to decompress zstd input into the ring with libzstd
+void decompressZstd(RawInput& input, ByteRing& ring) {
+    unique_ptr<ZSTD_DStream, size_t (*)(ZSTD_DStream*)> stream(ZSTD_createDStream(), ZSTD_freeDStream);
+    if (!stream || ZSTD_isError(ZSTD_initDStream(stream.get()))) {
+        throw runtime_error("Failed to initialize zstd decompression");
+    }
+    vector<char> in(ZSTD_DStreamInSize());
+    vector<char> out(ZSTD_DStreamOutSize());
+    size_t remaining = 0; // Nonzero while a frame is incomplete
+    size_t bytesRead;
+    while ((bytesRead = input.read(in.data(), in.size())) > 0) {
+        ZSTD_inBuffer inBuffer{in.data(), bytesRead, 0};
+        while (inBuffer.pos < inBuffer.size) {
+            ZSTD_outBuffer outBuffer{out.data(), out.size(), 0};
+            remaining = ZSTD_decompressStream(stream.get(), &outBuffer, &inBuffer);
+            if (ZSTD_isError(remaining)) {
+                throw runtime_error(string("Corrupt zstd collection: ") + ZSTD_getErrorName(remaining));
+            }
+            if (!ring.write(out.data(), outBuffer.pos)) {
+                return;
+            }
+        }
+    }
+    // Flush what the decoder still holds for the last frame
+    while (remaining != 0) {
+        ZSTD_inBuffer inBuffer{in.data(), 0, 0};
+        ZSTD_outBuffer outBuffer{out.data(), out.size(), 0};
+        remaining = ZSTD_decompressStream(stream.get(), &outBuffer, &inBuffer);
+        if (ZSTD_isError(remaining) || outBuffer.pos == 0) {
+            throw runtime_error("Truncated zstd collection");
+        }
+        if (!ring.write(out.data(), outBuffer.pos)) {
+            return;
+        }
+    }
+}
+#else
+// Function to decompress zstd input into the ring through the zstd command, for
+// builds without libzstd. A feeder thread copies the input to its stdin.
+void decompressZstd(RawInput& input, ByteRing& ring) {
+    // A write to zstd after it exits must fail with EPIPE instead of killing the indexer
+    signal(SIGPIPE, SIG_IGN);
+    int toChild[2];
+    int fromChild[2];
+    if (pipe(toChild) != 0 || pipe(fromChild) != 0) {
+        throw runtime_error("Failed to create pipes for zstd");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw runtime_error("Failed to start zstd");
+    }
+    if (pid == 0) {
+        dup2(toChild[0], STDIN_FILENO);
+        dup2(fromChild[1], STDOUT_FILENO);
+        close(toChild[0]);
+        close(toChild[1]);
+        close(fromChild[0]);
+        close(fromChild[1]);
+        execlp("zstd", "zstd", "-dcq", nullptr);
+        _exit(127);
+    }
+    close(toChild[0]);
+    close(fromChild[1]);
+
+    exception_ptr feedError;
+    thread feeder([&] {
+        try {
+            vector<char> buffer(1 << 20);
+            size_t bytesRead;
+            while ((bytesRead = input.read(buffer.data(), buffer.size())) > 0) {
+                for (size_t written = 0; written < bytesRead;) {
+                    ssize_t count = ::write(toChild[1], buffer.data() + written, bytesRead - written);
+                    if (count < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (count < 0) {
+                        throw runtime_error("zstd stopped reading the collection");
+                    }
+                    written += count;
+                }
+            }
+        } catch (...) {
+            feedError = current_exception();
+        }
+        close(toChild[1]);
+    });
+
+    vector<char> out(1 << 20);
+    bool readerGone = false;
+    while (true) {
+        ssize_t count = ::read(fromChild[0], out.data(), out.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        if (!ring.write(out.data(), count)) {
+            readerGone = true;
+            break;
+        }
+    }
+    close(fromChild[0]); // Unblocks the child, and through it the feeder, if we stopped early
+    feeder.join();
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (readerGone) {
+        return;
+    }
+    if (feedError) {
+        rethrow_exception(feedError);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw runtime_error("zstd failed to decompress the collection");
+    }
+}
+#endif
+
+// Bytes of the collection as text. Compressed input is decompressed on a thread
+// of its own into a bounded ring, so decompression overlaps with indexing.
+class CollectionStream {
+public:
+    explicit CollectionStream(const string& inputFilePath)
+        : input(inputFilePath), compression(input.compression()), textBytes(0) {
+        if (compression != Compression::None) {
+            ring = make_unique<ByteRing>(DECOMPRESS_RING_SIZE);
+            decompressor = thread([this] {
+                try {
+                    if (compression == Compression::Gzip) {
+                        inflateGzip(input, *ring);
+                    } else {
+                        decompressZstd(input, *ring);
+                    }
+                    ring->close();
+                } catch (...) {
+                    ring->close(current_exception());
+                }
+            });
+        }
+    }
+
+    ~CollectionStream() {
+        if (ring) {
+            ring->close(); // Stops the decompressor if indexing ended early
+            decompressor.join();
+        }
+    }
+
+    // Reads up to length bytes of text; returns 0 at end of input
+    size_t read(char* buffer, size_t length) {
+        size_t count = ring ? ring->read(buffer, length) : input.read(buffer, length);
+        textBytes += count;
+        return count;
+    }
+
+    // Skips length bytes of text, e.g. the part of the collection a resumed run already indexed
+    void skip(size_t length) {
+        if (!ring) {
+            input.skip(length);
+            return;
+        }
+        vector<char> buffer(min<size_t>(length, 1 << 20));
+        while (length > 0) {
+            size_t count = ring->read(buffer.data(), min(length, buffer.size()));
+            if (count == 0) {
+                break;
+            }
+            length -= count;
+        }
+    }
+
+    const char* compressionName() const {
+        return compression == Compression::Gzip ? "gzip" : compression == Compression::Zstd ? "zstd" : "none";
+    }
+
+    size_t bytesOfText() const {
+        return textBytes;
+    }
+
+    size_t bytesOfInput() const {
+        return input.bytesRead();
+    }
+
+private:
+    RawInput input;
+    Compression compression;
+    size_t textBytes;
+    unique_ptr<ByteRing> ring;
+    thread decompressor;
+};
+
+// Function to check that the collection can be parsed in place from a mapping
+bool isMappable(const string& inputFilePath) {
+    struct stat st;
+    if (inputFilePath == "-" || stat(inputFilePath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    return RawInput(inputFilePath).compression() == Compression::None;
+}
+
+// Reader stage: cut the collection into chunks that end on a line boundary, starting
+// startOffset bytes into its text
+void readCollectionChunks(const string& inputFilePath, size_t chunkSize, size_t startOffset,
+                          BoundedQueue<InputChunk>& chunkQueue) {
+    CollectionStream infile(inputFilePath);
+    auto startTime = chrono::steady_clock::now();
+    infile.skip(startOffset);
+
+    size_t sequence = 0;
+    size_t offset = startOffset; // Text offset of the next chunk
+    string carry; // Partial last line of the previous read
+    vector<char> buffer(chunkSize);
+    size_t bytesRead;
+    auto readStart = chrono::steady_clock::now(); // Time waiting on a full queue is not read time
+    while ((bytesRead = infile.read(buffer.data(), buffer.size())) > 0) {
+        string text = std::move(carry);
+        text.append(buffer.data(), bytesRead);
+        size_t lastNewline = text.rfind('\n');
+        if (lastNewline == string::npos) {
+            carry = std::move(text);
+            continue;
+        }
+        carry = text.substr(lastNewline + 1);
+        text.resize(lastNewline + 1);
+
+        // The worker that parses the chunk releases this charge
+        memoryBudget.charge(text.capacity());
+        metrics.record(STAGE_READ, chrono::steady_clock::now() - readStart, 1, 0, text.size());
+        offset += text.size();
+        if (!chunkQueue.push(InputChunk{sequence++, offset - text.size(), std::move(text), {}})) {
+            return;
+        }
+        readStart = chrono::steady_clock::now();
+    }
+    // The collection may not end with a newline
+    if (!carry.empty()) {
+        memoryBudget.charge(carry.capacity());
+        metrics.record(STAGE_READ, chrono::steady_clock::now() - readStart, 1, 0, carry.size());
+        chunkQueue.push(InputChunk{sequence++, offset, std::move(carry), {}});
+    }
+    metrics.add(STAGE_READ, 0, infile.bytesOfInput());
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - startTime;
+    lock_guard<mutex> lock(logMutex);
+    cout << "Read " << infile.bytesOfText() / (1024 * 1024) << " MB of text in " << elapsed.count()
+         << " seconds (compression: " << infile.compressionName() << ")" << endl;
+}
+
+// Reader stage for mmap mode: hand out views of the mapping from startOffset on, no
+// bytes are copied
+void readMappedChunks(const MappedFile& collection, size_t chunkSize, size_t startOffset,
+                      BoundedQueue<InputChunk>& chunkQueue) {
+    string_view text = collection.view();
+    size_t sequence = 0;
+    size_t chunkStart = min(startOffset, text.size());
+    while (chunkStart < text.size()) {
+        auto readStart = chrono::steady_clock::now();
+        size_t chunkEnd = min(text.size(), chunkStart + chunkSize);
+        if (chunkEnd < text.size()) {
+            size_t newline = text.find('\n', chunkEnd - 1);
+            chunkEnd = (newline == string_view::npos) ? text.size() : newline + 1;
+        }
+        metrics.record(STAGE_READ, chrono::steady_clock::now() - readStart, 1,
+                       chunkEnd - chunkStart, chunkEnd - chunkStart);
+        if (!chunkQueue.push(InputChunk{sequence++, chunkStart, {}, text.substr(chunkStart, chunkEnd - chunkStart)})) {
+            return;
+        }
+        chunkStart = chunkEnd;
+    }
+}
+
+// Function to parse a docID field the way stoll does, without building a string
+int64_t parseDocID(string_view field) {
+    size_t start = 0;
+    while (start < field.size() && std::isspace(static_cast<unsigned char>(field[start]))) {
+        start++;
+    }
+    if (start < field.size() && field[start] == '+') {
+        start++;
+    }
+    int64_t docID = 0;
+    auto [ptr, ec] = from_chars(field.data() + start, field.data() + field.size(), docID);
+    if (ec != errc()) {
+        throw runtime_error("Invalid docID: " + string(field));
+    }
+    return docID;
+}
+
+// Tokenizer stage: split a chunk into documents, intern their tokens and count the
+// term IDs of each one, keeping their token positions if recordPositions is set
+ParsedChunk parseChunk(const InputChunk& chunk, TermIDCache& termIDs, bool recordPositions) {
+    string_view text = chunk.text();
+    ParsedChunk parsed{chunk.sequence, {}};
+
+    string tokenBytes;
+    vector<string_view> tokens;
+    TermCounter termCounter;
+    vector<pair<uint32_t, uint32_t>> termPositions; // (term ID, position) of every token
+    vector<uint8_t> encodedTerms; // Term frequencies of the current document, copied out at their exact size
+    size_t parsedBytes = 0;
+    size_t lineStart = 0;
+    // Stage times are summed here and recorded once per chunk
+    chrono::steady_clock::duration tokenizeTime{0};
+    chrono::steady_clock::duration countTime{0};
+    size_t tokenCount = 0;
+    size_t passageBytes = 0;
+    auto lap = chrono::steady_clock::now();
+    while (lineStart < text.size()) {
+        size_t lineEnd = text.find('\n', lineStart);
+        if (lineEnd == string_view::npos) {
+            lineEnd = text.size();
+        }
+        string_view line = text.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+
+        // Split the line into docID and passage
+        size_t tabPos = line.find('\t');
+        if (tabPos == string_view::npos) {
+            continue; // Skip malformed lines
+        }
+        int64_t externalID = parseDocID(line.substr(0, tabPos));
+        string_view passage = line.substr(tabPos + 1);
+
+        // Tokenize the passage
+        tokenBytes.clear();
+        tokens.clear();
+        tokenize(passage, tokenBytes, tokens);
+        auto tokenized = chrono::steady_clock::now();
+        tokenizeTime += tokenized - lap;
+        tokenCount += tokens.size();
+        passageBytes += passage.size();
+
+        ParsedDocument doc{0, externalID, chunk.offset + min(lineStart, text.size()), tokens.size(), {}, {}, 0};
+        if (recordPositions) {
+            // Group the positions by term; sorting keeps each term's positions in order
+            termPositions.clear();
+            for (uint32_t position = 0; position < tokens.size(); ++position) {
+                termPositions.emplace_back(termIDs.lookup(tokens[position]), position);
+            }
+            sort(termPositions.begin(), termPositions.end());
+            doc.positions.reserve(termPositions.size());
+            encodedTerms.clear();
+            for (size_t first = 0; first < termPositions.size();) {
+                size_t last = first;
+                while (last < termPositions.size() && termPositions[last].first == termPositions[first].first) {
+                    doc.positions.push_back(termPositions[last++].second);
+                }
+                appendVarByte(encodedTerms, termPositions[first].first);
+                appendVarByte(encodedTerms, static_cast<uint32_t>(last - first));
+                first = last;
+            }
+        } else {
+            // Count term frequencies in the current document
+            termCounter.clear();
+            for (const auto& token : tokens) {
+                termCounter.add(termIDs.lookup(token));
+            }
+            encodedTerms.clear();
+            termCounter.encodeTo(encodedTerms);
+        }
+        doc.termFreqs.assign(encodedTerms.begin(), encodedTerms.end());
+        doc.bytes = sizeof(ParsedDocument) + doc.termFreqs.capacity() + doc.positions.capacity() * sizeof(uint32_t);
+        parsedBytes += doc.bytes;
+        parsed.docs.push_back(std::move(doc));
+        lap = chrono::steady_clock::now();
+        countTime += lap - tokenized;
+    }
+    // Released by the inverter once the documents are in its block index
+    memoryBudget.charge(parsedBytes);
+    metrics.record(STAGE_TOKENIZE, tokenizeTime, tokenCount, passageBytes);
+    metrics.record(STAGE_COUNT, countTime, parsed.docs.size(), 0, parsedBytes);
+    return parsed;
+}
+
+// Inverter stage: build the in-memory index of one block, a BlockIndex or a SortedBlockIndex.
+// Blocks are cut in input order, so every run holds increasing docIDs per term.
+// indexCharged is what this block index currently has charged to the budget.
+template <typename Index>
+void invertBlock(Block& block, Index& invertedIndex, size_t& indexCharged) {
+    auto invertStart = chrono::steady_clock::now();
+    size_t postingsBefore = invertedIndex.postingCount();
+    size_t docsAdded = 0;
+    if constexpr (is_same_v<Index, SortedBlockIndex>) {
+        // Every varbyte has one byte without the high bit, and a posting is two of them
+        size_t varBytes = 0;
+        for (const auto& doc : block.docs) {
+            for (uint8_t byte : doc.termFreqs) {
+                varBytes += !(byte & 0x80);
+            }
+        }
+        memoryBudget.update(indexCharged, invertedIndex.bytesAfterReserve(varBytes / 2));
+        invertedIndex.reserve(varBytes / 2);
+    }
+    for (const auto& doc : block.docs) {
+        const uint32_t* positions = doc.positions.empty() ? nullptr : doc.positions.data();
+        const uint8_t* p = doc.termFreqs.data();
+        const uint8_t* end = p + doc.termFreqs.size();
+        while (p < end) {
+            uint32_t termID = readVarByte(p);
+            int freq = static_cast<int>(readVarByte(p));
+            invertedIndex.addPosting(termID, Posting{doc.docID, freq}, positions);
+            if (positions) {
+                positions += freq;
+            }
+        }
+        if (++docsAdded % 4096 == 0) {
+            memoryBudget.update(indexCharged, invertedIndex.bytesReserved());
+        }
+    }
+    if constexpr (is_same_v<Index, SortedBlockIndex>) {
+        invertedIndex.sortPostings();
+    }
+    memoryBudget.update(indexCharged, invertedIndex.bytesReserved());
+    block.docs.clear();
+    block.docs.shrink_to_fit();
+    memoryBudget.release(block.bytes);
+    metrics.record(STAGE_INVERT, chrono::steady_clock::now() - invertStart,
+                   invertedIndex.postingCount() - postingsBefore, block.bytes);
+}
+
+// Time spent writing runs and time inverters spent waiting on their writers, in microseconds.
+// Whatever part of the write time nobody waited for overlapped with parsing.
+struct FlushStats {
+    atomic<long long> writeMicros{0};
+    atomic<long long> stallMicros{0};
+};
+
+// Function to force a file, or a directory's entries, to disk
+void syncPath(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw runtime_error("Failed to sync " + path + ": " + strerror(errno));
+    }
+    close(fd);
+}
+
+// Progress of an indexing run that survives a crash, kept in checkpoint.txt next to the
+// runs as "key value" lines. Runs intermediate_0 .. blocks-1 are on disk and hold the
+// first `documents` documents, which are every document before inputOffset in the
+// collection's text; the page table holds their pageTableBytes bytes and the docID map
+// their entries.
+struct IndexCheckpoint {
+    string input;            // Collection being indexed
+    string runFormat;        // text, binary or positional
+    size_t inputOffset = 0;
+    int blocks = 0;
+    int documents = 0;
+    size_t pageTableBytes = 0;
+
+    // Function to read a checkpoint; returns false if there is none
+    static bool load(const string& path, IndexCheckpoint& checkpoint) {
+        ifstream file(path);
+        if (!file.is_open()) {
+            return false;
+        }
+        string line;
+        int fields = 0;
+        while (getline(file, line)) {
+            size_t space = line.find(' ');
+            string key = line.substr(0, space);
+            string value = space == string::npos ? "" : line.substr(space + 1);
+            fields++;
+            if (key == "input") {
+                checkpoint.input = value;
+            } else if (key == "format") {
+                checkpoint.runFormat = value;
+            } else if (key == "offset") {
+                checkpoint.inputOffset = stoull(value);
+            } else if (key == "blocks") {
+                checkpoint.blocks = stoi(value);
+            } else if (key == "documents") {
+                checkpoint.documents = stoi(value);
+            } else if (key == "pagetable") {
+                checkpoint.pageTableBytes = stoull(value);
+            } else {
+                fields--;
+            }
+        }
+        if (fields != 6) {
+            throw runtime_error("Incomplete checkpoint: " + path);
+        }
+        return true;
+    }
+
+    // Function to replace the checkpoint at path; the rename makes the switch atomic
+    void save(const string& path) const {
+        string tempPath = path + ".tmp";
+        ofstream file(tempPath);
+        file << "input " << input << "\n"
+             << "format " << runFormat << "\n"
+             << "offset " << inputOffset << "\n"
+             << "blocks " << blocks << "\n"
+             << "documents " << documents << "\n"
+             << "pagetable " << pageTableBytes << "\n";
+        file.close();
+        if (file.fail()) {
+            throw runtime_error("Failed to write checkpoint: " + tempPath);
+        }
+        syncPath(tempPath);
+        fs::rename(tempPath, path);
+        syncPath(fs::path(path).parent_path().string());
+    }
+};
+
+// Commits checkpoints as runs reach the disk. The sequencer notes where each block ends
+// with blockCut(), run writers report synced runs with runWritten(), and commit() saves a
+// checkpoint for the longest prefix of blocks whose runs are all written. Runs finish out
+// of order when there are several inverters.
+class CheckpointTracker {
+public:
+    CheckpointTracker(string path, IndexCheckpoint start) : path(std::move(path)), committed(std::move(start)) {}
+
+    void blockCut(int blockID, size_t inputOffset, int documents, size_t pageTableBytes) {
+        lock_guard<mutex> lock(mtx);
+        cuts[blockID] = {inputOffset, documents, pageTableBytes, false};
+    }
+
+    void runWritten(int blockID) {
+        lock_guard<mutex> lock(mtx);
+        cuts[blockID].written = true;
+    }
+
+    // Function to save a checkpoint if more blocks are complete; syncOutputs must make the
+    // page table and docID map durable up to the current position first
+    void commit(const function<void()>& syncOutputs) {
+        IndexCheckpoint next;
+        {
+            lock_guard<mutex> lock(mtx);
+            next = committed;
+            for (auto it = cuts.find(next.blocks); it != cuts.end() && it->second.written;
+                 it = cuts.find(next.blocks)) {
+                next.inputOffset = it->second.inputOffset;
+                next.documents = it->second.documents;
+                next.pageTableBytes = it->second.pageTableBytes;
+                next.blocks++;
+                cuts.erase(it);
+            }
+        }
+        if (next.blocks == committed.blocks) {
+            return;
+        }
+        syncOutputs();
+        next.save(path);
+        committed = next;
+    }
+
+private:
+    struct Cut {
+        size_t inputOffset;
+        int documents;
+        size_t pageTableBytes;
+        bool written;
+    };
+
+    string path;
+    IndexCheckpoint committed; // Only touched by the sequencer
+    map<int, Cut> cuts;        // Blocks past the checkpoint
+    mutex mtx;
+};
+
+// Background writer paired with one inverter. The inverter fills one block index
+// while the writer serializes the other; submit() only waits when the writer is
+// still busy with the previous index, i.e. when both buffers are full.
+template <typename Index>
+class RunWriterThread {
+public:
+    RunWriterThread(const TermDictionary& dictionary, const IndexerOptions& options, FlushStats& stats,
+                    CheckpointTracker& checkpoints)
+        : dictionary(dictionary), options(options), stats(stats), checkpoints(checkpoints),
+          pendingIndex(nullptr), pendingCharged(nullptr), stopping(false), worker([this] { run(); }) {}
+
+    ~RunWriterThread() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
         }
-        return true;
-    };
+        changed.notify_all();
+        worker.join();
+    }
+
+    // Function to hand a filled block index to the writer. The index is cleared once
+    // written; indexCharged is its charge to the budget, owned by the writer until then.
+    void submit(Index& index, size_t& indexCharged, int blockID, string filename) {
+        drain();
+        lock_guard<mutex> lock(mtx);
+        pendingIndex = &index;
+        pendingCharged = &indexCharged;
+        pendingBlockID = blockID;
+        pendingFilename = std::move(filename);
+        changed.notify_all();
+    }
 
-    for (char c : text) {
-        if (std::isalnum(static_cast<unsigned char>(c))) {
-            token += std::tolower(static_cast<unsigned char>(c));
-        } else if (!token.empty()) {
-            if (isASCII(token)) {
-                tokens.push_back(token);
+    // Function to wait until the last submitted index is written, rethrowing a write error
+    void drain() {
+        auto waitStart = chrono::steady_clock::now();
+        unique_lock<mutex> lock(mtx);
+        changed.wait(lock, [&] { return pendingIndex == nullptr; });
+        stats.stallMicros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - waitStart).count();
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+private:
+    void run() {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            changed.wait(lock, [&] { return stopping || pendingIndex != nullptr; });
+            if (!pendingIndex) {
+                return;
+            }
+            lock.unlock();
+            try {
+                writeRun(*pendingIndex, pendingFilename);
+                syncPath(pendingFilename);
+                checkpoints.runWritten(pendingBlockID);
+            } catch (...) {
+                error = current_exception();
             }
-            token.clear();
+            if (memoryBudget.exceeded()) {
+                // Both buffers are charged while one waits; give this one's memory back
+                pendingIndex->release();
+                memoryBudget.update(*pendingCharged, pendingIndex->bytesReserved());
+            } else {
+                pendingIndex->clear();
+            }
+            lock.lock();
+            pendingIndex = nullptr;
+            changed.notify_all();
+        }
+    }
+
+    void writeRun(const Index& index, const string& filename) {
+        auto writeStart = chrono::steady_clock::now();
+        if (options.binaryRuns) {
+            writeBinaryPostingFile(filename, index, dictionary, options.positions);
+        } else {
+            writeTextPostingFile(filename, index, dictionary);
         }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - writeStart;
+        stats.writeMicros += chrono::duration_cast<chrono::microseconds>(elapsed).count();
+        metrics.record(STAGE_FLUSH, chrono::steady_clock::now() - writeStart, index.postingCount(), 0,
+                       fs::file_size(filename));
+
+        lock_guard<mutex> lock(logMutex);
+        cout << "Written intermediate file: " << filename << " in " << elapsed.count() << " seconds" << endl;
     }
-    if (!token.empty() && isASCII(token)) {
-        tokens.push_back(token);
+
+    const TermDictionary& dictionary;
+    const IndexerOptions& options;
+    FlushStats& stats;
+    CheckpointTracker& checkpoints;
+    Index* pendingIndex; // Index being written, null when the writer is idle
+    size_t* pendingCharged;
+    int pendingBlockID;
+    string pendingFilename;
+    bool stopping;
+    exception_ptr error;
+    mutex mtx;
+    condition_variable changed;
+    thread worker; // Declared last so it starts after the members it uses
+};
+
+// Function to count the bytes the merger's intToVarByte gives a value; 0 gets none
+inline uint32_t finalVarByteLength(uint32_t value) {
+    uint32_t length = 0;
+    for (; value > 0; value >>= 7) {
+        length++;
     }
-    return tokens;
+    return length;
 }
 
-// Function to write intermediate posting file in text format
-void writeTextPostingFile(const string& filename,
-                          const map<string, vector<Posting>>& invertedIndex) {
-    ofstream outfile(filename);
-    if (!outfile.is_open()) {
-        throw runtime_error("Failed to open text intermediate file for writing: " + filename);
+// Function to write a value the way the merger's intToVarByte does and move past it
+inline void putFinalVarByte(uint8_t*& out, uint32_t value) {
+    for (; value > 0; value >>= 7) {
+        *out++ = static_cast<uint8_t>(value & 0x7F) | (value > 0x7F ? 0x80 : 0);
     }
+}
 
-    for (const auto& [term, postings] : invertedIndex) {
-        // Write the term
-        outfile << term;
+// Two-pass build of the final index, with no runs and no merge. Pass 1 sees every
+// document in docID order through count() and sizes, per term, each block of
+// POSTINGS_PER_BLOCK postings exactly as the merger would encode it: docID gaps, then
+// frequencies. build() lays the terms out in lexicon order in a pre-sized, mapped
+// index.bin and runs pass 2: one writer per docID range re-parses its part of the
+// collection and writes every gap and frequency straight to its byte. A range starts
+// from the term states pass 1 had reached at its first document, so writers never meet.
+// Memory is 12 bytes per term per range plus 16 bytes per block, on top of the dictionary.
+// Each range's states are charged to the budget as pass 1 copies them, so a build that
+// cannot fit stops there instead of after pass 1.
+class TwoPassIndex {
+public:
+    TwoPassIndex(string indexDir, size_t collectionBytes, int rangeCount) : indexDir(std::move(indexDir)) {
+        for (int i = 0; i < rangeCount; ++i) {
+            ranges.push_back(Range{collectionBytes * i / rangeCount, SIZE_MAX, 0, {}});
+        }
+        ranges[0].start = 0;
+    }
 
-        // Write each posting as docID:termFreq separated by space
-        for (const auto& posting : postings) {
-            outfile << " " << posting.docID << ":" << posting.termFreq;
+    ~TwoPassIndex() {
+        memoryBudget.release(rangeStateBytes);
+    }
+
+    TwoPassIndex(const TwoPassIndex&) = delete;
+    TwoPassIndex& operator=(const TwoPassIndex&) = delete;
+
+    // Function to add a document of pass 1, called in docID order
+    void count(const ParsedDocument& doc) {
+        while (nextRange < ranges.size() && lastInputEnd >= ranges[nextRange].target) {
+            ranges[nextRange].start = lastInputEnd;
+            ranges[nextRange].firstDocID = static_cast<uint32_t>(doc.docID);
+            ranges[nextRange].states.assign(states.begin(), states.begin() + termCount);
+            nextRange++;
+            memoryBudget.charge(termCount * sizeof(TermState));
+            rangeStateBytes += termCount * sizeof(TermState);
+            if (memoryBudget.exceeded()) {
+                throwOverBudget();
+            }
         }
+        lastInputEnd = doc.inputEnd;
+        documents++;
+        mapped = mapped || doc.externalID != doc.docID;
 
-        // End the line for the current term
-        outfile << "\n";
+        uint32_t docID = static_cast<uint32_t>(doc.docID);
+        const uint8_t* p = doc.termFreqs.data();
+        const uint8_t* end = p + doc.termFreqs.size();
+        while (p < end) {
+            uint32_t termID = readVarByte(p);
+            uint32_t freq = readVarByte(p);
+            if (termID >= states.size()) {
+                states.resize(max<size_t>(termID + 1, states.size() * 2), TermState{0, 0, 0, 0});
+            }
+            termCount = max<size_t>(termCount, termID + 1);
+            TermState& state = states[termID];
+            state.gapBytes += finalVarByteLength(docID - state.lastDocID);
+            state.freqBytes += finalVarByteLength(freq);
+            state.lastDocID = docID;
+            if (++state.count % POSTINGS_PER_BLOCK == 0) {
+                blocks.push_back(BlockSize{termID, state.gapBytes, state.freqBytes, docID});
+                state.gapBytes = 0;
+                state.freqBytes = 0;
+            }
+            postings++;
+        }
+    }
+
+    // True when some document's docID differs from its collection docID
+    bool docIDsMapped() const {
+        return mapped;
+    }
+
+    // Function to write index.bin, lexicon.txt and blockMetaData.txt in indexDir,
+    // running pass 2 over collection with one writer thread per range
+    void build(TermDictionary& dictionary, const MappedFile& collection) {
+        auto layoutStart = chrono::steady_clock::now();
+        uint64_t indexBytes = layout(dictionary);
+        size_t charged = (states.size() + termBlocks.size()) * sizeof(TermState) +
+                         placed.size() * sizeof(PlacedBlock) + termBlocks.size() * sizeof(uint32_t);
+        memoryBudget.charge(charged);
+        if (memoryBudget.exceeded()) {
+            memoryBudget.release(charged);
+            throwOverBudget();
+        }
+        states = vector<TermState>(); // Pass 2 starts each range from its own copy
+
+        string indexPath = indexDir + "/index.bin";
+        int fd = open(indexPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            memoryBudget.release(charged);
+            throw runtime_error("Failed to open index file for writing: " + indexPath);
+        }
+        uint8_t* index = nullptr;
+        if (ftruncate(fd, static_cast<off_t>(indexBytes)) != 0 ||
+            (indexBytes > 0 && (index = static_cast<uint8_t*>(mmap(nullptr, indexBytes, PROT_READ | PROT_WRITE,
+                                                                    MAP_SHARED, fd, 0))) == MAP_FAILED)) {
+            close(fd);
+            memoryBudget.release(charged);
+            throw runtime_error("Failed to size and map index file: " + indexPath);
+        }
+        close(fd);
+        {
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - layoutStart;
+            lock_guard<mutex> lock(logMutex);
+            cout << "Laid out " << termBlocks.size() << " terms in " << placed.size() << " blocks (" << indexBytes
+                 << " bytes) in " << elapsed.count() << " seconds" << endl;
+        }
+
+        // Pass 2: each range ends where the next one starts
+        auto placeStart = chrono::steady_clock::now();
+        string_view text = collection.view();
+        vector<uint32_t> endDocIDs(ranges.size(), 0);
+        PipelineError error;
+        vector<thread> writers;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            writers.emplace_back([&, i] {
+                try {
+                    size_t end = i + 1 < ranges.size() ? ranges[i + 1].start : text.size();
+                    endDocIDs[i] = placeRange(dictionary, text, ranges[i], min(end, text.size()), index);
+                } catch (...) {
+                    error.set(current_exception());
+                }
+            });
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        if (index) {
+            munmap(index, indexBytes);
+        }
+        memoryBudget.release(charged + rangeStateBytes);
+        rangeStateBytes = 0;
+        error.rethrowIfSet();
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            uint32_t expected = i + 1 < ranges.size() ? ranges[i + 1].firstDocID : documents;
+            if (endDocIDs[i] != expected) {
+                throw runtime_error("Pass 2 found other documents than pass 1; was the collection changed?");
+            }
+        }
+        auto placeTime = chrono::steady_clock::now() - placeStart;
+        metrics.record(STAGE_FLUSH, placeTime, postings, 0, indexBytes);
+        chrono::duration<double> elapsed = placeTime;
+        lock_guard<mutex> lock(logMutex);
+        cout << "Placed " << postings << " postings with " << ranges.size() << " writers in " << elapsed.count()
+             << " seconds" << endl;
+    }
+
+private:
+    [[noreturn]] static void throwOverBudget() {
+        size_t used = max(memoryBudget.bytesUsed(), residentBytes());
+        throw runtime_error("The two-pass build needs more than " + to_string(used / (1024 * 1024)) +
+                            " MB, over the memory budget; build runs and merge them instead");
+    }
+
+    // Where a term's postings are after some number of documents: the postings so far,
+    // the last docID and the gap and frequency bytes in its unfinished block
+    struct TermState {
+        uint32_t count;
+        uint32_t lastDocID;
+        uint16_t gapBytes;
+        uint16_t freqBytes;
+    };
+
+    // A block as pass 1 finishes it; blocks of different terms are interleaved
+    struct BlockSize {
+        uint32_t termID;
+        uint16_t gapBytes;
+        uint16_t freqBytes;
+        uint32_t lastDocID;
+    };
+
+    // A block in index.bin; the frequencies start gapBytes after the offset
+    struct PlacedBlock {
+        uint64_t offset;
+        uint32_t gapBytes;
+        uint32_t size;
+    };
+
+    // The documents one writer of pass 2 parses, starting at a line boundary
+    struct Range {
+        size_t target;          // Collection offset the range should start near
+        size_t start;           // Offset of its first line, SIZE_MAX until pass 1 gets there
+        uint32_t firstDocID;
+        vector<TermState> states; // Term states before its first document
+    };
+
+    // Function to order the terms, give every block its offset and write the lexicon and
+    // block meta data. Returns the size of index.bin.
+    uint64_t layout(const TermDictionary& dictionary) {
+        // Ranges pass 1 never reached are empty
+        for (Range& range : ranges) {
+            if (range.start == SIZE_MAX) {
+                range.start = lastInputEnd;
+                range.firstDocID = documents;
+            }
+        }
+        states.resize(dictionary.size(), TermState{0, 0, 0, 0});
+        for (uint32_t termID = 0; termID < states.size(); ++termID) {
+            const TermState& state = states[termID];
+            if (state.count % POSTINGS_PER_BLOCK != 0) {
+                blocks.push_back(BlockSize{termID, state.gapBytes, state.freqBytes, state.lastDocID});
+            }
+        }
+
+        vector<uint32_t> terms;
+        for (uint32_t termID = 0; termID < states.size(); ++termID) {
+            if (states[termID].count > 0) {
+                terms.push_back(termID);
+            }
+        }
+        sort(terms.begin(), terms.end(), [&](uint32_t a, uint32_t b) {
+            return dictionary.term(a) < dictionary.term(b);
+        });
+
+        // Blocks of a term are finished in order, so a cursor per term puts them in place
+        termBlocks.assign(states.size(), 0);
+        uint32_t nextBlock = 0;
+        for (uint32_t termID : terms) {
+            termBlocks[termID] = nextBlock;
+            nextBlock += (states[termID].count + POSTINGS_PER_BLOCK - 1) / POSTINGS_PER_BLOCK;
+        }
+        vector<uint32_t> cursor = termBlocks;
+        vector<uint32_t> order(blocks.size());
+        for (uint32_t i = 0; i < blocks.size(); ++i) {
+            order[cursor[blocks[i].termID]++] = i;
+        }
+
+        string lexiconPath = indexDir + "/lexicon.txt";
+        string blockMetaDataPath = indexDir + "/blockMetaData.txt";
+        ofstream lexicon(lexiconPath);
+        ofstream blockMetaData(blockMetaDataPath);
+        if (!lexicon.is_open() || !blockMetaData.is_open()) {
+            throw runtime_error("Failed to open lexicon or block meta data for writing in " + indexDir);
+        }
+        placed.resize(blocks.size());
+        uint64_t offset = 0;
+        for (uint32_t termID : terms) {
+            uint64_t termOffset = offset;
+            uint32_t first = termBlocks[termID];
+            uint32_t last = first + (states[termID].count + POSTINGS_PER_BLOCK - 1) / POSTINGS_PER_BLOCK;
+            for (uint32_t b = first; b < last; ++b) {
+                const BlockSize& block = blocks[order[b]];
+                uint32_t size = uint32_t(block.gapBytes) + block.freqBytes;
+                placed[b] = PlacedBlock{offset, block.gapBytes, size};
+                blockMetaData << size << " " << block.lastDocID << "\n";
+                offset += size;
+            }
+            lexicon << dictionary.term(termID) << " " << termOffset << " " << offset - termOffset << " "
+                    << states[termID].count << "\n";
+        }
+        blocks = vector<BlockSize>();
+        lexicon.close();
+        blockMetaData.close();
+        if (lexicon.fail() || blockMetaData.fail()) {
+            throw runtime_error("Failed to write lexicon or block meta data in " + indexDir);
+        }
+        return offset;
+    }
+
+    // Function to parse the documents of one range and write their postings into index.
+    // Returns the docID after its last document.
+    uint32_t placeRange(TermDictionary& dictionary, string_view text, Range& range, size_t end, uint8_t* index) {
+        vector<TermState> rangeStates = std::move(range.states);
+        rangeStates.resize(termBlocks.size(), TermState{0, 0, 0, 0});
+        TermIDCache termIDs(dictionary);
+        uint32_t docID = range.firstDocID;
+        size_t sequence = 0;
+        for (size_t chunkStart = range.start; chunkStart < end;) {
+            size_t chunkEnd = min(end, chunkStart + READ_CHUNK_SIZE);
+            if (chunkEnd < end) {
+                size_t newline = text.find('\n', chunkEnd - 1);
+                chunkEnd = (newline == string_view::npos || newline >= end) ? end : newline + 1;
+            }
+            ParsedChunk parsed = parseChunk(InputChunk{sequence++, chunkStart, {}, text.substr(chunkStart, chunkEnd - chunkStart)},
+                                            termIDs, false);
+            size_t parsedBytes = 0;
+            for (const auto& doc : parsed.docs) {
+                const uint8_t* p = doc.termFreqs.data();
+                const uint8_t* docEnd = p + doc.termFreqs.size();
+                while (p < docEnd) {
+                    uint32_t termID = readVarByte(p);
+                    uint32_t freq = readVarByte(p);
+                    if (termID >= rangeStates.size()) {
+                        throw runtime_error("Pass 2 found a term pass 1 did not; was the collection changed?");
+                    }
+                    TermState& state = rangeStates[termID];
+                    const PlacedBlock& block = placed[termBlocks[termID] + state.count / POSTINGS_PER_BLOCK];
+                    uint8_t* gapOut = index + block.offset + state.gapBytes;
+                    uint8_t* freqOut = index + block.offset + block.gapBytes + state.freqBytes;
+                    state.gapBytes += finalVarByteLength(docID - state.lastDocID);
+                    state.freqBytes += finalVarByteLength(freq);
+                    putFinalVarByte(gapOut, docID - state.lastDocID);
+                    putFinalVarByte(freqOut, freq);
+                    state.lastDocID = docID;
+                    if (++state.count % POSTINGS_PER_BLOCK == 0) {
+                        state.gapBytes = 0;
+                        state.freqBytes = 0;
+                    }
+                }
+                parsedBytes += doc.bytes;
+                docID++;
+            }
+            memoryBudget.release(parsedBytes);
+            chunkStart = chunkEnd;
+        }
+        return docID;
+    }
+
+    string indexDir;
+    vector<TermState> states;    // Term ID -> state after the documents counted so far
+    vector<BlockSize> blocks;    // Finished blocks, in the order pass 1 finished them
+    vector<uint32_t> termBlocks; // Term ID -> index of its first block in placed
+    vector<PlacedBlock> placed;  // Blocks in index.bin order
+    vector<Range> ranges;
+    size_t rangeStateBytes = 0; // Budget charged for the ranges' states
+    size_t termCount = 0;       // Term IDs below this have been counted
+    size_t nextRange = 1;
+    size_t lastInputEnd = 0;
+    uint32_t documents = 0;
+    size_t postings = 0;
+    bool mapped = false;
+};
+
+// Function to write the binary page table that queries map, as the merger does: "WSEPAGE1",
+// int64 first docID, uint64 slot count, uint64 document count, uint64 total length in
+// tokens, then a uint16 length per docID from the first, NO_DOCUMENT where there is none
+void writeBinaryPageTable(const string& textPath, const string& binaryPath) {
+    ifstream input(textPath);
+    if (!input.is_open()) {
+        throw runtime_error("Failed to open page table file for reading: " + textPath);
+    }
+    vector<pair<int, uint64_t>> documents;
+    int docID;
+    uint64_t length;
+    while (input >> docID >> length) {
+        documents.emplace_back(docID, length);
+    }
+
+    int64_t firstDocID = 0;
+    vector<uint16_t> lengths;
+    uint64_t totalLength = 0;
+    if (!documents.empty()) {
+        auto [minIt, maxIt] = minmax_element(documents.begin(), documents.end());
+        firstDocID = minIt->first;
+        lengths.assign(static_cast<size_t>(maxIt->first - firstDocID + 1), NO_DOCUMENT);
+    }
+    for (const auto& document : documents) {
+        lengths[document.first - firstDocID] = static_cast<uint16_t>(min<uint64_t>(document.second, MAX_PAGE_LENGTH));
+        totalLength += document.second;
+    }
+
+    ofstream output(binaryPath, ios::binary);
+    if (!output.is_open()) {
+        throw runtime_error("Failed to open page table for writing: " + binaryPath);
+    }
+    uint64_t header[4] = {static_cast<uint64_t>(firstDocID), lengths.size(), documents.size(), totalLength};
+    output.write(PAGE_TABLE_MAGIC, sizeof(PAGE_TABLE_MAGIC));
+    output.write(reinterpret_cast<const char*>(header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(lengths.data()), lengths.size() * sizeof(uint16_t));
+    output.close();
+    if (output.fail()) {
+        throw runtime_error("Failed to write page table: " + binaryPath);
     }
-    outfile.close();
 }
 
-// Function to parse the collection and create intermediate posting files
-void parseCollectionWritePageTable(const string& inputFilePath, 
-                    map<std::string, vector<Posting>>& invertedIndex,
-                    int& currentBlockSize,
+// Function to parse the collection and create intermediate posting files.
+// A reader thread, numWorkers tokenizer threads and numInverters inverter threads
+// run as a pipeline; this thread restores input order, writes the page table and
+// cuts blocks at the same documents as a sequential pass would.
+// A checkpoint is saved in outputDir as runs reach the disk; with options.resume the
+// run continues from it, so a crash costs at most the blocks that were in flight.
+// With twoPass, documents are counted into it instead of being inverted into runs, and
+// its pass 2 writes the final index once the page table is complete.
+void parseCollectionWritePageTable(const string& inputFilePath,
                     const int maxBlockSize,
                     int& blockCount,
                     const string& outputDir,
-                    const string& pageTableFileName) {
-    ifstream infile(inputFilePath);
-    if (!infile.is_open()) {
-        throw runtime_error("Failed to open collection file: " + inputFilePath);
+                    const string& pageTableFileName,
+                    const IndexerOptions& options,
+                    TwoPassIndex* twoPass = nullptr) {
+    const int numWorkers = options.numWorkers;
+    const int numInverters = options.numInverters;
+
+    // Under a budget, a quarter of it goes to the input pipeline: up to 5 chunks per
+    // worker (queued, being parsed, parsed and waiting) plus the reader's buffers,
+    // each held as text and as parsed documents of about the same size
+    size_t chunkSize = READ_CHUNK_SIZE;
+    size_t pipelineReserve = 0;
+    if (memoryBudget.limit() > 0) {
+        pipelineReserve = memoryBudget.limit() / 4;
+        chunkSize = min(chunkSize, max<size_t>(64 * 1024, pipelineReserve / (2 * (5 * numWorkers + 2))));
+    }
+    string checkpointPath = outputDir + "/checkpoint.txt";
+    IndexCheckpoint checkpoint;
+    checkpoint.input = inputFilePath;
+    checkpoint.runFormat = options.positions ? "positional" : options.binaryRuns ? "binary" : "text";
+    if (options.resume) {
+        IndexCheckpoint saved;
+        if (!IndexCheckpoint::load(checkpointPath, saved)) {
+            throw runtime_error("No checkpoint to resume from: " + checkpointPath);
+        }
+        if (saved.input != checkpoint.input || saved.runFormat != checkpoint.runFormat) {
+            throw runtime_error("Checkpoint was written for " + saved.input + " with " + saved.runFormat +
+                                " runs; resume with the same input and run format");
+        }
+        checkpoint = saved;
+        blockCount = checkpoint.blocks;
+        // Runs past the checkpoint may be partial or cut at other documents
+        for (const auto& entry : fs::directory_iterator(outputDir)) {
+            string name = entry.path().filename().string();
+            if (name.rfind("intermediate_", 0) == 0 && atoi(name.c_str() + strlen("intermediate_")) >= blockCount) {
+                fs::remove(entry.path());
+            }
+        }
+        lock_guard<mutex> lock(logMutex);
+        cout << "Resuming after " << checkpoint.documents << " documents and " << checkpoint.blocks
+             << " runs, at byte " << checkpoint.inputOffset << " of " << inputFilePath << endl;
+    } else {
+        fs::remove(checkpointPath);
     }
 
-    ofstream outfile(pageTableFileName);
+    // Documents are numbered densely in input order; docmap.bin next to the runs maps those
+    // docIDs back to the collection's: int64 first docID (0), uint64 count, then an int64
+    // collection docID per document. The count is filled in at the end.
+    // A resumed run cuts both files back to the checkpoint and appends to them.
+    string docMapFileName = outputDir + "/docmap.bin";
+    uint64_t docMapHeader[2] = {0, 0};
+    ofstream outfile;
+    ofstream docMapFile;
+    if (options.resume) {
+        fs::resize_file(pageTableFileName, checkpoint.pageTableBytes);
+        fs::resize_file(docMapFileName, sizeof(docMapHeader) + checkpoint.documents * sizeof(int64_t));
+        outfile.open(pageTableFileName, ios::in | ios::out | ios::ate);
+        docMapFile.open(docMapFileName, ios::in | ios::out | ios::binary | ios::ate);
+    } else {
+        outfile.open(pageTableFileName);
+        docMapFile.open(docMapFileName, ios::binary);
+        docMapFile.write(reinterpret_cast<const char*>(docMapHeader), sizeof(docMapHeader));
+    }
     if (!outfile.is_open()) {
         throw runtime_error("Failed to open page table file for writing: " + pageTableFileName);
     }
+    if (!docMapFile.is_open()) {
+        throw runtime_error("Failed to open docID map for writing: " + docMapFileName);
+    }
+    CheckpointTracker checkpoints(checkpointPath, checkpoint);
+
+    BoundedQueue<InputChunk> chunkQueue(numWorkers * 2);
+    BoundedQueue<ParsedChunk> parsedQueue(numWorkers * 2);
+    BoundedQueue<Block> blockQueue(numInverters);
+    PipelineError error;
+    TermDictionary dictionary;
+    atomic<int> blocksInFlight{0}; // Blocks handed to the inverters and not yet inverted
+    FlushStats flushStats;
+
+    auto abortPipeline = [&](exception_ptr e) {
+        error.set(e);
+        chunkQueue.close();
+        parsedQueue.close();
+        blockQueue.close();
+    };
+
+    // Mapped before any thread starts so a missing file is reported directly
+    unique_ptr<MappedFile> collection;
+    if (options.useMmap && isMappable(inputFilePath)) {
+        collection = make_unique<MappedFile>(inputFilePath);
+    } else if (twoPass) {
+        throw runtime_error("A two-pass build reads the collection twice and needs an uncompressed regular file: " +
+                            inputFilePath);
+    } else if (options.useMmap) {
+        lock_guard<mutex> lock(logMutex);
+        cout << "--mmap needs an uncompressed regular file; streaming " << inputFilePath << " instead" << endl;
+    }
+
+    auto startTime = chrono::steady_clock::now();
+    thread reader([&] {
+        try {
+            if (collection) {
+                readMappedChunks(*collection, chunkSize, checkpoint.inputOffset, chunkQueue);
+            } else {
+                readCollectionChunks(inputFilePath, chunkSize, checkpoint.inputOffset, chunkQueue);
+            }
+        } catch (...) {
+            abortPipeline(current_exception());
+        }
+        chunkQueue.close();
+    });
+
+    vector<thread> workers;
+    for (int i = 0; i < numWorkers; ++i) {
+        workers.emplace_back([&] {
+            try {
+                TermIDCache termIDs(dictionary);
+                InputChunk chunk;
+                while (chunkQueue.pop(chunk)) {
+                    ParsedChunk parsed = parseChunk(chunk, termIDs, options.positions);
+                    if (chunk.mapped.data()) {
+                        // Let the kernel drop the parsed pages instead of keeping them resident
+                        size_t pageSize = sysconf(_SC_PAGESIZE);
+                        uintptr_t first = (reinterpret_cast<uintptr_t>(chunk.mapped.data()) + pageSize - 1) & ~(pageSize - 1);
+                        uintptr_t last = (reinterpret_cast<uintptr_t>(chunk.mapped.data()) + chunk.mapped.size()) & ~(pageSize - 1);
+                        if (last > first) {
+                            madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+                        }
+                    } else {
+                        memoryBudget.release(chunk.storage.capacity());
+                        chunk.storage = string();
+                    }
+                    if (!parsedQueue.push(std::move(parsed))) {
+                        break;
+                    }
+                }
+            } catch (...) {
+                abortPipeline(current_exception());
+            }
+        });
+    }
+
+    // buffers are two block indexes, one being filled while the other is written
+    auto invertBlocks = [&](auto& buffers) {
+        Block block;
+        size_t indexCharged[2] = {0, 0};
+        int current = 0;
+        RunWriterThread<remove_reference_t<decltype(buffers[0])>> writer(dictionary, options, flushStats, checkpoints);
+        while (blockQueue.pop(block)) {
+            invertBlock(block, buffers[current], indexCharged[current]);
+            blocksInFlight--;
+            memoryBudget.release(0); // Wake the sequencer if it waits for memory
+            string filename = outputDir + "/intermediate_" + to_string(block.blockID) +
+                              (options.binaryRuns ? ".bin" : ".txt");
+            writer.submit(buffers[current], indexCharged[current], block.blockID, filename);
+            current ^= 1;
+        }
+        writer.drain();
+        memoryBudget.release(indexCharged[0] + indexCharged[1]);
+    };
+    // A two-pass build cuts no blocks, so it starts no inverters and no run writers
+    vector<thread> inverters;
+    for (int i = 0; i < (twoPass ? 0 : numInverters); ++i) {
+        inverters.emplace_back([&] {
+            try {
+                if (options.sortInverter) {
+                    SortedBlockIndex buffers[2] = {SortedBlockIndex(options.sortThreads),
+                                                   SortedBlockIndex(options.sortThreads)};
+                    invertBlocks(buffers);
+                } else {
+                    BlockIndex buffers[2];
+                    invertBlocks(buffers);
+                }
+            } catch (...) {
+                abortPipeline(current_exception());
+            }
+        });
+    }
+
+    // Close the parsed queue once every worker is done so the loop below ends
+    thread workerJoiner([&] {
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        parsedQueue.close();
+    });
+
+    int processedDocs = checkpoint.documents; // Document counter
+    size_t inputOffset = checkpoint.inputOffset; // Text offset past the last numbered document
+    Block currentBlock{blockCount, {}, 0};
+    auto dispatchBlock = [&] {
+        checkpoints.blockCut(currentBlock.blockID, inputOffset, processedDocs, static_cast<size_t>(outfile.tellp()));
+        blocksInFlight++;
+        blockQueue.push(std::move(currentBlock));
+        currentBlock = Block{++blockCount, {}, 0};
+    };
+
+    // Size of the next block. Under a budget, the dictionary and the input pipeline
+    // come off the top and the rest is split between the blocks that can be alive at
+    // once: one being filled, numInverters queued, numInverters being inverted, whose
+    // postings briefly exist both as documents and in the block index, and
+    // numInverters block indexes being written in the background. A BlockIndex takes
+    // about what its documents did, ~5 bytes per posting; a SortedBlockIndex takes 24,
+    // in its triples and the sort's second array.
+    double indexBytesPerBlockByte = options.sortInverter ? 24.0 / 5 : 1.0;
+    auto blockLimit = [&]() -> size_t {
+        size_t limit = maxBlockSize;
+        if (memoryBudget.limit() > 0) {
+            size_t fixed = dictionary.bytesReserved() + pipelineReserve;
+            size_t available = memoryBudget.limit() > fixed ? memoryBudget.limit() - fixed : 0;
+            double blocksAlive = 1 + 2 * numInverters * (1 + indexBytesPerBlockByte);
+            limit = min(limit, max<size_t>(1 << 20, static_cast<size_t>(available / blocksAlive)));
+        }
+        return limit;
+    };
+
+    map<size_t, ParsedChunk> pending; // Chunks that arrived ahead of their turn
+    size_t nextSequence = 0;
+    size_t currentLimit = blockLimit();
+    ParsedChunk parsed;
+    while (parsedQueue.pop(parsed)) {
+        pending.emplace(parsed.sequence, std::move(parsed));
+
+        for (auto it = pending.find(nextSequence); it != pending.end(); it = pending.find(nextSequence)) {
+            // Flush early and wait for the inverters when the budget is exhausted
+            if (memoryBudget.exceeded()) {
+                if (!currentBlock.docs.empty()) {
+                    dispatchBlock();
+                }
+                while (blocksInFlight > 0 && memoryBudget.exceeded()) {
+                    memoryBudget.waitForRelease();
+                }
+            }
+
+            for (auto& doc : it->second.docs) {
+                doc.docID = processedDocs;
+                inputOffset = doc.inputEnd;
+                docMapFile.write(reinterpret_cast<const char*>(&doc.externalID), sizeof(doc.externalID));
+                //wirte to page table file
+                outfile << doc.docID << '\t' << doc.length << '\n';
+
+                if (twoPass) {
+                    try {
+                        twoPass->count(doc);
+                    } catch (...) {
+                        abortPipeline(current_exception());
+                    }
+                    memoryBudget.release(doc.bytes);
+                } else {
+                    currentBlock.bytes += doc.bytes;
+                    currentBlock.docs.push_back(std::move(doc));
+                }
+
+                // Increment document counter and log progress
+                processedDocs++;
+                if (processedDocs % 100000 == 0) {
+                    lock_guard<mutex> lock(logMutex);
+                    cout << "Processed " << processedDocs << " documents..." << endl;
+                }
+
+                // Check if the current block size exceeds the maximum allowed
+                if (currentBlock.bytes >= currentLimit) {
+                    dispatchBlock();
+                    currentLimit = blockLimit();
+                }
+            }
+            pending.erase(it);
+            nextSequence++;
+        }
+
+        try {
+            checkpoints.commit([&] {
+                outfile.flush();
+                docMapFile.flush();
+                if (!outfile || !docMapFile) {
+                    throw runtime_error("Failed to write the page table or docID map");
+                }
+                syncPath(pageTableFileName);
+                syncPath(docMapFileName);
+                syncPath(outputDir);
+            });
+        } catch (...) {
+            abortPipeline(current_exception());
+        }
+    }
+
+    workerJoiner.join();
+    reader.join();
+    outfile.close();
+    docMapHeader[1] = static_cast<uint64_t>(processedDocs);
+    docMapFile.seekp(0);
+    docMapFile.write(reinterpret_cast<const char*>(docMapHeader), sizeof(docMapHeader));
+    docMapFile.close();
+    if (docMapFile.fail()) {
+        error.set(make_exception_ptr(runtime_error("Failed to write docID map: " + docMapFileName)));
+    }
+
+    // Inverters must be joined before an error leaves this function
+    auto joinInverters = [&] {
+        blockQueue.close();
+        for (auto& inverter : inverters) {
+            inverter.join();
+        }
+    };
+    try {
+        error.rethrowIfSet();
+    } catch (...) {
+        joinInverters();
+        throw;
+    }
+    {
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - startTime;
+        lock_guard<mutex> lock(logMutex);
+        cout << "Page Table completed" << endl;
+        cout << "Parsed " << processedDocs << " documents in " << elapsed.count() << " seconds ("
+             << static_cast<long long>(processedDocs / max(elapsed.count(), 1e-9)) << " docs/sec)" << endl;
+    }
+
+    // Write any remaining postings to an intermediate file
+    bool hasPostings = false;
+    for (const auto& doc : currentBlock.docs) {
+        hasPostings = hasPostings || !doc.termFreqs.empty();
+    }
+    if (hasPostings) {
+        dispatchBlock();
+    }
+    joinInverters();
+    error.rethrowIfSet();
+    if (twoPass) {
+        twoPass->build(dictionary, *collection);
+    }
+    // Every run is written; a later run starts afresh
+    fs::remove(checkpointPath);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    lock_guard<mutex> lock(logMutex);
+    if (!twoPass) {
+        double writeSeconds = flushStats.writeMicros / 1e6;
+        double overlapSeconds = max(0.0, writeSeconds - flushStats.stallMicros / 1e6);
+        cout << "Run writes took " << writeSeconds << " seconds, " << overlapSeconds
+             << " seconds of it overlapped with parsing (" << static_cast<int>(100 * overlapSeconds / max(writeSeconds, 1e-9))
+             << "%)" << endl;
+    }
+    cout << "Peak tracked memory: " << memoryBudget.peakBytes() / (1024 * 1024) << " MB, peak RSS: "
+         << usage.ru_maxrss / 1024 << " MB";
+    if (memoryBudget.limit() > 0) {
+        cout << " (budget " << memoryBudget.limit() / (1024 * 1024) << " MB)";
+    }
+    cout << endl;
+}
 
+// Function to measure each tokenizer kernel on the passages of the collection.
+// Reads up to maxBytes of input, checks every kernel against the scalar output and
+// reports bytes/sec over the passage text.
+void benchmarkTokenizers(const string& inputFilePath, size_t maxBytes) {
+    ifstream infile(inputFilePath, ios::binary);
+    if (!infile.is_open()) {
+        throw runtime_error("Failed to open collection file: " + inputFilePath);
+    }
+    vector<string> passages;
+    size_t passageBytes = 0;
     string line;
-    static int processedDocs = 0; // Document counter
-    while (getline(infile, line)) {
-        // Split the line into docID and passage
+    while (passageBytes < maxBytes && getline(infile, line)) {
         size_t tabPos = line.find('\t');
-        if (tabPos == string::npos) {
-            continue; // Skip malformed lines
+        if (tabPos != string::npos) {
+            passages.push_back(line.substr(tabPos + 1));
+            passageBytes += passages.back().size();
         }
-        int docID = stoi(line.substr(0, tabPos));
-        string passage = line.substr(tabPos + 1);
+    }
+    cout << "Tokenizer benchmark over " << passages.size() << " passages, " << passageBytes << " bytes" << endl;
 
-        // Tokenize the passage
-        vector<string> tokens = tokenize(passage);
+    vector<pair<string, TokenizerKernel>> kernels = {{"scalar", tokenizeScalar}};
+    for (const char* name : {"avx2", "avx512"}) {
+        try {
+            kernels.emplace_back(name, selectTokenizerKernel(name));
+        } catch (const exception&) {
+            cout << name << ": not supported on this machine" << endl;
+        }
+    }
+
+    const int rounds = 5;
+    size_t expectedTokens = 0;
+    uint64_t expectedChecksum = 0;
+    string tokenBytes;
+    vector<string_view> tokens;
+    for (const auto& [name, kernel] : kernels) {
+        tokenizerKernel = kernel;
+
+        // Verification pass, kept out of the timed rounds
+        size_t tokenCount = 0;
+        uint64_t checksum = 0;
+        for (const auto& passage : passages) {
+            tokenBytes.clear();
+            tokens.clear();
+            tokenize(passage, tokenBytes, tokens);
+            tokenCount += tokens.size();
+            for (const auto& token : tokens) {
+                checksum = checksum * 31 + hash<string_view>()(token);
+            }
+        }
+        if (name == "scalar") {
+            expectedTokens = tokenCount;
+            expectedChecksum = checksum;
+        } else if (tokenCount != expectedTokens || checksum != expectedChecksum) {
+            throw runtime_error("Tokenizer kernel " + name + " does not match the scalar output");
+        }
+
+        auto start = chrono::steady_clock::now();
+        for (int round = 0; round < rounds; ++round) {
+            for (const auto& passage : passages) {
+                tokenBytes.clear();
+                tokens.clear();
+                tokenize(passage, tokenBytes, tokens);
+            }
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
 
-        //wirte to page table file
-        outfile << docID << '\t' << tokens.size() << '\n';
+        double bytesPerSec = passageBytes * rounds / max(elapsed.count(), 1e-9);
+        cout << name << ": " << static_cast<long long>(bytesPerSec / (1024 * 1024)) << " MB/sec, "
+             << tokenCount << " tokens" << endl;
+    }
+}
 
-        // Count term frequencies in the current document
-        unordered_map<string, int> termFreqMap;
+// Function to measure per-document term counting on the passages of the collection.
+// Passages are tokenized and interned up front so only the counting is timed; every
+// strategy is checked against the unordered_map result before its timed rounds.
+void benchmarkCounting(const string& inputFilePath, size_t maxBytes) {
+    ifstream infile(inputFilePath, ios::binary);
+    if (!infile.is_open()) {
+        throw runtime_error("Failed to open collection file: " + inputFilePath);
+    }
+    TermDictionary dictionary;
+    TermIDCache termIDs(dictionary);
+    vector<uint32_t> docTerms;         // Term IDs of all passages, back to back
+    vector<size_t> docOffsets = {0};   // Start of each passage in docTerms
+    size_t passageBytes = 0;
+    string line;
+    string tokenBytes;
+    vector<string_view> tokens;
+    while (passageBytes < maxBytes && getline(infile, line)) {
+        size_t tabPos = line.find('\t');
+        if (tabPos == string::npos) {
+            continue;
+        }
+        string_view passage = string_view(line).substr(tabPos + 1);
+        passageBytes += passage.size();
+        tokenBytes.clear();
+        tokens.clear();
+        tokenize(passage, tokenBytes, tokens);
         for (const auto& token : tokens) {
-            termFreqMap[token]++;
+            docTerms.push_back(termIDs.lookup(token));
         }
+        docOffsets.push_back(docTerms.size());
+    }
+    size_t docCount = docOffsets.size() - 1;
+    cout << "Counting benchmark over " << docCount << " passages, " << docTerms.size() << " tokens ("
+         << docTerms.size() / max<size_t>(docCount, 1) << " per passage)" << endl;
+
+    // Each strategy fills termFreqs for one document; the order of pairs may differ
+    using Counter = function<void(const uint32_t*, const uint32_t*, vector<pair<uint32_t, int>>&)>;
+    unordered_map<uint32_t, int> reusedMap;
+    TermCounter termCounter;
+    vector<uint32_t> sorted;
+    vector<pair<string, Counter>> counters = {
+        {"unordered_map (fresh)", [](const uint32_t* begin, const uint32_t* end, vector<pair<uint32_t, int>>& termFreqs) {
+            unordered_map<uint32_t, int> termFreqMap;
+            for (const uint32_t* term = begin; term != end; ++term) {
+                termFreqMap[*term]++;
+            }
+            termFreqs.assign(termFreqMap.begin(), termFreqMap.end());
+        }},
+        {"unordered_map (reused)", [&](const uint32_t* begin, const uint32_t* end, vector<pair<uint32_t, int>>& termFreqs) {
+            reusedMap.clear();
+            for (const uint32_t* term = begin; term != end; ++term) {
+                reusedMap[*term]++;
+            }
+            termFreqs.assign(reusedMap.begin(), reusedMap.end());
+        }},
+        {"sort + run-length", [&](const uint32_t* begin, const uint32_t* end, vector<pair<uint32_t, int>>& termFreqs) {
+            sorted.assign(begin, end);
+            sort(sorted.begin(), sorted.end());
+            for (size_t i = 0; i < sorted.size(); ++i) {
+                if (termFreqs.empty() || termFreqs.back().first != sorted[i]) {
+                    termFreqs.emplace_back(sorted[i], 0);
+                }
+                termFreqs.back().second++;
+            }
+        }},
+        {"flat counter", [&](const uint32_t* begin, const uint32_t* end, vector<pair<uint32_t, int>>& termFreqs) {
+            termCounter.clear();
+            for (const uint32_t* term = begin; term != end; ++term) {
+                termCounter.add(*term);
+            }
+            termCounter.appendTo(termFreqs);
+        }},
+    };
 
-        // Update the inverted index
-        for (const auto& [term, freq] : termFreqMap) {
-            invertedIndex[term].emplace_back(Posting{docID, freq});
-            // Estimate block size: term length + (docID + freq) bytes
-            currentBlockSize += term.size() + sizeof(int) * 2;
+    const int rounds = 5;
+    uint64_t expectedChecksum = 0;
+    vector<pair<uint32_t, int>> termFreqs;
+    for (const auto& [name, counter] : counters) {
+        // Verification pass, kept out of the timed rounds. The checksum is a sum so
+        // it does not depend on the order of the pairs.
+        uint64_t checksum = 0;
+        for (size_t d = 0; d < docCount; ++d) {
+            termFreqs.clear();
+            counter(docTerms.data() + docOffsets[d], docTerms.data() + docOffsets[d + 1], termFreqs);
+            for (const auto& [termID, freq] : termFreqs) {
+                checksum += (static_cast<uint64_t>(termID) * 0x9E3779B97F4A7C15ull) ^ (freq * 0xC2B2AE3D27D4EB4Full);
+            }
+            checksum += d * termFreqs.size();
+        }
+        if (expectedChecksum == 0) {
+            expectedChecksum = checksum;
+        } else if (checksum != expectedChecksum) {
+            throw runtime_error("Counter " + name + " does not match the unordered_map output");
         }
 
-        // Increment document counter and log progress
-        processedDocs++;
-        if (processedDocs % 100000 == 0) {
-            cout << "Processed " << processedDocs << " documents..." << endl;
+        // Every document gets a fresh termFreqs, as in parseChunk
+        auto start = chrono::steady_clock::now();
+        for (int round = 0; round < rounds; ++round) {
+            for (size_t d = 0; d < docCount; ++d) {
+                vector<pair<uint32_t, int>> docFreqs;
+                counter(docTerms.data() + docOffsets[d], docTerms.data() + docOffsets[d + 1], docFreqs);
+            }
         }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
 
-        // Check if the current block size exceeds the maximum allowed
-        if (currentBlockSize >= maxBlockSize) {
-            // Write the current inverted index to an intermediate file
-            string filename = outputDir + "/intermediate_" + to_string(blockCount++) + ".txt";
-            writeTextPostingFile(filename, invertedIndex);
-            cout << "Written intermediate file: " << filename << endl;
+        double docsPerSec = docCount * rounds / max(elapsed.count(), 1e-9);
+        cout << name << ": " << static_cast<long long>(docsPerSec) << " docs/sec, "
+             << elapsed.count() * 1e9 / max<size_t>(docTerms.size() * rounds, 1) << " ns/token" << endl;
+    }
+}
 
-            // Clear the in-memory inverted index and reset block size
-            invertedIndex.clear();
-            currentBlockSize = 0;
+// Function to compare the block index with the sort-based inverter on the passages of
+// the collection. Reads up to maxBytes of input as one block, inverts it with each and
+// then walks the terms in run order, as a flush does; sorting runs on 1 and on
+// sortThreads threads. Reports postings/sec for inverting and for the whole flush walk.
+void benchmarkInverters(const string& inputFilePath, size_t maxBytes, int sortThreads) {
+    ifstream infile(inputFilePath, ios::binary);
+    if (!infile.is_open()) {
+        throw runtime_error("Failed to open collection file: " + inputFilePath);
+    }
+    string text;
+    string line;
+    while (text.size() < maxBytes && getline(infile, line)) {
+        text.append(line).push_back('\n');
+    }
+    TermDictionary dictionary;
+    TermIDCache termIDs(dictionary);
+    ParsedChunk parsed = parseChunk(InputChunk{0, 0, std::move(text), {}}, termIDs, false);
+    size_t postings = 0;
+    for (size_t d = 0; d < parsed.docs.size(); ++d) {
+        parsed.docs[d].docID = static_cast<int>(d);
+        for (const uint8_t* p = parsed.docs[d].termFreqs.data(); p < parsed.docs[d].termFreqs.data() + parsed.docs[d].termFreqs.size(); postings++) {
+            readVarByte(p);
+            readVarByte(p);
         }
     }
+    cout << "Inverter benchmark over " << parsed.docs.size() << " passages, " << postings << " postings, "
+         << dictionary.size() << " terms" << endl;
 
-    infile.close();
-    outfile.close();
-    cout << "Page Table completed" << endl;
+    // Adds the documents' postings to index; walkRuns returns a checksum of them in run order
+    auto addPostings = [&](auto& index) {
+        if constexpr (is_same_v<remove_reference_t<decltype(index)>, SortedBlockIndex>) {
+            index.reserve(postings);
+        }
+        for (const auto& doc : parsed.docs) {
+            const uint8_t* p = doc.termFreqs.data();
+            const uint8_t* end = p + doc.termFreqs.size();
+            while (p < end) {
+                uint32_t termID = readVarByte(p);
+                int freq = static_cast<int>(readVarByte(p));
+                index.addPosting(termID, Posting{doc.docID, freq});
+            }
+        }
+        if constexpr (is_same_v<remove_reference_t<decltype(index)>, SortedBlockIndex>) {
+            index.sortPostings();
+        }
+    };
+    auto walkRuns = [&](const auto& index) {
+        uint64_t checksum = 0;
+        for (uint32_t slot : index.sortedSlots(dictionary)) {
+            checksum = checksum * 31 + index.termID(slot);
+            index.forEachPosting(slot, [&](const Posting& posting) {
+                checksum = checksum * 31 + (static_cast<uint64_t>(posting.docID) << 8 ^ posting.termFreq);
+            });
+        }
+        return checksum;
+    };
 
-    // Write any remaining postings to an intermediate file
-    if (!invertedIndex.empty()) {
-        string filename = outputDir + "/intermediate_" + to_string(blockCount++) + ".txt";
-        writeTextPostingFile(filename, invertedIndex);
-        cout << "Written intermediate file: " << filename << endl;
-    }      
-} 
-
-int main() {
+    const int rounds = 3;
+    uint64_t expectedChecksum = 0;
+    auto measure = [&](const string& name, auto& index) {
+        double invertSeconds = 0;
+        double walkSeconds = 0;
+        uint64_t checksum = 0;
+        for (int round = 0; round < rounds; ++round) {
+            index.clear();
+            auto start = chrono::steady_clock::now();
+            addPostings(index);
+            auto inverted = chrono::steady_clock::now();
+            checksum = walkRuns(index);
+            invertSeconds += chrono::duration<double>(inverted - start).count();
+            walkSeconds += chrono::duration<double>(chrono::steady_clock::now() - inverted).count();
+        }
+        if (expectedChecksum == 0) {
+            expectedChecksum = checksum;
+        } else if (checksum != expectedChecksum) {
+            throw runtime_error("Inverter " + name + " does not match the block index output");
+        }
+        cout << name << ": invert " << static_cast<long long>(postings * rounds / max(invertSeconds, 1e-9))
+             << " postings/sec, invert + walk " << static_cast<long long>(postings * rounds / max(invertSeconds + walkSeconds, 1e-9))
+             << " postings/sec, " << index.bytesReserved() / (1024 * 1024) << " MB" << endl;
+    };
+
+    BlockIndex blockIndex;
+    measure("block index", blockIndex);
+    SortedBlockIndex sortedIndex(1);
+    measure("radix sort (1 thread)", sortedIndex);
+    if (sortThreads > 1) {
+        SortedBlockIndex parallelIndex(sortThreads);
+        measure("radix sort (" + to_string(sortThreads) + " threads)", parallelIndex);
+    }
+}
+
+int main(int argc, char* argv[]) {
     string inputFilePath = "sample.tsv";
     string outputDir = "src/temp";
     string pageTableFileName = "src/pagetable.tsv";
 
+    // Default to one tokenizer per core and one inverter per four cores
+    int numThreads = max(1u, thread::hardware_concurrency());
+    int numInverters = -1;
+    bool useMmap = false;
+    bool binaryRuns = true;
+    bool recordPositions = false;
+    size_t memoryLimit = 0;
+    bool benchTokenizer = false;
+    bool benchCounting = false;
+    bool benchInverter = false;
+    bool sortInverter = false;
+    bool resume = false;
+    string twoPassDir;             // Build the final index here in two passes, without runs
+    string kernelName = "auto";
+    string metricsPath;            // Append JSON metric snapshots here
+    double metricsInterval = 1.0;  // Seconds between snapshots
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            numThreads = max(1, atoi(argv[++i]));
+        } else if (arg == "--inverters" && i + 1 < argc) {
+            numInverters = max(1, atoi(argv[++i]));
+        } else if (arg == "--mmap") {
+            useMmap = true;
+        } else if (arg == "--input" && i + 1 < argc) {
+            inputFilePath = argv[++i];
+        } else if (arg == "--tokenizer" && i + 1 < argc) {
+            kernelName = argv[++i];
+        } else if (arg == "--bench-tokenizer") {
+            benchTokenizer = true;
+        } else if (arg == "--bench-counting") {
+            benchCounting = true;
+        } else if (arg == "--bench-inverter") {
+            benchInverter = true;
+        } else if (arg == "--sort-inverter") {
+            sortInverter = true;
+        } else if (arg == "--text-runs") {
+            binaryRuns = false;
+        } else if (arg == "--positions") {
+            recordPositions = true;
+        } else if (arg == "--resume") {
+            resume = true;
+        } else if (arg == "--two-pass" && i + 1 < argc) {
+            twoPassDir = argv[++i];
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metricsPath = argv[++i];
+        } else if (arg == "--metrics-interval" && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            metricsInterval = atof(argv[++i]);
+        } else if (arg == "--memory-budget" && i + 1 < argc) {
+            try {
+                memoryLimit = parseByteSize(argv[++i]);
+            } catch (const std::exception& ex) {
+                std::cerr << "Error: " << ex.what() << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else {
+            std::cerr << "Usage: ./indexer [--input FILE|-] [--mmap] [--threads N] [--inverters N]"
+                      << " [--tokenizer auto|scalar|avx2|avx512] [--bench-tokenizer] [--bench-counting]"
+                      << " [--bench-inverter] [--text-runs] [--sort-inverter]"
+                      << " [--memory-budget SIZE] [--positions] [--resume] [--two-pass INDEX_DIR]"
+                      << " [--metrics FILE] [--metrics-interval SECONDS]"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    memoryBudget.setLimit(memoryLimit);
+
+    try {
+        tokenizerKernel = selectTokenizerKernel(kernelName);
+        if (benchTokenizer) {
+            benchmarkTokenizers(inputFilePath, 256 * 1024 * 1024);
+            return EXIT_SUCCESS;
+        }
+        if (benchCounting) {
+            benchmarkCounting(inputFilePath, 256 * 1024 * 1024);
+            return EXIT_SUCCESS;
+        }
+        if (benchInverter) {
+            benchmarkInverters(inputFilePath, 256 * 1024 * 1024, numThreads);
+            return EXIT_SUCCESS;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (recordPositions && !binaryRuns) {
+        std::cerr << "Error: --positions needs binary runs, drop --text-runs" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (recordPositions && sortInverter) {
+        std::cerr << "Error: the sort-based inverter does not record positions, drop --sort-inverter" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!twoPassDir.empty() && (recordPositions || resume)) {
+        std::cerr << "Error: --two-pass builds the index without positions or checkpoints,"
+                  << " drop --positions and --resume" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (numInverters < 0) {
+        numInverters = max(1, numThreads / 4);
+    }
+
     // Check if output directory exists; if not, create it
     try {
         if (!fs::exists(outputDir)) {
@@ -168,18 +3491,63 @@ int main() {
                 return EXIT_FAILURE;
             }
         }
+
+        if (resume && !fs::exists(outputDir + "/checkpoint.txt")) {
+            std::cout << "No checkpoint in " << outputDir << ", indexing from the beginning" << std::endl;
+            resume = false;
+        }
+        // Remove runs left by an earlier build so the merger only sees this one; a resumed
+        // build keeps the runs its checkpoint covers
+        if (!resume) {
+            for (const auto& entry : fs::directory_iterator(outputDir)) {
+                string name = entry.path().filename().string();
+                string extension = entry.path().extension().string();
+                if (name.rfind("intermediate_", 0) == 0 && (extension == ".txt" || extension == ".bin")) {
+                    fs::remove(entry.path());
+                }
+            }
+        }
     } catch (const fs::filesystem_error& e) {
         std::cerr << "Filesystem error: " << e.what() << std::endl;
         return EXIT_FAILURE;
     }
 
     // Initialize variables
-    map<string, vector<Posting>> invertedIndex;
-    int currentBlockSize = 0;
     int blockCount = 0;
+    // Each inverter sorts with its share of the threads
+    IndexerOptions options{numThreads, numInverters, useMmap, binaryRuns, recordPositions, resume,
+                           sortInverter, max(1, numThreads / numInverters)};
 
     try {
-        parseCollectionWritePageTable(inputFilePath, invertedIndex, currentBlockSize, MAX_BLOCK_SIZE, blockCount, outputDir, pageTableFileName);
+        if (!metricsPath.empty()) {
+            metrics.startReporter(metricsPath, metricsInterval);
+        }
+        if (!twoPassDir.empty()) {
+            // Pass 2 has one writer per tokenizer thread, each over its own docID range
+            fs::create_directories(twoPassDir);
+            options.useMmap = true;
+            TwoPassIndex twoPass(twoPassDir, isMappable(inputFilePath) ? fs::file_size(inputFilePath) : 0, numThreads);
+            parseCollectionWritePageTable(inputFilePath, MAX_BLOCK_SIZE, blockCount, outputDir, pageTableFileName,
+                                          options, &twoPass);
+            // The rest of the index directory, as the merger leaves it
+            fs::copy_file(pageTableFileName, twoPassDir + "/pagetable.tsv", fs::copy_options::overwrite_existing);
+            writeBinaryPageTable(twoPassDir + "/pagetable.tsv", twoPassDir + "/pagetable.bin");
+            if (twoPass.docIDsMapped()) {
+                fs::copy_file(outputDir + "/docmap.bin", twoPassDir + "/docmap.bin", fs::copy_options::overwrite_existing);
+            } else {
+                fs::remove(twoPassDir + "/docmap.bin");
+            }
+            fs::remove(twoPassDir + "/positions.bin");
+            fs::remove(twoPassDir + "/positionMetaData.txt");
+            metrics.stopReporter();
+            metrics.report(std::cout);
+            std::cout << "Indexing completed successfully. Final index written to " << twoPassDir << std::endl;
+            return EXIT_SUCCESS;
+        }
+        parseCollectionWritePageTable(inputFilePath, MAX_BLOCK_SIZE, blockCount, outputDir, pageTableFileName,
+                                      options);
+        metrics.stopReporter();
+        metrics.report(std::cout);
         std::cout << "Indexing completed successfully. " << blockCount << " intermediate files created." << std::endl;
     } catch (const std::exception& ex) {
         std::cerr << "Error during indexing: " << ex.what() << std::endl;
@@ -187,4 +3555,4 @@ int main() {
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
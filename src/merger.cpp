@@ -4,18 +4,47 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <filesystem>
-#include <queue>
 #include <memory>
 #include <algorithm>
 #include <cstdint>
 #include <sstream>
 #include <chrono>
+#include <cstring>
+#include <functional>
+#include <cmath>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 using namespace std;
 
 const int POSTING_PER_BLOCK = 64;
+const char RUN_FILE_MAGIC[8] = {'W', 'S', 'E', 'R', 'U', 'N', '0', '1'};
+const char POSITIONAL_RUN_FILE_MAGIC[8] = {'W', 'S', 'E', 'R', 'U', 'N', 'P', '1'};
+const char PAGE_TABLE_MAGIC[8] = {'W', 'S', 'E', 'P', 'A', 'G', 'E', '1'};
+const uint16_t NO_DOCUMENT = 0xFFFF;        // Page table slot of a docID without a document
+const uint16_t MAX_PAGE_LENGTH = 0xFFFE;    // Longer documents are stored with this length
+const size_t READER_WINDOW = 4 * 1024 * 1024; // Resident bytes kept behind each run reader
+const size_t PREFETCH_WINDOW = 1024 * 1024;   // Bytes of each run read ahead on the prefetch thread
+const size_t SEGMENT_MERGE_FACTOR = 4;           // Segments of one size tier merged together
+const uint64_t SEGMENT_TIER_BASE = 1024 * 1024;  // index.bin bytes of the smallest tier
+const int BISECTION_ITERATIONS = 20;             // Most swap rounds per bisection step
+const size_t BISECTION_LEAF = 16;                // Partitions this small keep their docID order
+const uint64_t MERGE_CHECKPOINT_BYTES = 64 * 1024 * 1024; // index.bin bytes between merge checkpoints
+const size_t MERGE_RANGES_PER_THREAD = 4;        // Term ranges of a parallel merge per thread, for balance
+const size_t MERGE_SAMPLES_PER_RANGE = 8;        // Terms sampled from each run per term range
+const uint64_t MERGE_MIN_SAMPLE_GAP = 4096;      // Fewest run bytes between two sampled terms
 
 // Struct definitions
 struct Posting {
@@ -35,16 +64,180 @@ struct BlockMetaData {
     int lastDocID;
 };
 
-// PostingFileReader class to handle reading from intermediate text files
-class PostingFileReader {
+// Per-stage throughput and latency counters for read, heap, encode and write. Each stage
+// adds up its time (summed over the threads that run it), how often it ran, the items
+// it handled and the bytes in and out, with relaxed atomic adds made once per run
+// advance, term or part file, not per posting. A reporter thread can append a JSON
+// snapshot to a file at a fixed interval; report() prints the totals.
+class Metrics {
 public:
-    PostingFileReader(const string& filepath) : infile(filepath), eof(false) {
-        if (!infile.is_open()) {
-            throw runtime_error("Failed to open intermediate file: " + filepath);
+    struct StageInfo {
+        const char* name;
+        const char* unit; // What the stage's items are
+    };
+
+    // Charges the time since the previous lap() to a stage; one clock read per call
+    class Lap {
+    public:
+        explicit Lap(Metrics& metrics) : metrics(metrics), last(chrono::steady_clock::now()) {}
+
+        void lap(size_t stage, uint64_t items = 0, uint64_t bytesIn = 0, uint64_t bytesOut = 0) {
+            auto now = chrono::steady_clock::now();
+            metrics.record(stage, now - last, items, bytesIn, bytesOut);
+            last = now;
         }
-        readNextTerm();
+
+        // Starts the next lap without charging the time since the last one to any stage
+        void reset() {
+            last = chrono::steady_clock::now();
+        }
+
+    private:
+        Metrics& metrics;
+        chrono::steady_clock::time_point last;
+    };
+
+    Metrics(const char* program, vector<StageInfo> stageInfo)
+        : program(program), info(move(stageInfo)), stages(info.size()), start(chrono::steady_clock::now()),
+          stopping(false) {}
+
+    ~Metrics() {
+        stopReporter();
+    }
+
+    void record(size_t stage, chrono::steady_clock::duration elapsed, uint64_t items,
+                uint64_t bytesIn = 0, uint64_t bytesOut = 0) {
+        Totals& totals = stages[stage];
+        totals.nanos.fetch_add(chrono::duration_cast<chrono::nanoseconds>(elapsed).count(), memory_order_relaxed);
+        totals.calls.fetch_add(1, memory_order_relaxed);
+        add(stage, items, bytesIn, bytesOut);
+    }
+
+    // Counts items or bytes without timing anything
+    void add(size_t stage, uint64_t items, uint64_t bytesIn = 0, uint64_t bytesOut = 0) {
+        Totals& totals = stages[stage];
+        totals.items.fetch_add(items, memory_order_relaxed);
+        totals.bytesIn.fetch_add(bytesIn, memory_order_relaxed);
+        totals.bytesOut.fetch_add(bytesOut, memory_order_relaxed);
+    }
+
+    // Function to render the counters as one line of JSON
+    string snapshot(bool final) const {
+        ostringstream json;
+        json << "{\"program\":\"" << program << "\",\"elapsed_seconds\":" << elapsedSeconds()
+             << ",\"final\":" << (final ? "true" : "false") << ",\"stages\":[";
+        for (size_t i = 0; i < stages.size(); ++i) {
+            double seconds = stages[i].nanos.load(memory_order_relaxed) / 1e9;
+            uint64_t items = stages[i].items.load(memory_order_relaxed);
+            json << (i ? "," : "") << "{\"stage\":\"" << info[i].name << "\",\"unit\":\"" << info[i].unit
+                 << "\",\"seconds\":" << seconds
+                 << ",\"calls\":" << stages[i].calls.load(memory_order_relaxed)
+                 << ",\"items\":" << items
+                 << ",\"bytes_in\":" << stages[i].bytesIn.load(memory_order_relaxed)
+                 << ",\"bytes_out\":" << stages[i].bytesOut.load(memory_order_relaxed)
+                 << ",\"items_per_second\":" << (seconds > 0 ? static_cast<uint64_t>(items / seconds) : 0) << "}";
+        }
+        json << "]}";
+        return json.str();
+    }
+
+    // Function to append a snapshot to path every intervalSeconds until stopReporter()
+    void startReporter(const string& path, double intervalSeconds) {
+        reportFile.open(path, ios::app);
+        if (!reportFile.is_open()) {
+            throw runtime_error("Failed to open metrics file for writing: " + path);
+        }
+        reporter = thread([this, intervalSeconds] {
+            unique_lock<mutex> lock(mtx);
+            while (!wake.wait_for(lock, chrono::duration<double>(intervalSeconds), [&] { return stopping; })) {
+                reportFile << snapshot(false) << endl;
+            }
+        });
+    }
+
+    // Function to stop the reporter and append the final snapshot
+    void stopReporter() {
+        if (!reporter.joinable()) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        reporter.join();
+        reportFile << snapshot(true) << endl;
+        reportFile.close();
+    }
+
+    // Function to print the totals per stage and the stage that took the most time
+    void report(ostream& out) const {
+        out << "Stage metrics after " << elapsedSeconds() << " seconds (busy time summed over threads):" << endl;
+        size_t busiest = 0;
+        for (size_t i = 0; i < stages.size(); ++i) {
+            double seconds = stages[i].nanos.load(memory_order_relaxed) / 1e9;
+            uint64_t items = stages[i].items.load(memory_order_relaxed);
+            out << "  " << info[i].name << ": " << seconds << " s, " << stages[i].calls.load(memory_order_relaxed)
+                << " calls, " << items << " " << info[i].unit << " ("
+                << (seconds > 0 ? static_cast<uint64_t>(items / seconds) : 0) << "/sec), "
+                << stages[i].bytesIn.load(memory_order_relaxed) / (1024 * 1024) << " MB in, "
+                << stages[i].bytesOut.load(memory_order_relaxed) / (1024 * 1024) << " MB out" << endl;
+            if (stages[i].nanos.load(memory_order_relaxed) > stages[busiest].nanos.load(memory_order_relaxed)) {
+                busiest = i;
+            }
+        }
+        out << "Busiest stage: " << info[busiest].name << endl;
+    }
+
+private:
+    struct Totals {
+        atomic<uint64_t> nanos{0};
+        atomic<uint64_t> calls{0};
+        atomic<uint64_t> items{0};
+        atomic<uint64_t> bytesIn{0};
+        atomic<uint64_t> bytesOut{0};
+    };
+
+    double elapsedSeconds() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
     }
 
+    const char* program;
+    vector<StageInfo> info;
+    vector<Totals> stages;
+    chrono::steady_clock::time_point start;
+    ofstream reportFile;
+    bool stopping;
+    mutex mtx;
+    condition_variable wake;
+    thread reporter;
+};
+
+// Stages of a merge: decoding runs, picking the next term from the heap, encoding
+// blocks and writing the index
+enum MergerStage : size_t { STAGE_READ, STAGE_HEAP, STAGE_ENCODE, STAGE_WRITE };
+
+Metrics metrics("merger", {{"read", "postings"}, {"heap", "pops"}, {"encode", "postings"}, {"write", "postings"}});
+
+// Bytes of a run a reader starts at and reads ahead up to. The readers of one term
+// range of a parallel merge get the span holding that range's entries, so they neither
+// walk their runs from the start nor read far ahead past the range.
+struct RunSpan {
+    uint64_t begin = 0;
+    uint64_t end = UINT64_MAX;
+};
+
+// A term of a run and the offset its entry starts at
+struct TermSample {
+    string term;
+    uint64_t offset;
+};
+
+// PostingFileReader interface over one sorted intermediate run
+class PostingFileReader {
+public:
+    virtual ~PostingFileReader() = default;
+
     bool hasNext() const {
         return !eof;
     }
@@ -57,304 +250,2718 @@ public:
         return currentPostings;
     }
 
-    void readNextTerm() {
-        if (!getline(infile, currentLine)) {
+    // Token positions of the current postings, termFreq per posting, in posting order
+    const vector<uint32_t>& getCurrentPositions() const {
+        return currentPositions;
+    }
+
+    bool hasPositions() const {
+        return positional;
+    }
+
+    // Function to hand the current term to the caller by swapping strings; the reader
+    // must be advanced before its term is looked at again
+    void takeCurrentTerm(string& term) {
+        term.swap(currentTerm);
+    }
+
+    // Function to append the current postings and positions to the caller's. Empty
+    // vectors are swapped with the reader's instead of copied, and the reader refills
+    // whatever it gets back when it is advanced.
+    void takeCurrentPostings(vector<Posting>& postings, vector<uint32_t>& positions) {
+        if (postings.empty()) {
+            postings.swap(currentPostings);
+        } else {
+            postings.insert(postings.end(), currentPostings.begin(), currentPostings.end());
+        }
+        if (positions.empty()) {
+            positions.swap(currentPositions);
+        } else {
+            positions.insert(positions.end(), currentPositions.begin(), currentPositions.end());
+        }
+    }
+
+    virtual void readNextTerm() = 0;
+
+    // Function to move past every term up to and including term
+    virtual void skipPast(const string& term) {
+        while (!eof && currentTerm <= term) {
+            readNextTerm();
+        }
+    }
+
+    // Function to sample about count terms spread evenly over the bytes of the run, in
+    // term order, without moving the reader. Inputs that a reader cannot start in the
+    // middle of give no samples and are read from their start.
+    virtual void sampleTerms(size_t, vector<TermSample>&) {}
+
+protected:
+    bool eof = false;
+    bool positional = false;
+    string currentTerm;
+    vector<Posting> currentPostings;
+    vector<uint32_t> currentPositions;
+};
+
+// Background thread that reads ahead in mapped runs. It faults in each requested
+// range a page at a time, so the disk reads of a wide merge happen here instead of
+// stalling the merge loop on one run after another. A run cancels its requests
+// before it is unmapped.
+class RunPrefetcher {
+public:
+    ~RunPrefetcher() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        changed.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    void request(const void* owner, const uint8_t* start, size_t length) {
+        lock_guard<mutex> lock(mtx);
+        if (!worker.joinable()) {
+            worker = thread([this] { run(); });
+        }
+        requests.push_back(Request{owner, start, length});
+        changed.notify_all();
+    }
+
+    // Function to drop owner's queued requests and wait for the one being served
+    void cancel(const void* owner) {
+        unique_lock<mutex> lock(mtx);
+        requests.erase(remove_if(requests.begin(), requests.end(),
+                                 [&](const Request& request) { return request.owner == owner; }),
+                       requests.end());
+        changed.wait(lock, [&] { return active != owner; });
+    }
+
+private:
+    struct Request {
+        const void* owner;
+        const uint8_t* start;
+        size_t length;
+    };
+
+    void run() {
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            changed.wait(lock, [&] { return stopping || !requests.empty(); });
+            if (stopping) {
+                return;
+            }
+            Request request = requests.front();
+            requests.pop_front();
+            active = request.owner;
+            lock.unlock();
+
+            uintptr_t first = reinterpret_cast<uintptr_t>(request.start) & ~(pageSize - 1);
+            madvise(reinterpret_cast<void*>(first), reinterpret_cast<uintptr_t>(request.start) + request.length - first,
+                    MADV_WILLNEED);
+            uint8_t sum = 0;
+            for (size_t i = 0; i < request.length; i += pageSize) {
+                sum += request.start[i];
+            }
+            sink = sum;
+
+            lock.lock();
+            active = nullptr;
+            changed.notify_all();
+        }
+    }
+
+    deque<Request> requests;
+    const void* active = nullptr; // Owner of the range being read
+    bool stopping = false;
+    volatile uint8_t sink = 0;    // Keeps the page reads from being optimized away
+    mutex mtx;
+    condition_variable changed;
+    thread worker;
+};
+
+RunPrefetcher runPrefetcher;
+
+// Read-only mapping of one run file for a reader that moves through it front to back.
+// advance() hands pages more than READER_WINDOW behind the reader back to the kernel,
+// so a wide merge stays within its memory budget, and asks the prefetch thread for the
+// next PREFETCH_WINDOW once the reader is half way through the last one, up to the
+// end of the reader's span.
+class MappedRun {
+public:
+    MappedRun(const string& filepath, const RunSpan& span = RunSpan())
+        : data(nullptr), size(0), dropped(0), prefetched(0) {
+        int fd = open(filepath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Failed to open intermediate file: " + filepath);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error("Failed to stat intermediate file: " + filepath);
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size > 0) {
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("Failed to mmap intermediate file: " + filepath);
+            }
+            data = static_cast<const uint8_t*>(addr);
+            madvise(addr, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        readAheadEnd = min<uint64_t>(size, span.end);
+        dropped = min<uint64_t>(size, span.begin) & ~(size_t(sysconf(_SC_PAGESIZE)) - 1);
+        prefetched = dropped;
+    }
+
+    ~MappedRun() {
+        if (data) {
+            runPrefetcher.cancel(this);
+            munmap(const_cast<uint8_t*>(data), size);
+        }
+    }
+
+    MappedRun(const MappedRun&) = delete;
+    MappedRun& operator=(const MappedRun&) = delete;
+
+    const uint8_t* bytes() const {
+        return data;
+    }
+
+    size_t length() const {
+        return size;
+    }
+
+    void advance(size_t pos) {
+        if (pos - dropped >= 2 * READER_WINDOW) {
+            size_t dropEnd = (pos - READER_WINDOW) & ~(size_t(sysconf(_SC_PAGESIZE)) - 1);
+            madvise(const_cast<uint8_t*>(data) + dropped, dropEnd - dropped, MADV_DONTNEED);
+            dropped = dropEnd;
+        }
+        if (prefetched < readAheadEnd && pos + PREFETCH_WINDOW / 2 >= prefetched && pos < readAheadEnd) {
+            size_t start = max(prefetched, pos);
+            prefetched = min(readAheadEnd, start + PREFETCH_WINDOW);
+            runPrefetcher.request(this, data + start, prefetched - start);
+        }
+    }
+
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t readAheadEnd; // Nothing past this offset is prefetched
+    size_t dropped;    // Pages before this offset have been released
+    size_t prefetched; // Bytes before this offset have been requested from the prefetcher
+};
+
+// TextPostingFileReader class to handle reading from intermediate text files.
+// Lines of "term docID:freq docID:freq ..." are parsed in place in the mapped run,
+// with no per-posting strings.
+class TextPostingFileReader : public PostingFileReader {
+public:
+    TextPostingFileReader(const string& filepath, const RunSpan& span = RunSpan())
+        : filepath(filepath), run(filepath, span), pos(min<uint64_t>(span.begin, run.length())) {
+        readNextTerm();
+    }
+
+    void readNextTerm() override {
+        const char* text = reinterpret_cast<const char*>(run.bytes());
+        size_t size = run.length();
+        // An empty line has no term and is skipped
+        while (pos < size && text[pos] == '\n') {
+            pos++;
+        }
+        if (pos == size) {
+            eof = true;
+            return;
+        }
+
+        const char* p = text + pos;
+        const char* end = text + size;
+        const char* termEnd = p;
+        while (termEnd < end && *termEnd != ' ' && *termEnd != '\n') {
+            termEnd++;
+        }
+        currentTerm.assign(p, termEnd);
+        p = termEnd;
+
+        currentPostings.clear();
+        while (p < end && *p == ' ') {
+            p++;
+            int docID = parseNumber(p, end);
+            if (p == end || *p != ':') {
+                throw runtime_error("Malformed posting for term " + currentTerm + " in " + filepath);
+            }
+            p++;
+            int termFreq = parseNumber(p, end);
+            currentPostings.push_back(Posting{docID, termFreq});
+        }
+        if (p < end && *p != '\n') {
+            throw runtime_error("Malformed posting for term " + currentTerm + " in " + filepath);
+        }
+        pos = (p < end) ? p - text + 1 : size;
+        run.advance(pos);
+    }
+
+    // Steps over whole lines by their terms without parsing their postings
+    void skipPast(const string& term) override {
+        if (eof || currentTerm > term) {
+            return;
+        }
+        const char* text = reinterpret_cast<const char*>(run.bytes());
+        size_t size = run.length();
+        while (pos < size) {
+            const char* line = text + pos;
+            size_t termLength = 0;
+            while (pos + termLength < size && line[termLength] != ' ' && line[termLength] != '\n') {
+                termLength++;
+            }
+            if (termLength > 0 && string_view(line, termLength) > term) {
+                break;
+            }
+            const void* newline = memchr(line, '\n', size - pos);
+            pos = newline ? static_cast<const char*>(newline) - text + 1 : size;
+        }
+        readNextTerm();
+    }
+
+    // Jumps to evenly spaced offsets and takes the term of the next line from each
+    void sampleTerms(size_t count, vector<TermSample>& samples) override {
+        const char* text = reinterpret_cast<const char*>(run.bytes());
+        size_t size = run.length();
+        size_t last = SIZE_MAX;
+        for (size_t i = 0; i < count; ++i) {
+            size_t line = i * (size / count);
+            if (line > 0) {
+                const void* newline = memchr(text + line - 1, '\n', size - line + 1);
+                if (newline == nullptr) {
+                    break;
+                }
+                line = static_cast<const char*>(newline) - text + 1;
+            }
+            while (line < size && text[line] == '\n') {
+                line++;
+            }
+            if (line == size) {
+                break;
+            }
+            if (line == last) {
+                continue;
+            }
+            size_t termEnd = line;
+            while (termEnd < size && text[termEnd] != ' ' && text[termEnd] != '\n') {
+                termEnd++;
+            }
+            samples.push_back(TermSample{string(text + line, termEnd - line), line});
+            last = line;
+        }
+    }
+
+private:
+    // Function to parse a decimal docID or frequency and move past it. Digits are
+    // tested with one unsigned compare each; values past INT_MAX are rejected.
+    int parseNumber(const char*& p, const char* end) const {
+        const char* start = p;
+        uint64_t value = 0;
+        while (p < end && static_cast<unsigned>(*p - '0') < 10 && p - start < 11) {
+            value = value * 10 + static_cast<unsigned>(*p - '0');
+            p++;
+        }
+        if (p == start || value > static_cast<uint64_t>(INT32_MAX)) {
+            throw runtime_error("Invalid docID or termFreq for term " + currentTerm + " in " + filepath);
+        }
+        return static_cast<int>(value);
+    }
+
+    string filepath;
+    MappedRun run;
+    size_t pos; // Start of the next line
+};
+
+// BinaryPostingFileReader class to read binary runs through a mapped run.
+// Each term is uint32 termLength, term bytes, uint32 postingCount, uint32 payloadBytes
+// and then varbyte (docID gap, termFreq) pairs. Positional runs add uint32 positionBytes
+// and varbyte position gaps, termFreq per posting, restarting from 0 at each posting.
+class BinaryPostingFileReader : public PostingFileReader {
+public:
+    BinaryPostingFileReader(const string& filepath, const RunSpan& span = RunSpan())
+        : filepath(filepath), run(filepath, span), data(run.bytes()), size(run.length()), pos(0) {
+        if (size < sizeof(RUN_FILE_MAGIC)) {
+            throw runtime_error("Not a binary intermediate file: " + filepath);
+        }
+        positional = memcmp(data, POSITIONAL_RUN_FILE_MAGIC, sizeof(RUN_FILE_MAGIC)) == 0;
+        if (!positional && memcmp(data, RUN_FILE_MAGIC, sizeof(RUN_FILE_MAGIC)) != 0) {
+            throw runtime_error("Not a binary intermediate file: " + filepath);
+        }
+        pos = max<uint64_t>(sizeof(RUN_FILE_MAGIC), min<uint64_t>(span.begin, size));
+        readNextTerm();
+    }
+
+    void readNextTerm() override {
+        if (pos == size) {
             eof = true;
             return;
         }
 
-        // Parse the current line
-        istringstream iss(currentLine);
-        iss >> currentTerm;
+        uint32_t termLength = readUint32();
+        need(termLength);
+        currentTerm.assign(reinterpret_cast<const char*>(data + pos), termLength);
+        pos += termLength;
+        uint32_t postingCount = readUint32();
+        uint32_t payloadBytes = readUint32();
+        need(payloadBytes);
+
+        const uint8_t* p = data + pos;
+        const uint8_t* end = p + payloadBytes;
+        currentPostings.resize(postingCount);
+        uint32_t docID = 0;
+        for (auto& posting : currentPostings) {
+            docID += readVarByte(p, end);
+            posting.docID = static_cast<int>(docID);
+            posting.termFreq = static_cast<int>(readVarByte(p, end));
+        }
+        if (p != end) {
+            throw runtime_error("Corrupt posting payload in intermediate file: " + filepath);
+        }
+        pos += payloadBytes;
+
+        if (positional) {
+            uint32_t positionBytes = readUint32();
+            need(positionBytes);
+            p = data + pos;
+            end = p + positionBytes;
+            currentPositions.clear();
+            for (const auto& posting : currentPostings) {
+                uint32_t position = 0;
+                for (int i = 0; i < posting.termFreq; ++i) {
+                    position += readVarByte(p, end);
+                    currentPositions.push_back(position);
+                }
+            }
+            if (p != end) {
+                throw runtime_error("Corrupt position payload in intermediate file: " + filepath);
+            }
+            pos += positionBytes;
+        }
+
+        run.advance(pos);
+    }
+
+    // Steps over whole terms by their byte counts without decoding their postings
+    void skipPast(const string& term) override {
+        if (eof || currentTerm > term) {
+            return;
+        }
+        while (pos < size) {
+            size_t termStart = pos;
+            uint32_t termLength = readUint32();
+            need(termLength);
+            if (string_view(reinterpret_cast<const char*>(data + pos), termLength) > term) {
+                pos = termStart;
+                break;
+            }
+            pos += termLength;
+            skipPostings();
+        }
+        readNextTerm();
+    }
+
+    // Steps over the terms by their byte counts, taking one about every size / count bytes
+    void sampleTerms(size_t count, vector<TermSample>& samples) override {
+        size_t readerPos = pos;
+        size_t stride = max<size_t>(1, size / count);
+        size_t next = 0;
+        pos = sizeof(RUN_FILE_MAGIC);
+        while (pos < size) {
+            size_t termStart = pos;
+            uint32_t termLength = readUint32();
+            need(termLength);
+            if (termStart >= next) {
+                samples.push_back(TermSample{string(reinterpret_cast<const char*>(data + pos), termLength), termStart});
+                next = termStart + stride;
+            }
+            pos += termLength;
+            skipPostings();
+        }
+        pos = readerPos;
+    }
+
+private:
+    void need(size_t bytes) const {
+        if (size - pos < bytes) {
+            throw runtime_error("Truncated intermediate file: " + filepath);
+        }
+    }
+
+    // Function to move past the posting count and payloads of the term just read
+    void skipPostings() {
+        readUint32(); // Posting count
+        uint32_t payloadBytes = readUint32();
+        need(payloadBytes);
+        pos += payloadBytes;
+        if (positional) {
+            uint32_t positionBytes = readUint32();
+            need(positionBytes);
+            pos += positionBytes;
+        }
+    }
+
+    uint32_t readUint32() {
+        need(sizeof(uint32_t));
+        uint32_t value;
+        memcpy(&value, data + pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+
+    uint32_t readVarByte(const uint8_t*& p, const uint8_t* end) const {
+        uint32_t value = 0;
+        int shift = 0;
+        while (p < end) {
+            uint8_t byte = *p++;
+            value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+            shift += 7;
+        }
+        throw runtime_error("Corrupt posting payload in intermediate file: " + filepath);
+    }
+
+    string filepath;
+    MappedRun run;
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+};
+
+// Function to append a varbyte, low 7 bits first, with 0 taking one byte
+void appendVarByte(vector<uint8_t>& bytes, uint32_t value) {
+    while (value > 0x7F) {
+        bytes.push_back(static_cast<uint8_t>(value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
+}
+
+// Function to append the positions of one posting, each as the gap from the previous one
+void appendPositionGaps(vector<uint8_t>& bytes, const uint32_t* positions, int count) {
+    uint32_t previousPosition = 0;
+    for (int i = 0; i < count; ++i) {
+        appendVarByte(bytes, positions[i] - previousPosition);
+        previousPosition = positions[i];
+    }
+}
+
+// SegmentReader class to read back a finished index (a segment directory) term by term,
+// so that segments can be merged like runs. Lists are decoded from index.bin in lexicon
+// order with their block sizes from blockMetaData.txt, positions likewise if present.
+class SegmentReader : public PostingFileReader {
+public:
+    SegmentReader(const string& segmentDir)
+        : segmentDir(segmentDir),
+          lexiconFile(segmentDir + "/lexicon.txt"),
+          blockMetaFile(segmentDir + "/blockMetaData.txt"),
+          indexFile(segmentDir + "/index.bin", ios::binary) {
+        if (!lexiconFile.is_open() || !blockMetaFile.is_open() || !indexFile.is_open()) {
+            throw runtime_error("Failed to open segment: " + segmentDir);
+        }
+        if (fs::exists(segmentDir + "/positions.bin")) {
+            positional = true;
+            positionMetaFile.open(segmentDir + "/positionMetaData.txt");
+            positionsFile.open(segmentDir + "/positions.bin", ios::binary);
+            if (!positionMetaFile.is_open() || !positionsFile.is_open()) {
+                throw runtime_error("Failed to open positions of segment: " + segmentDir);
+            }
+        }
+        readNextTerm();
+    }
+
+    void readNextTerm() override {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t docFreq;
+        if (!(lexiconFile >> currentTerm >> offset >> length >> docFreq)) {
+            eof = true;
+            return;
+        }
 
+        // Gaps run on across the blocks of a list
         currentPostings.clear();
-        string postingStr;
-        while (iss >> postingStr) {
+        currentPositions.clear();
+        uint32_t docID = 0;
+        for (uint32_t first = 0; first < docFreq; first += POSTING_PER_BLOCK) {
+            uint32_t count = min<uint32_t>(POSTING_PER_BLOCK, docFreq - first);
+            uint32_t blockSize;
+            int lastDocID;
+            if (!(blockMetaFile >> blockSize >> lastDocID)) {
+                throw runtime_error("Block meta data ends early in segment: " + segmentDir);
+            }
+            bytes.resize(blockSize);
+            indexFile.read(reinterpret_cast<char*>(bytes.data()), blockSize);
+            numbers.clear();
+            decodeVarBytes(bytes, numbers);
+            if (numbers.size() + 1 == 2 * count && first == 0) {
+                numbers.insert(numbers.begin(), 0); // A first docID of 0 is written as no bytes
+            }
+            if (!indexFile || numbers.size() != 2 * count) {
+                throw runtime_error("Corrupt block in segment: " + segmentDir);
+            }
+            for (uint32_t i = 0; i < count; ++i) {
+                docID += numbers[i];
+                currentPostings.push_back(Posting{static_cast<int>(docID), static_cast<int>(numbers[count + i])});
+            }
+
+            if (positional) {
+                uint32_t positionBlockSize;
+                if (!(positionMetaFile >> positionBlockSize)) {
+                    throw runtime_error("Position meta data ends early in segment: " + segmentDir);
+                }
+                bytes.resize(positionBlockSize);
+                positionsFile.read(reinterpret_cast<char*>(bytes.data()), positionBlockSize);
+                numbers.clear();
+                decodeVarBytes(bytes, numbers);
+                size_t next = 0;
+                for (uint32_t i = 0; i < count; ++i) {
+                    uint32_t position = 0;
+                    for (int j = 0; j < currentPostings[first + i].termFreq; ++j) {
+                        if (next == numbers.size()) {
+                            throw runtime_error("Corrupt position block in segment: " + segmentDir);
+                        }
+                        position += numbers[next++];
+                        currentPositions.push_back(position);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    static void decodeVarBytes(const vector<uint8_t>& bytes, vector<uint32_t>& numbers) {
+        uint32_t value = 0;
+        int shift = 0;
+        for (uint8_t byte : bytes) {
+            value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) {
+                numbers.push_back(value);
+                value = 0;
+                shift = 0;
+            }
+        }
+    }
+
+    string segmentDir;
+    ifstream lexiconFile;
+    ifstream blockMetaFile;
+    ifstream indexFile;
+    ifstream positionMetaFile;
+    ifstream positionsFile;
+    vector<uint8_t> bytes;
+    vector<uint32_t> numbers;
+};
+
+// Writer for binary runs produced by intermediate merge passes, in the indexer's format
+class RunFileWriter {
+public:
+    RunFileWriter(const string& filepath, bool positional) : positional(positional), buffer(1 << 20) {
+        outfile.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        outfile.open(filepath, ios::binary);
+        if (!outfile.is_open()) {
+            throw runtime_error("Failed to open intermediate file for writing: " + filepath);
+        }
+        outfile.write(positional ? POSITIONAL_RUN_FILE_MAGIC : RUN_FILE_MAGIC, sizeof(RUN_FILE_MAGIC));
+    }
+
+    void writeTerm(const string& term, const vector<Posting>& postings, const vector<uint32_t>& positions) {
+        payload.clear();
+        uint32_t previousDocID = 0;
+        for (const auto& posting : postings) {
+            appendVarByte(payload, static_cast<uint32_t>(posting.docID) - previousDocID);
+            appendVarByte(payload, static_cast<uint32_t>(posting.termFreq));
+            previousDocID = posting.docID;
+        }
+        writeUint32(term.size());
+        outfile.write(term.data(), term.size());
+        writeUint32(postings.size());
+        writeUint32(payload.size());
+        outfile.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+
+        if (positional) {
+            payload.clear();
+            const uint32_t* next = positions.data();
+            for (const auto& posting : postings) {
+                appendPositionGaps(payload, next, posting.termFreq);
+                next += posting.termFreq;
+            }
+            writeUint32(payload.size());
+            outfile.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+        }
+    }
+
+    void close() {
+        outfile.close();
+        if (outfile.fail()) {
+            throw runtime_error("Failed to write intermediate file");
+        }
+    }
+
+private:
+    void writeUint32(uint32_t value) {
+        outfile.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
 
-            size_t colonPos = postingStr.find(':');
-            if (colonPos == string::npos) {
-                throw runtime_error("Malformed posting: " + postingStr);
+    bool positional;
+    ofstream outfile;
+    vector<char> buffer;
+    vector<uint8_t> payload;
+};
+
+// Function to open a run with the reader matching its format
+unique_ptr<PostingFileReader> openPostingFileReader(const string& filepath, const RunSpan& span = RunSpan()) {
+    if (fs::is_directory(filepath)) {
+        return make_unique<SegmentReader>(filepath);
+    }
+    if (fs::path(filepath).extension() == ".bin") {
+        return make_unique<BinaryPostingFileReader>(filepath, span);
+    }
+    return make_unique<TextPostingFileReader>(filepath, span);
+}
+
+// Tournament tree of losers over the current terms of k readers. Leaves are the
+// readers, each inner node keeps the reader that lost the match played there, and
+// node 0 the overall winner: the reader with the smallest term, the earliest run on
+// ties, so postings stay in run order. After the winner is advanced, replay() plays
+// its leaf's path to the root again: one compare per level, against the readers'
+// own term strings, so nothing is copied. Exhausted readers lose every match.
+class LoserTree {
+public:
+    explicit LoserTree(const vector<unique_ptr<PostingFileReader>>& readers)
+        : readers(readers), k(readers.size()), nodes(max<size_t>(k, 1), NONE) {
+        // Each inner node keeps the first contestant to reach it; the second plays it
+        for (size_t i = 0; i < k; ++i) {
+            size_t winner = i;
+            size_t node = (i + k) / 2;
+            for (; node > 0; node /= 2) {
+                if (nodes[node] == NONE) {
+                    nodes[node] = winner;
+                    break;
+                }
+                if (less(nodes[node], winner)) {
+                    swap(nodes[node], winner);
+                }
+            }
+            if (node == 0) {
+                nodes[0] = winner;
             }
+        }
+    }
+
+    bool empty() const {
+        return k == 0 || !readers[nodes[0]]->hasNext();
+    }
+
+    // Reader with the smallest current term
+    size_t top() const {
+        return nodes[0];
+    }
 
-            int docID = stoi(postingStr.substr(0, colonPos));
-            int termFreq = stoi(postingStr.substr(colonPos + 1));
+    // Function to restore the tree after reader i, the winner, has been advanced
+    void replay(size_t i) {
+        size_t winner = i;
+        for (size_t node = (i + k) / 2; node > 0; node /= 2) {
+            if (less(nodes[node], winner)) {
+                swap(nodes[node], winner);
+            }
+        }
+        nodes[0] = winner;
+    }
+
+private:
+    static constexpr size_t NONE = SIZE_MAX;
+
+    bool less(size_t a, size_t b) const {
+        if (!readers[a]->hasNext()) {
+            return false;
+        }
+        if (!readers[b]->hasNext()) {
+            return true;
+        }
+        int order = readers[a]->getCurrentTerm().compare(readers[b]->getCurrentTerm());
+        return order < 0 || (order == 0 && a < b);
+    }
+
+    const vector<unique_ptr<PostingFileReader>>& readers;
+    size_t k;
+    vector<size_t> nodes; // 1..k-1 losers of the inner matches, 0 the winner
+};
+
+// Function to get the block number of an intermediate file name
+long runNumber(const string& filepath) {
+    string stem = fs::path(filepath).stem().string();
+    size_t underscore = stem.rfind('_');
+    if (underscore == string::npos) {
+        return -1;
+    }
+    return strtol(stem.c_str() + underscore + 1, nullptr, 10);
+}
+
+// Function to list intermediate files (text .txt or binary .bin runs)
+vector<string> listIntermediateFiles(const string& directory) {
+    vector<string> files;
+    for (const auto& entry : fs::directory_iterator(directory)) {
+        string name = entry.path().filename().string();
+        string extension = entry.path().extension().string();
+        if (entry.is_regular_file() && name.rfind("intermediate_", 0) == 0 && (extension == ".txt" || extension == ".bin")) {
+            files.push_back(entry.path().string());
+        }
+    }
+    // Merge in block order so postings of a term stay in docID order; a plain
+    // string sort would put intermediate_10 before intermediate_2
+    sort(files.begin(), files.end(), [](const string& a, const string& b) {
+        long runA = runNumber(a);
+        long runB = runNumber(b);
+        return runA != runB ? runA < runB : a < b;
+    });
+    return files;
+}
+
+// Function to write the Lexicon in text format
+void writeLexiconText(const string& lexiconFilePath, const vector<LexiconEntry>& lexicon) {
+    ofstream lexFile(lexiconFilePath);
+    if (!lexFile.is_open()) {
+        throw runtime_error("Failed to open lexicon file for writing: " + lexiconFilePath);
+    }
+
+    for (const auto& entry : lexicon) {
+        // Write term, offset, length, and docFreq separated by spaces
+        lexFile << entry.term << " " << entry.offset << " " << entry.length << " " << entry.docFreq << "\n";
+    }
+
+    lexFile.close();
+}
+
+// Function to turn int to bytes
+vector<uint8_t> intToVarByte(int num) {
+    vector<uint8_t> bytes;
+
+    while (num > 0) {
+        // Extract the 7 least significant bits
+        uint8_t byte = num & 0x7F;
+        // Set the high bit to indicate more bytes if needed
+        if (num > 0x7F)
+        {
+            byte |= 0x80;
+        }
+        bytes.push_back(byte);
+        // Shift the value to the right by 7 bits
+        num >>= 7;
+    }
+    return bytes;
+}
+
+//function to turn bytes to int
+int byteToInt(const vector<uint8_t>& bytes) {
+    int value = 0;
+    int shift = 0;
+
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        value |= (bytes[i] & 0x7F) << shift; // Mask the highest bit
+        shift += 7;
+
+        if (bytes[i] & 0x80) {  // If the highest bit is 1, continue
+            continue;
+        }
+        break; // Exit if the highest bit is 0
+    }
+
+    return value;
+}
+   
+
+// Terms of a merge after firstAfter up to and including lastTerm, where "" leaves that
+// end open. spans, if not empty, holds for each run the bytes its terms in the range
+// are found in.
+struct MergeRange {
+    string firstAfter;
+    string lastTerm;
+    vector<RunSpan> spans;
+};
+
+// Function to perform a k-way merge of sorted runs. emitTerm is called once per term,
+// in lexicographic order, with the postings of all runs concatenated in run order
+// and, for positional runs, their positions likewise. Only the terms of range are
+// merged, all of them by default.
+void mergeRuns(const vector<string>& files,
+               const function<void(const string&, vector<Posting>&, vector<uint32_t>&)>& emitTerm,
+               const MergeRange& range = MergeRange()) {
+    // Initialize readers
+    vector<unique_ptr<PostingFileReader>> readers;
+    for (size_t i = 0; i < files.size(); ++i) {
+        readers.emplace_back(openPostingFileReader(files[i], range.spans.empty() ? RunSpan() : range.spans[i]));
+        if (!range.firstAfter.empty()) {
+            readers.back()->skipPast(range.firstAfter);
+        }
+        if (readers.back()->hasPositions() != readers.front()->hasPositions()) {
+            throw runtime_error("Intermediate files mix positional and non-positional runs: " + files[i]);
+        }
+    }
+
+    // Input bytes are counted once per merge, by the range that runs to the last term
+    if (range.lastTerm.empty()) {
+        uint64_t inputBytes = 0;
+        for (const auto& file : files) {
+            inputBytes += fs::file_size(fs::is_directory(file) ? file + "/index.bin" : file);
+        }
+        metrics.add(STAGE_READ, 0, inputBytes);
+    }
+
+    // The term and postings buffers are reused from term to term, trading places with
+    // the winning reader's
+    LoserTree tree(readers);
+    string term;
+    vector<Posting> mergedPostings;
+    vector<uint32_t> mergedPositions;
+    Metrics::Lap lap(metrics);
+    while (!tree.empty() && (range.lastTerm.empty() || readers[tree.top()]->getCurrentTerm() <= range.lastTerm)) {
+        // Collect all postings for the smallest term from all readers, in run order.
+        // A run's next term is larger, so an advanced reader cannot match again.
+        size_t winner = tree.top();
+        readers[winner]->takeCurrentTerm(term);
+        do {
+            size_t postingsBefore = mergedPostings.size();
+            readers[winner]->takeCurrentPostings(mergedPostings, mergedPositions);
+            readers[winner]->readNextTerm();
+            lap.lap(STAGE_READ, mergedPostings.size() - postingsBefore);
+            tree.replay(winner);
+            winner = tree.top();
+            lap.lap(STAGE_HEAP, 1);
+        } while (!tree.empty() && readers[winner]->getCurrentTerm() == term);
+
+        emitTerm(term, mergedPostings, mergedPositions);
+        mergedPostings.clear();
+        mergedPositions.clear();
+        lap.reset();
+    }
+}
+
+// Function to merge runs in passes until at most fanIn remain. Each pass merges
+// groups of consecutive runs, so postings stay in docID order, into binary runs
+// under workDir. Returns the runs the final merge should read.
+vector<string> reduceRunsToFanIn(vector<string> files, size_t fanIn, const string& workDir, bool positional) {
+    int pass = 0;
+    while (files.size() > fanIn) {
+        fs::create_directories(workDir);
+        vector<string> merged;
+        for (size_t first = 0; first < files.size(); first += fanIn) {
+            vector<string> group(files.begin() + first, files.begin() + min(files.size(), first + fanIn));
+            string output = workDir + "/pass" + to_string(pass) + "_" + to_string(merged.size()) + ".bin";
+            if (group.size() == 1) {
+                merged.push_back(group[0]);
+                continue;
+            }
+            RunFileWriter writer(output, positional);
+            mergeRuns(group, [&](const string& term, vector<Posting>& postings, vector<uint32_t>& positions) {
+                auto writeStart = chrono::steady_clock::now();
+                writer.writeTerm(term, postings, positions);
+                metrics.record(STAGE_WRITE, chrono::steady_clock::now() - writeStart, postings.size());
+            });
+            writer.close();
+            metrics.add(STAGE_WRITE, 0, 0, fs::file_size(output));
+            // Runs written by an earlier pass are no longer needed
+            for (const auto& file : group) {
+                if (fs::path(file).parent_path() == fs::path(workDir)) {
+                    fs::remove(file);
+                }
+            }
+            merged.push_back(output);
+        }
+        cout << "Merge pass " << pass << ": " << files.size() << " runs -> " << merged.size() << " runs" << endl;
+        files.swap(merged);
+        pass++;
+    }
+    return files;
+}
+
+// Function to sort postings by docID, moving each posting's positions along with it
+void sortPostingsByDocID(vector<Posting>& postings, vector<uint32_t>& positions) {
+    vector<size_t> order(postings.size());
+    vector<size_t> positionStart(postings.size());
+    size_t next = 0;
+    for (size_t i = 0; i < postings.size(); ++i) {
+        order[i] = i;
+        positionStart[i] = next;
+        next += postings[i].termFreq;
+    }
+    stable_sort(order.begin(), order.end(),
+                [&](size_t a, size_t b) { return postings[a].docID < postings[b].docID; });
+
+    vector<Posting> sortedPostings;
+    vector<uint32_t> sortedPositions;
+    for (size_t i : order) {
+        sortedPostings.push_back(postings[i]);
+        if (!positions.empty()) {
+            sortedPositions.insert(sortedPositions.end(), positions.begin() + positionStart[i],
+                                   positions.begin() + positionStart[i] + postings[i].termFreq);
+        }
+    }
+    postings.swap(sortedPostings);
+    positions.swap(sortedPositions);
+}
+
+// Deleted docIDs of one index, one bit per docID from base in 64-bit words. Stored
+// next to the index as deleted.bin: uint64 base, uint64 wordCount, then the words.
+class DeletionBitmap {
+public:
+    bool empty() const {
+        return words.empty();
+    }
+
+    bool contains(int docID) const {
+        if (docID < base) {
+            return false;
+        }
+        uint64_t bit = static_cast<uint64_t>(docID - base);
+        return bit / 64 < words.size() && (words[bit / 64] >> (bit % 64) & 1);
+    }
+
+    // Returns false if docID was already deleted
+    bool insert(int docID) {
+        if (contains(docID)) {
+            return false;
+        }
+        if (words.empty()) {
+            base = docID & ~63;
+        } else if (docID < base) {
+            // Grow downwards in whole words so existing bits keep their word offsets
+            int newBase = docID & ~63;
+            words.insert(words.begin(), (base - newBase) / 64, 0);
+            base = newBase;
+        }
+        uint64_t bit = static_cast<uint64_t>(docID - base);
+        if (bit / 64 >= words.size()) {
+            words.resize(bit / 64 + 1, 0);
+        }
+        words[bit / 64] |= uint64_t(1) << (bit % 64);
+        return true;
+    }
+
+    void insertAll(const DeletionBitmap& other) {
+        for (size_t w = 0; w < other.words.size(); ++w) {
+            for (uint64_t word = other.words[w]; word != 0; word &= word - 1) {
+                insert(other.base + static_cast<int>(w * 64 + __builtin_ctzll(word)));
+            }
+        }
+    }
+
+    size_t count() const {
+        size_t total = 0;
+        for (uint64_t word : words) {
+            total += __builtin_popcountll(word);
+        }
+        return total;
+    }
+
+    bool operator==(const DeletionBitmap& other) const {
+        return count() == other.count() && (empty() || (base == other.base && words == other.words));
+    }
+
+    // Function to load indexDir/deleted.bin; a missing file means nothing is deleted
+    static DeletionBitmap load(const string& indexDir) {
+        DeletionBitmap bitmap;
+        ifstream file(indexDir + "/deleted.bin", ios::binary);
+        if (!file.is_open()) {
+            return bitmap;
+        }
+        uint64_t base = 0, wordCount = 0;
+        file.read(reinterpret_cast<char*>(&base), sizeof(base));
+        file.read(reinterpret_cast<char*>(&wordCount), sizeof(wordCount));
+        bitmap.base = static_cast<int>(base);
+        bitmap.words.resize(wordCount);
+        file.read(reinterpret_cast<char*>(bitmap.words.data()), wordCount * sizeof(uint64_t));
+        if (!file) {
+            throw runtime_error("Truncated deletion bitmap: " + indexDir + "/deleted.bin");
+        }
+        return bitmap;
+    }
+
+    // Function to replace indexDir/deleted.bin; the rename keeps readers from seeing a partial file
+    void save(const string& indexDir) const {
+        string tempPath = indexDir + "/deleted.bin.tmp";
+        ofstream file(tempPath, ios::binary);
+        uint64_t header[2] = {static_cast<uint64_t>(base), words.size()};
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint64_t));
+        file.close();
+        if (file.fail()) {
+            throw runtime_error("Failed to write deletion bitmap: " + tempPath);
+        }
+        fs::rename(tempPath, indexDir + "/deleted.bin");
+    }
+
+private:
+    int base = 0;
+    vector<uint64_t> words;
+};
+
+// DocIDs of an index or of a set of runs mapped to the docIDs of the collection. Stored
+// next to them as docmap.bin: int64 first docID, uint64 count, then an int64 docID per
+// docID from the first, -1 where there is none. Without one, docIDs map to themselves.
+class DocIDMap {
+public:
+    bool empty() const {
+        return ids.empty();
+    }
+
+    int64_t map(int docID) const {
+        uint64_t slot = static_cast<uint64_t>(static_cast<int64_t>(docID) - base); // Wraps around below base
+        return slot < ids.size() && ids[slot] >= 0 ? ids[slot] : docID;
+    }
+
+    void set(int docID, int64_t mapped) {
+        if (ids.empty()) {
+            base = docID;
+        } else if (docID < base) {
+            ids.insert(ids.begin(), static_cast<size_t>(base - docID), -1);
+            base = docID;
+        }
+        size_t slot = static_cast<size_t>(docID - base);
+        if (slot >= ids.size()) {
+            ids.resize(slot + 1, -1);
+        }
+        ids[slot] = mapped;
+    }
+
+    void insertAll(const DocIDMap& other) {
+        for (size_t slot = 0; slot < other.ids.size(); ++slot) {
+            if (other.ids[slot] >= 0) {
+                set(static_cast<int>(other.base + slot), other.ids[slot]);
+            }
+        }
+    }
+
+    // Function to load indexDir/docmap.bin; a missing file means docIDs are not remapped
+    static DocIDMap load(const string& indexDir) {
+        DocIDMap docMap;
+        ifstream file(indexDir + "/docmap.bin", ios::binary);
+        if (!file.is_open()) {
+            return docMap;
+        }
+        uint64_t count = 0;
+        file.read(reinterpret_cast<char*>(&docMap.base), sizeof(docMap.base));
+        file.read(reinterpret_cast<char*>(&count), sizeof(count));
+        docMap.ids.resize(count);
+        file.read(reinterpret_cast<char*>(docMap.ids.data()), count * sizeof(int64_t));
+        if (!file) {
+            throw runtime_error("Truncated docID map: " + indexDir + "/docmap.bin");
+        }
+        return docMap;
+    }
+
+    void save(const string& indexDir) const {
+        ofstream file(indexDir + "/docmap.bin", ios::binary);
+        uint64_t count = ids.size();
+        file.write(reinterpret_cast<const char*>(&base), sizeof(base));
+        file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        file.write(reinterpret_cast<const char*>(ids.data()), count * sizeof(int64_t));
+        file.close();
+        if (file.fail()) {
+            throw runtime_error("Failed to write docID map: " + indexDir + "/docmap.bin");
+        }
+    }
+
+private:
+    int64_t base = 0;
+    vector<int64_t> ids;
+};
+
+// Function to drop the postings of deleted documents, with their positions, keeping order
+void dropDeletedPostings(vector<Posting>& postings, vector<uint32_t>& positions,
+                         const DeletionBitmap& deletions) {
+    size_t keptPostings = 0;
+    size_t keptPositions = 0;
+    size_t nextPosition = 0;
+    for (const auto& posting : postings) {
+        if (!deletions.contains(posting.docID)) {
+            if (!positions.empty()) {
+                copy(positions.begin() + nextPosition, positions.begin() + nextPosition + posting.termFreq,
+                     positions.begin() + keptPositions);
+                keptPositions += posting.termFreq;
+            }
+            postings[keptPostings++] = posting;
+        }
+        if (!positions.empty()) {
+            nextPosition += posting.termFreq;
+        }
+    }
+    postings.resize(keptPostings);
+    positions.resize(keptPositions);
+}
+
+// Function to force a file, or a directory's entries, to disk
+void syncPath(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw runtime_error("Failed to sync " + path + ": " + strerror(errno));
+    }
+    close(fd);
+}
+
+// Progress of a merge into an index directory that survives a crash. merge.checkpoint
+// holds "key value" lines: the merge inputs, the last term fully written and the sizes of
+// index.bin, positions.bin and three journals. The journals, lexicon.partial,
+// blockMetaData.partial and positionMetaData.partial, take the lexicon entries and block
+// sizes written so far in their final text formats. Bytes past the recorded sizes are
+// cut off when the merge resumes.
+class MergeCheckpoint {
+public:
+    explicit MergeCheckpoint(const string& indexDir)
+        : indexDir(indexDir), indexBytes(0), positionBytes(0), journalBytes{0, 0, 0},
+          savedEntries{0, 0, 0} {}
+
+    const string& lastTerm() const {
+        return term;
+    }
+
+    // Function to read the inputs of the checkpointed merge in indexDir; empty if there is none
+    static vector<string> inputsOf(const string& indexDir) {
+        MergeCheckpoint checkpoint(indexDir);
+        checkpoint.load();
+        return checkpoint.inputs;
+    }
+
+    // Function to pick up an interrupted merge of inputs: cut the index files back to the
+    // checkpoint and reload the lexicon and block sizes written before it. Returns false,
+    // leaving everything alone, if there is no checkpoint.
+    bool resume(const vector<string>& mergeInputs, const string& indexPath, const string& positionsPath,
+                vector<LexiconEntry>& lexicon, vector<BlockMetaData>& blockMetaData,
+                vector<uint32_t>& positionBlockSizes) {
+        if (!load()) {
+            return false;
+        }
+        if (inputs != mergeInputs) {
+            throw runtime_error("Merge checkpoint " + path() + " was written for other inputs");
+        }
+        fs::resize_file(indexPath, indexBytes);
+        if (!positionsPath.empty()) {
+            fs::resize_file(positionsPath, positionBytes);
+        }
+        for (int i = 0; i < JOURNAL_COUNT; ++i) {
+            fs::resize_file(journalPath(i), journalBytes[i]);
+        }
+
+        ifstream lexiconJournal(journalPath(0));
+        LexiconEntry entry;
+        while (lexiconJournal >> entry.term >> entry.offset >> entry.length >> entry.docFreq) {
+            lexicon.push_back(entry);
+        }
+        ifstream blockJournal(journalPath(1));
+        BlockMetaData block;
+        while (blockJournal >> block.size >> block.lastDocID) {
+            blockMetaData.push_back(block);
+        }
+        ifstream positionJournal(journalPath(2));
+        uint32_t size;
+        while (positionJournal >> size) {
+            positionBlockSizes.push_back(size);
+        }
+        savedEntries[0] = lexicon.size();
+        savedEntries[1] = blockMetaData.size();
+        savedEntries[2] = positionBlockSizes.size();
+        return true;
+    }
+
+    // Function to make everything up to and including term durable and record it. Only
+    // entries added since the last checkpoint are appended to the journals.
+    void save(const vector<string>& mergeInputs, const string& lastTerm,
+              ofstream& indexFile, const string& indexPath, ofstream& positionsFile, const string& positionsPath,
+              const vector<LexiconEntry>& lexicon, const vector<BlockMetaData>& blockMetaData,
+              const vector<uint32_t>& positionBlockSizes) {
+        for (int i = 0; i < JOURNAL_COUNT; ++i) {
+            if (!journals[i].is_open()) {
+                journals[i].open(journalPath(i), ios::app);
+            }
+        }
+        for (size_t i = savedEntries[0]; i < lexicon.size(); ++i) {
+            const auto& entry = lexicon[i];
+            journals[0] << entry.term << " " << entry.offset << " " << entry.length << " " << entry.docFreq << "\n";
+        }
+        for (size_t i = savedEntries[1]; i < blockMetaData.size(); ++i) {
+            journals[1] << blockMetaData[i].size << " " << blockMetaData[i].lastDocID << "\n";
+        }
+        for (size_t i = savedEntries[2]; i < positionBlockSizes.size(); ++i) {
+            journals[2] << positionBlockSizes[i] << "\n";
+        }
+        savedEntries[0] = lexicon.size();
+        savedEntries[1] = blockMetaData.size();
+        savedEntries[2] = positionBlockSizes.size();
+
+        indexFile.flush();
+        if (positionsFile.is_open()) {
+            positionsFile.flush();
+        }
+        for (auto& journal : journals) {
+            journal.flush();
+        }
+        if (!indexFile || !positionsFile || !journals[0] || !journals[1] || !journals[2]) {
+            throw runtime_error("Failed to write the index in " + indexDir);
+        }
+        syncPath(indexPath);
+        if (positionsFile.is_open()) {
+            syncPath(positionsPath);
+        }
+        for (int i = 0; i < JOURNAL_COUNT; ++i) {
+            syncPath(journalPath(i));
+        }
+
+        inputs = mergeInputs;
+        term = lastTerm;
+        indexBytes = fs::file_size(indexPath);
+        positionBytes = positionsFile.is_open() ? fs::file_size(positionsPath) : 0;
+        for (int i = 0; i < JOURNAL_COUNT; ++i) {
+            journalBytes[i] = fs::file_size(journalPath(i));
+        }
+        string tempPath = path() + ".tmp";
+        ofstream file(tempPath);
+        for (const auto& input : inputs) {
+            file << "input " << input << "\n";
+        }
+        file << "term " << term << "\n"
+             << "index " << indexBytes << "\n"
+             << "positions " << positionBytes << "\n"
+             << "journals " << journalBytes[0] << " " << journalBytes[1] << " " << journalBytes[2] << "\n";
+        file.close();
+        if (file.fail()) {
+            throw runtime_error("Failed to write merge checkpoint: " + tempPath);
+        }
+        syncPath(tempPath);
+        fs::rename(tempPath, path());
+        syncPath(indexDir);
+    }
+
+    // Function to drop the checkpoint and journals once the merge is complete
+    void remove() {
+        for (int i = 0; i < JOURNAL_COUNT; ++i) {
+            journals[i].close();
+            fs::remove(journalPath(i));
+        }
+        fs::remove(path());
+    }
+
+private:
+    static const int JOURNAL_COUNT = 3;
+
+    string path() const {
+        return indexDir + "/merge.checkpoint";
+    }
+
+    string journalPath(int journal) const {
+        static const char* names[JOURNAL_COUNT] = {"lexicon.partial", "blockMetaData.partial", "positionMetaData.partial"};
+        return indexDir + "/" + names[journal];
+    }
+
+    bool load() {
+        ifstream file(path());
+        if (!file.is_open()) {
+            return false;
+        }
+        string line;
+        bool complete = false;
+        while (getline(file, line)) {
+            size_t space = line.find(' ');
+            string key = line.substr(0, space);
+            string value = space == string::npos ? "" : line.substr(space + 1);
+            if (key == "input") {
+                inputs.push_back(value);
+            } else if (key == "term") {
+                term = value;
+            } else if (key == "index") {
+                indexBytes = stoull(value);
+            } else if (key == "positions") {
+                positionBytes = stoull(value);
+            } else if (key == "journals") {
+                istringstream sizes(value);
+                complete = static_cast<bool>(sizes >> journalBytes[0] >> journalBytes[1] >> journalBytes[2]);
+            }
+        }
+        if (!complete || term.empty()) {
+            throw runtime_error("Incomplete merge checkpoint: " + path());
+        }
+        return true;
+    }
+
+    string indexDir;
+    vector<string> inputs;
+    string term;
+    uint64_t indexBytes;
+    uint64_t positionBytes;
+    uint64_t journalBytes[JOURNAL_COUNT];
+    size_t savedEntries[JOURNAL_COUNT]; // Entries of each vector already in its journal
+    ofstream journals[JOURNAL_COUNT];
+};
+
+// Function to merge the terms of range from files and encode them, with Differential
+// Encoding and Non-Interleaved Storage, into indexFile and, if it is open, positionsFile.
+// Their lexicon entries, block metadata and position block sizes are appended, with
+// lexicon offsets counted from startOffset. afterTerm, if given, is called after each
+// term with the term and the index offset reached.
+void encodeTermRange(const vector<string>& files, const MergeRange& range,
+                     ofstream& indexFile, ofstream& positionsFile, uint64_t startOffset,
+                     vector<LexiconEntry>& lexicon,
+                     vector<BlockMetaData>& blockMetaData,
+                     vector<uint32_t>& positionBlockSizes,
+                     const DeletionBitmap* deletions, const DocIDMap* renumbering,
+                     const function<void(const string&, uint64_t)>& afterTerm = nullptr) {
+    // Time spent in writes, taken out of the encode time of each term
+    chrono::steady_clock::duration writeTime{0};
+    uint64_t bytesWritten = 0;
+    auto timedWrite = [&](ofstream& file, const vector<uint8_t>& bytes) {
+        auto writeStart = chrono::steady_clock::now();
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        writeTime += chrono::steady_clock::now() - writeStart;
+        bytesWritten += bytes.size();
+    };
+
+    vector<uint8_t> combinedPositionBytes;
+    auto writePositionBlock = [&] {
+        if (positionsFile.is_open()) {
+            timedWrite(positionsFile, combinedPositionBytes);
+            positionBlockSizes.push_back(combinedPositionBytes.size());
+            combinedPositionBytes.clear();
+        }
+    };
+
+    uint64_t currentOffset = startOffset; // Byte offset in the index file
+
+    vector<uint8_t> combinedIndexBytes;
+    vector<int> combinedDocID;
+    vector<int> combinedFreq;
+
+    mergeRuns(files, [&](const string& smallestTerm, vector<Posting>& mergedPostings,
+                         vector<uint32_t>& mergedPositions) {
+        auto encodeStart = chrono::steady_clock::now();
+        writeTime = chrono::steady_clock::duration::zero();
+        bytesWritten = 0;
+        if (renumbering != nullptr) {
+            for (auto& posting : mergedPostings) {
+                posting.docID = static_cast<int>(renumbering->map(posting.docID));
+            }
+        }
+        // Segments merged out of docID order, or renumbered runs, leave the postings unsorted
+        if (!is_sorted(mergedPostings.begin(), mergedPostings.end(),
+                       [](const Posting& a, const Posting& b) { return a.docID < b.docID; })) {
+            sortPostingsByDocID(mergedPostings, mergedPositions);
+        }
+        if (deletions != nullptr && !deletions->empty()) {
+            dropDeletedPostings(mergedPostings, mergedPositions, *deletions);
+            if (mergedPostings.empty()) {
+                return;
+            }
+        }
+        const uint32_t* nextPositions = mergedPositions.data();
+        // Differential Encoding for docIDs
+        int previousDocID = 0;
+        int currDocID;
+        int lastBlockID;
+        int postingCount = 0;
+
+        LexiconEntry lexEntry;
+        lexEntry.term = smallestTerm;
+        lexEntry.offset = currentOffset;
+        lexEntry.length = 0;
+        
+        for (auto& posting : mergedPostings) {
+            
+            currDocID = posting.docID;
+            //if the posting is more than POSTING_PER_BLOCK, we block them
+            if (postingCount % POSTING_PER_BLOCK == 0 && postingCount != 0) {
+                BlockMetaData currBlock;
+                currBlock.size = 0;
+                currBlock.lastDocID = lastBlockID;
+                for (const auto& docID : combinedDocID) {
+                    vector<uint8_t> varbytes = intToVarByte(docID);
+                    combinedIndexBytes.insert(combinedIndexBytes.end(), varbytes.begin(), varbytes.end());
+                }
+                for (const auto& freq : combinedFreq) {
+                    vector<uint8_t> varbytes = intToVarByte(freq);
+                    combinedIndexBytes.insert(combinedIndexBytes.end(), varbytes.begin(), varbytes.end());
+                }
+                timedWrite(indexFile, combinedIndexBytes);
+                
+                currBlock.size = static_cast<uint32_t>(combinedIndexBytes.size());
+                lexEntry.length += static_cast<uint32_t>(combinedIndexBytes.size());
+                if (postingCount == mergedPostings.size()-1) {
+                    lastBlockID = currDocID;
+                }
+                
+                blockMetaData.push_back(currBlock);
+                writePositionBlock();
+                combinedIndexBytes.clear();
+                combinedDocID.clear();
+                combinedFreq.clear();
+            }
+            else if (postingCount % POSTING_PER_BLOCK == POSTING_PER_BLOCK - 1) {
+                lastBlockID = currDocID;
+            }
+
+            //take the difference of postings 
+            posting.docID -= previousDocID;
+            
+            previousDocID = currDocID;
+    
+            combinedDocID.push_back(posting.docID);
+            combinedFreq.push_back(posting.termFreq);
+            if (positionsFile.is_open()) {
+                appendPositionGaps(combinedPositionBytes, nextPositions, posting.termFreq);
+                nextPositions += posting.termFreq;
+            }
+            postingCount++;
+            
+        }
+
+        //write out remaining index
+        if (!combinedDocID.empty()) {
+            BlockMetaData currBlock;
+            currBlock.size = 0;
+            currBlock.lastDocID = previousDocID;
+            /*if (smallestTerm == "peacefully") {
+                cout << "currBlock.lastDocID" << currBlock.lastDocID << endl;
+            }*/
+            for (const auto& docID : combinedDocID) {
+                vector<uint8_t> varbytes = intToVarByte(docID);
+                combinedIndexBytes.insert(combinedIndexBytes.end(), varbytes.begin(), varbytes.end());
+            }
+            for (const auto& freq : combinedFreq) {
+                vector<uint8_t> varbytes = intToVarByte(freq);
+                combinedIndexBytes.insert(combinedIndexBytes.end(), varbytes.begin(), varbytes.end());
+            }
+            timedWrite(indexFile, combinedIndexBytes);
+            
+            currBlock.size = static_cast<uint32_t>(combinedIndexBytes.size());
+            lexEntry.length += static_cast<uint32_t>(combinedIndexBytes.size());
+            blockMetaData.push_back(currBlock);
+            writePositionBlock();
+            combinedIndexBytes.clear();
+            combinedDocID.clear();
+            combinedFreq.clear();
+        }
+
+        lexEntry.docFreq = mergedPostings.size();
+
+        // Add to lexicon
+        lexicon.emplace_back(lexEntry);
+
+        // Update the currentOffset
+        currentOffset += lexEntry.length;
+
+        metrics.record(STAGE_ENCODE, chrono::steady_clock::now() - encodeStart - writeTime, mergedPostings.size());
+        metrics.record(STAGE_WRITE, writeTime, mergedPostings.size(), 0, bytesWritten);
+
+        if (afterTerm) {
+            afterTerm(smallestTerm, currentOffset);
+        }
+    }, range);
+}
+
+// Function to split the terms of a merge after firstAfter into about rangeCount ranges
+// holding similar bytes of the runs. Every run is sampled, and a sampled term stands for
+// the bytes of its run up to the run's next sample. Each range gets, in each run, the
+// span from the last sample at or before its first term to the first sample past its
+// last term, so its readers step over at most one sample gap before reaching it.
+vector<MergeRange> splitMergeRanges(const vector<string>& files, const string& firstAfter, size_t rangeCount) {
+    vector<vector<TermSample>> runSamples(files.size());
+    vector<pair<string, uint64_t>> sampleBytes;
+    for (size_t i = 0; i < files.size(); ++i) {
+        uint64_t size = fs::is_directory(files[i]) ? 0 : fs::file_size(files[i]);
+        size_t count = min<uint64_t>(rangeCount * MERGE_SAMPLES_PER_RANGE, size / MERGE_MIN_SAMPLE_GAP + 1);
+        // A sampling reader reads nothing ahead
+        openPostingFileReader(files[i], RunSpan{0, 0})->sampleTerms(count, runSamples[i]);
+        const auto& samples = runSamples[i];
+        for (size_t j = 0; j < samples.size(); ++j) {
+            if (samples[j].term > firstAfter) {
+                uint64_t next = j + 1 < samples.size() ? samples[j + 1].offset : size;
+                sampleBytes.emplace_back(samples[j].term, next - samples[j].offset);
+            }
+        }
+    }
+
+    // Range ends are taken where the sampled bytes pass each multiple of total / rangeCount
+    sort(sampleBytes.begin(), sampleBytes.end());
+    uint64_t total = 0;
+    for (const auto& sample : sampleBytes) {
+        total += sample.second;
+    }
+    vector<string> lastTerms;
+    uint64_t seen = 0;
+    for (const auto& sample : sampleBytes) {
+        seen += sample.second;
+        if (lastTerms.size() + 1 < rangeCount && seen * rangeCount >= total * (lastTerms.size() + 1) &&
+            (lastTerms.empty() || sample.first > lastTerms.back())) {
+            lastTerms.push_back(sample.first);
+        }
+    }
+    lastTerms.push_back(""); // The last range runs to the end
+
+    auto termBefore = [](const string& term, const TermSample& sample) { return term < sample.term; };
+    vector<MergeRange> ranges;
+    string first = firstAfter;
+    for (const auto& last : lastTerms) {
+        MergeRange range{first, last, vector<RunSpan>(files.size())};
+        for (size_t i = 0; i < files.size(); ++i) {
+            const auto& samples = runSamples[i];
+            if (!first.empty()) {
+                auto after = upper_bound(samples.begin(), samples.end(), first, termBefore);
+                if (after != samples.begin()) {
+                    range.spans[i].begin = prev(after)->offset;
+                }
+            }
+            if (!last.empty()) {
+                auto after = upper_bound(samples.begin(), samples.end(), last, termBefore);
+                if (after != samples.end()) {
+                    range.spans[i].end = after->offset;
+                }
+            }
+        }
+        ranges.push_back(move(range));
+        first = last;
+    }
+    return ranges;
+}
+
+// Function to append the part file at partPath to out and remove it. Returns its size.
+uint64_t appendIndexPart(ofstream& out, const string& partPath) {
+    uint64_t size = fs::file_size(partPath);
+    // Streaming an empty file would mark out failed
+    if (size > 0) {
+        ifstream part(partPath, ios::binary);
+        out << part.rdbuf();
+    }
+    if (!out) {
+        throw runtime_error("Failed to append index part: " + partPath);
+    }
+    fs::remove(partPath);
+    return size;
+}
+
+// Function to remove the part files of path left by an interrupted parallel merge
+void removeIndexParts(const string& path) {
+    fs::path file(path);
+    string prefix = file.filename().string() + ".part";
+    for (const auto& entry : fs::directory_iterator(file.parent_path().empty() ? fs::path(".") : file.parent_path())) {
+        if (entry.path().filename().string().rfind(prefix, 0) == 0) {
+            fs::remove(entry.path());
+        }
+    }
+}
+
+// Function to merge ranges on mergeThreads threads and append the results to indexFile
+// and positionsFile, which are at index offset startOffset, and to lexicon, blockMetaData
+// and positionBlockSizes, in range order. Each range is merged and encoded into part
+// files next to the index, with lexicon offsets from 0, and threads take ranges in
+// order. As the parts of each range come in, in order, they are appended, their
+// lexicon offsets moved to where they land, and afterRange is called with the range's
+// last term and the index offset reached. The result is the serial merge's, byte for
+// byte.
+void mergeRangesInParallel(const vector<string>& files, const vector<MergeRange>& ranges,
+                           ofstream& indexFile, const string& indexFilePath,
+                           ofstream& positionsFile, const string& positionsFilePath, uint64_t startOffset,
+                           vector<LexiconEntry>& lexicon, vector<BlockMetaData>& blockMetaData,
+                           vector<uint32_t>& positionBlockSizes,
+                           const DeletionBitmap* deletions, const DocIDMap* renumbering, size_t mergeThreads,
+                           const function<void(const string&, uint64_t)>& afterRange) {
+    struct RangePart {
+        vector<LexiconEntry> lexicon;
+        vector<BlockMetaData> blockMetaData;
+        vector<uint32_t> positionBlockSizes;
+        bool done = false;
+        exception_ptr error;
+    };
+    vector<RangePart> parts(ranges.size());
+    auto partPath = [](const string& path, size_t range) { return path + ".part" + to_string(range); };
+    atomic<size_t> nextRange{0};
+    atomic<bool> failed{false};
+    mutex mtx;
+    condition_variable partDone;
+
+    vector<thread> workers;
+    for (size_t t = 0; t < min(mergeThreads, ranges.size()); ++t) {
+        workers.emplace_back([&] {
+            for (size_t i = nextRange++; i < ranges.size() && !failed; i = nextRange++) {
+                RangePart& part = parts[i];
+                try {
+                    ofstream partIndex(partPath(indexFilePath, i), ios::binary);
+                    ofstream partPositions;
+                    if (positionsFile.is_open()) {
+                        partPositions.open(partPath(positionsFilePath, i), ios::binary);
+                    }
+                    if (!partIndex.is_open() || (positionsFile.is_open() && !partPositions.is_open())) {
+                        throw runtime_error("Failed to open index part for writing: " + partPath(indexFilePath, i));
+                    }
+                    encodeTermRange(files, ranges[i], partIndex, partPositions, 0, part.lexicon,
+                                    part.blockMetaData, part.positionBlockSizes, deletions, renumbering);
+                    partIndex.close();
+                    if (partPositions.is_open()) {
+                        partPositions.close();
+                    }
+                    if (partIndex.fail() || partPositions.fail()) {
+                        throw runtime_error("Failed to write index part: " + partPath(indexFilePath, i));
+                    }
+                } catch (...) {
+                    part.error = current_exception();
+                    failed = true;
+                }
+                {
+                    lock_guard<mutex> lock(mtx);
+                    part.done = true;
+                }
+                partDone.notify_all();
+            }
+        });
+    }
+
+    uint64_t currentOffset = startOffset;
+    exception_ptr error;
+    for (size_t i = 0; i < ranges.size() && !failed; ++i) {
+        {
+            unique_lock<mutex> lock(mtx);
+            partDone.wait(lock, [&] { return parts[i].done || failed; });
+        }
+        if (failed) {
+            break;
+        }
+        try {
+            auto appendStart = chrono::steady_clock::now();
+            uint64_t indexBytes = appendIndexPart(indexFile, partPath(indexFilePath, i));
+            if (positionsFile.is_open()) {
+                appendIndexPart(positionsFile, partPath(positionsFilePath, i));
+            }
+            // The part's bytes were counted when it was written
+            metrics.record(STAGE_WRITE, chrono::steady_clock::now() - appendStart, 0);
+
+            RangePart& part = parts[i];
+            for (auto& entry : part.lexicon) {
+                entry.offset += currentOffset;
+            }
+            currentOffset += indexBytes;
+            lexicon.insert(lexicon.end(), part.lexicon.begin(), part.lexicon.end());
+            blockMetaData.insert(blockMetaData.end(), part.blockMetaData.begin(), part.blockMetaData.end());
+            positionBlockSizes.insert(positionBlockSizes.end(), part.positionBlockSizes.begin(),
+                                      part.positionBlockSizes.end());
+            part = RangePart();
+            if (!ranges[i].lastTerm.empty()) {
+                afterRange(ranges[i].lastTerm, currentOffset);
+            }
+        } catch (...) {
+            error = current_exception();
+            failed = true;
+        }
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    if (failed) {
+        for (size_t i = 0; i < ranges.size() && !error; ++i) {
+            error = parts[i].error;
+        }
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            fs::remove(partPath(indexFilePath, i));
+            if (positionsFile.is_open()) {
+                fs::remove(partPath(positionsFilePath, i));
+            }
+        }
+        rethrow_exception(error);
+    }
+}
+
+// Function to perform k-way merge and build the final inverted index with Differential Encoding and Non-Interleaved Storage.
+// For positional runs, positions go to their own file, positionsFilePath, in one position
+// block per docID/freq block so that queries without phrases never read them. A position
+// block holds, for each posting of its docID block, termFreq varbyte gaps from 0.
+// Given deletions, this compacts: postings of deleted docs are dropped before blocking, so
+// blocks, docFreq and lexicon offsets describe only live documents, and terms left without
+// postings get no lexicon entry. Given a renumbering, postings are renumbered and sorted
+// again before that.
+// Given a checkpoint, progress is saved to it every MERGE_CHECKPOINT_BYTES of index, and a
+// merge it recorded is resumed after its last term instead of starting over.
+// With more than one merge thread, the term space is split into ranges by sampling the
+// runs, at least MERGE_RANGES_PER_THREAD per thread and one per MERGE_CHECKPOINT_BYTES of
+// input, and the ranges are merged in parallel; checkpoints then fall between ranges.
+void mergePostingFiles(const vector<string>& files, const string& indexFilePath,
+                      const string& lexiconFilePath,
+                      vector<LexiconEntry>& lexicon,
+                      vector<BlockMetaData>& blockMetaData,
+                      const string& positionsFilePath,
+                      vector<uint32_t>& positionBlockSizes,
+                      const DeletionBitmap* deletions = nullptr,
+                      const DocIDMap* renumbering = nullptr,
+                      MergeCheckpoint* checkpoint = nullptr,
+                      size_t mergeThreads = 1) {
+    bool resuming = checkpoint != nullptr &&
+                    checkpoint->resume(files, indexFilePath, positionsFilePath, lexicon, blockMetaData, positionBlockSizes);
+    if (resuming) {
+        cout << "Resuming merge after term \"" << checkpoint->lastTerm() << "\" with " << lexicon.size()
+             << " terms and " << fs::file_size(indexFilePath) << " bytes of " << indexFilePath << " written" << endl;
+    }
+    // Open final index file for writing in text format
+    ios::openmode mode = resuming ? ios::binary | ios::in | ios::out | ios::ate : ios::binary;
+    ofstream indexFile(indexFilePath, mode);
+    if (!indexFile.is_open()) {
+        throw runtime_error("Failed to open final index file for writing: " + indexFilePath);
+    }
+    ofstream positionsFile;
+    if (!positionsFilePath.empty()) {
+        positionsFile.open(positionsFilePath, mode);
+        if (!positionsFile.is_open()) {
+            throw runtime_error("Failed to open positions file for writing: " + positionsFilePath);
+        }
+    }
+    removeIndexParts(indexFilePath);
+    if (!positionsFilePath.empty()) {
+        removeIndexParts(positionsFilePath);
+    }
+    uint64_t startOffset = resuming ? fs::file_size(indexFilePath) : 0; // Byte offset in the index file
+    uint64_t checkpointOffset = startOffset;
+    string firstAfter = resuming ? checkpoint->lastTerm() : string();
+    auto saveCheckpoint = [&](const string& lastTerm, uint64_t offset) {
+        if (checkpoint != nullptr && offset - checkpointOffset >= MERGE_CHECKPOINT_BYTES) {
+            auto saveStart = chrono::steady_clock::now();
+            checkpoint->save(files, lastTerm, indexFile, indexFilePath, positionsFile, positionsFilePath,
+                             lexicon, blockMetaData, positionBlockSizes);
+            metrics.record(STAGE_WRITE, chrono::steady_clock::now() - saveStart, 0);
+            checkpointOffset = offset;
+        }
+    };
+
+    if (mergeThreads <= 1) {
+        encodeTermRange(files, MergeRange{firstAfter, "", {}}, indexFile, positionsFile, startOffset,
+                        lexicon, blockMetaData, positionBlockSizes, deletions, renumbering, saveCheckpoint);
+    } else {
+        uint64_t inputBytes = 0;
+        for (const auto& file : files) {
+            inputBytes += fs::is_directory(file) ? 0 : fs::file_size(file);
+        }
+        auto splitStart = chrono::steady_clock::now();
+        vector<MergeRange> ranges = splitMergeRanges(
+            files, firstAfter, max<uint64_t>(mergeThreads * MERGE_RANGES_PER_THREAD, inputBytes / MERGE_CHECKPOINT_BYTES));
+        metrics.record(STAGE_READ, chrono::steady_clock::now() - splitStart, 0);
+        cout << "Merging " << ranges.size() << " term ranges on " << mergeThreads << " threads" << endl;
+        mergeRangesInParallel(files, ranges, indexFile, indexFilePath, positionsFile, positionsFilePath, startOffset,
+                              lexicon, blockMetaData, positionBlockSizes, deletions, renumbering, mergeThreads,
+                              saveCheckpoint);
+    }
+
+    indexFile.close();
+    if (positionsFile.is_open()) {
+        positionsFile.close();
+    }
+}
+
+void writeBlockMetaData(const string& blockMetaDataFilePath, const vector<BlockMetaData>& blockMetaData) {
+    // Open block meta data file for writing in text format
+    ofstream metaFile(blockMetaDataFilePath);
+    if (!metaFile.is_open()) {
+        throw runtime_error("Failed to open block meta data file for writing: " + blockMetaDataFilePath);
+    }
+
+    for (const auto& metaData : blockMetaData) {
+        //write block meata data
+        metaFile << metaData.size << " " << metaData.lastDocID << "\n";
+    }
+
+    metaFile.close();
+    
+}
+
+// Function to write the byte size of each position block, one per line, in index order
+void writePositionMetaData(const string& positionMetaDataFilePath, const vector<uint32_t>& positionBlockSizes) {
+    ofstream metaFile(positionMetaDataFilePath);
+    if (!metaFile.is_open()) {
+        throw runtime_error("Failed to open position meta data file for writing: " + positionMetaDataFilePath);
+    }
+    for (uint32_t size : positionBlockSizes) {
+        metaFile << size << "\n";
+    }
+    metaFile.close();
+}
+
+// Function to merge runs or segments into a finished index in finalIndexDir:
+// index.bin, lexicon.txt, blockMetaData.txt and, if positional, the positions section,
+// and, given deletions, without the postings of deleted documents. Given a renumbering,
+// postings take the docIDs it maps theirs to. If checkpointed, the merge saves checkpoints
+// in finalIndexDir and resumes from one left there by an interrupted run. The merge runs
+// on mergeThreads threads.
+void writeFinalIndex(const vector<string>& inputs, const string& finalIndexDir, bool positional,
+                     const DeletionBitmap* deletions = nullptr, const DocIDMap* renumbering = nullptr,
+                     bool checkpointed = false, size_t mergeThreads = 1) {
+    string finalIndexPath = finalIndexDir + "/index.bin";
+    string lexiconPath = finalIndexDir + "/lexicon.txt";
+    string BlockMetaDataFilePath = finalIndexDir + "/blockMetaData.txt";
+    string positionsPath = positional ? finalIndexDir + "/positions.bin" : "";
+    string positionMetaDataFilePath = finalIndexDir + "/positionMetaData.txt";
+    vector<LexiconEntry> lexicon;
+    vector<BlockMetaData> blockMetaData;
+    vector<uint32_t> positionBlockSizes;
+
+    MergeCheckpoint checkpoint(finalIndexDir);
+    auto mergeStart = chrono::high_resolution_clock::now();
+    mergePostingFiles(inputs, finalIndexPath, lexiconPath, lexicon, blockMetaData,
+                      positionsPath, positionBlockSizes, deletions, renumbering,
+                      checkpointed ? &checkpoint : nullptr, mergeThreads);
+    chrono::duration<double> mergeTime = chrono::high_resolution_clock::now() - mergeStart;
+    cout << "Merged postings into final index file: " << finalIndexPath << " in " << mergeTime.count() << " seconds." << endl;
+
+    // Write lexicon in text format
+    auto metaWriteStart = chrono::steady_clock::now();
+    writeLexiconText(lexiconPath, lexicon);
+    cout << "Written lexicon file: " << lexiconPath << endl;
+
+    // Write block meta data in text format
+    writeBlockMetaData(BlockMetaDataFilePath, blockMetaData);
+    cout << "Written block meta data file: " << BlockMetaDataFilePath << endl;
+
+    metrics.record(STAGE_WRITE, chrono::steady_clock::now() - metaWriteStart, 0, 0,
+                   fs::file_size(lexiconPath) + fs::file_size(BlockMetaDataFilePath));
+
+    if (positional) {
+        writePositionMetaData(positionMetaDataFilePath, positionBlockSizes);
+        cout << "Written positions file: " << positionsPath << " and position meta data file: "
+             << positionMetaDataFilePath << endl;
+    } else {
+        // A positions section from an earlier build no longer matches the index
+        fs::remove(finalIndexDir + "/positions.bin");
+        fs::remove(positionMetaDataFilePath);
+    }
+
+    if (checkpointed) {
+        // The finished files replace the checkpoint only once they are on disk
+        for (const auto& path : {finalIndexPath, lexiconPath, BlockMetaDataFilePath}) {
+            syncPath(path);
+        }
+        if (positional) {
+            syncPath(positionsPath);
+            syncPath(positionMetaDataFilePath);
+        }
+        checkpoint.remove();
+    }
+}
+
+// One live segment of a segmented index, as listed in its manifest
+struct SegmentInfo {
+    string name;         // Directory under the segments directory
+    uint64_t docCount;   // Documents in its page table
+    uint64_t indexBytes; // Size of its index.bin, which decides its tier
+};
+
+// Exclusive flock on a file in the segments directory, released when destroyed
+class FileLock {
+public:
+    FileLock(const string& path, bool wait = true) : locked(false) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to open lock file: " + path);
+        }
+        locked = flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) == 0;
+    }
+
+    ~FileLock() {
+        close(fd); // Also drops the lock
+    }
+
+    bool held() const {
+        return locked;
+    }
+
+private:
+    int fd;
+    bool locked;
+};
+
+// Function to read the manifest of a segments directory; one "name docCount indexBytes"
+// line per live segment, oldest documents first
+vector<SegmentInfo> readSegmentManifest(const string& segmentsDir) {
+    vector<SegmentInfo> segments;
+    ifstream manifest(segmentsDir + "/segments.txt");
+    SegmentInfo segment;
+    while (manifest >> segment.name >> segment.docCount >> segment.indexBytes) {
+        segments.push_back(segment);
+    }
+    return segments;
+}
+
+// Function to replace the manifest; the rename makes the switch atomic for queries
+void writeSegmentManifest(const string& segmentsDir, const vector<SegmentInfo>& segments) {
+    string tempPath = segmentsDir + "/segments.txt.tmp";
+    ofstream manifest(tempPath);
+    for (const auto& segment : segments) {
+        manifest << segment.name << " " << segment.docCount << " " << segment.indexBytes << "\n";
+    }
+    manifest.close();
+    if (manifest.fail()) {
+        throw runtime_error("Failed to write segment manifest: " + tempPath);
+    }
+    fs::rename(tempPath, segmentsDir + "/segments.txt");
+}
+
+// Function to name the next segment; callers hold the manifest lock
+string nextSegmentName(const string& segmentsDir) {
+    long highest = 0;
+    for (const auto& entry : fs::directory_iterator(segmentsDir)) {
+        string name = entry.path().filename().string();
+        if (name.rfind("seg_", 0) == 0) {
+            highest = max(highest, strtol(name.c_str() + 4, nullptr, 10));
+        }
+    }
+    string number = to_string(highest + 1);
+    return "seg_" + string(number.size() < 6 ? 6 - number.size() : 0, '0') + number;
+}
+
+// Function to describe a finished index directory for the manifest
+SegmentInfo describeSegment(const string& name, const string& segmentPath) {
+    ifstream pageTable(segmentPath + "/pagetable.tsv");
+    uint64_t docCount = 0;
+    string line;
+    while (getline(pageTable, line)) {
+        docCount++;
+    }
+    return SegmentInfo{name, docCount, static_cast<uint64_t>(fs::file_size(segmentPath + "/index.bin"))};
+}
+
+// Function to make a finished index in builtDir the newest live segment
+string commitSegment(const string& segmentsDir, const string& builtDir) {
+    FileLock lock(segmentsDir + "/manifest.lock");
+    string name = nextSegmentName(segmentsDir);
+    fs::rename(builtDir, segmentsDir + "/" + name);
+    vector<SegmentInfo> segments = readSegmentManifest(segmentsDir);
+    segments.push_back(describeSegment(name, segmentsDir + "/" + name));
+    writeSegmentManifest(segmentsDir, segments);
+    return name;
+}
+
+// Function to pick segments to merge under the size-tiered policy: segments fall in
+// tiers by powers of SEGMENT_MERGE_FACTOR of their index size, and SEGMENT_MERGE_FACTOR
+// adjacent segments of one tier are merged. Only neighbours are merged so segments stay
+// in docID order. Returns [first, last), or an empty range if nothing needs merging.
+pair<size_t, size_t> pickSegmentMerge(const vector<SegmentInfo>& segments) {
+    auto tier = [](const SegmentInfo& segment) {
+        double ratio = max<double>(1.0, static_cast<double>(segment.indexBytes) / SEGMENT_TIER_BASE);
+        return static_cast<int>(log(ratio) / log(static_cast<double>(SEGMENT_MERGE_FACTOR)));
+    };
+    size_t runStart = 0;
+    for (size_t i = 1; i <= segments.size(); ++i) {
+        if (i == segments.size() || tier(segments[i]) != tier(segments[runStart])) {
+            if (i - runStart >= SEGMENT_MERGE_FACTOR) {
+                return {runStart, runStart + SEGMENT_MERGE_FACTOR};
+            }
+            runStart = i;
+        }
+    }
+    return {0, 0};
+}
+
+// Function to write the page table of a rebuilt index: the input page tables in order,
+// without the lines of deleted documents
+void writeLivePageTable(const vector<string>& pageTables, const string& outputPath,
+                        const DeletionBitmap& deletions) {
+    ofstream output(outputPath, ios::binary);
+    if (!output.is_open()) {
+        throw runtime_error("Failed to open page table for writing: " + outputPath);
+    }
+    for (const auto& pageTable : pageTables) {
+        ifstream input(pageTable, ios::binary);
+        if (deletions.empty()) {
+            output << input.rdbuf();
+            continue;
+        }
+        string line;
+        while (getline(input, line)) {
+            if (!deletions.contains(atoi(line.c_str()))) {
+                output << line << "\n";
+            }
+        }
+    }
+    output.close();
+    if (output.fail()) {
+        throw runtime_error("Failed to write page table: " + outputPath);
+    }
+}
+
+// Function to write the binary page table that queries map: "WSEPAGE1", int64 first
+// docID, uint64 slot count, uint64 document count, uint64 total length in tokens, then a
+// uint16 length per docID from the first, NO_DOCUMENT where there is none
+void writeBinaryPageTable(const string& textPath, const string& binaryPath) {
+    ifstream input(textPath);
+    if (!input.is_open()) {
+        throw runtime_error("Failed to open page table file for reading: " + textPath);
+    }
+    vector<pair<int, uint64_t>> documents;
+    int docID;
+    uint64_t length;
+    while (input >> docID >> length) {
+        documents.emplace_back(docID, length);
+    }
+
+    int64_t firstDocID = 0;
+    vector<uint16_t> lengths;
+    uint64_t totalLength = 0;
+    if (!documents.empty()) {
+        auto [minIt, maxIt] = minmax_element(documents.begin(), documents.end());
+        firstDocID = minIt->first;
+        lengths.assign(static_cast<size_t>(maxIt->first - firstDocID + 1), NO_DOCUMENT);
+    }
+    for (const auto& document : documents) {
+        lengths[document.first - firstDocID] = static_cast<uint16_t>(min<uint64_t>(document.second, MAX_PAGE_LENGTH));
+        totalLength += document.second;
+    }
+
+    ofstream output(binaryPath, ios::binary);
+    if (!output.is_open()) {
+        throw runtime_error("Failed to open page table for writing: " + binaryPath);
+    }
+    uint64_t header[4] = {static_cast<uint64_t>(firstDocID), lengths.size(), documents.size(), totalLength};
+    output.write(PAGE_TABLE_MAGIC, sizeof(PAGE_TABLE_MAGIC));
+    output.write(reinterpret_cast<const char*>(header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(lengths.data()), lengths.size() * sizeof(uint16_t));
+    output.close();
+    if (output.fail()) {
+        throw runtime_error("Failed to write page table: " + binaryPath);
+    }
+}
+
+// Function to read the docIDs of a page table, in increasing order
+vector<int> readPageTableDocIDs(const string& pageTablePath) {
+    ifstream input(pageTablePath);
+    if (!input.is_open()) {
+        throw runtime_error("Failed to open page table file for reading: " + pageTablePath);
+    }
+    vector<int> docIDs;
+    string line;
+    while (getline(input, line)) {
+        docIDs.push_back(atoi(line.c_str()));
+    }
+    sort(docIDs.begin(), docIDs.end());
+    return docIDs;
+}
+
+// Function to write a page table with its docIDs renumbered, in increasing new docID order
+void writeRenumberedPageTable(const string& pageTablePath, const string& outputPath, const DocIDMap& renumbering) {
+    ifstream input(pageTablePath);
+    if (!input.is_open()) {
+        throw runtime_error("Failed to open page table file for reading: " + pageTablePath);
+    }
+    vector<pair<int, uint64_t>> documents;
+    int docID;
+    uint64_t length;
+    while (input >> docID >> length) {
+        documents.emplace_back(static_cast<int>(renumbering.map(docID)), length);
+    }
+    sort(documents.begin(), documents.end());
+    ofstream output(outputPath);
+    for (const auto& document : documents) {
+        output << document.first << '\t' << document.second << '\n';
+    }
+    output.close();
+    if (output.fail()) {
+        throw runtime_error("Failed to write page table: " + outputPath);
+    }
+}
+
+// Documents as the lists of terms they contain, the graph that bisection cuts. Terms
+// in a single document are left out, since they cannot pull documents together.
+struct ForwardIndex {
+    vector<uint64_t> offsets; // Document -> start of its terms, plus an end
+    vector<uint32_t> terms;
+    uint32_t termCount = 0;
+};
+
+// Function to build the forward index of the runs over documents 0..docIDs.size() - 1,
+// document i being docIDs[i]
+ForwardIndex buildForwardIndex(const vector<string>& files, const vector<int>& docIDs) {
+    int firstDocID = docIDs.front();
+    vector<uint32_t> documentOf(static_cast<size_t>(docIDs.back() - firstDocID + 1), UINT32_MAX);
+    for (size_t i = 0; i < docIDs.size(); ++i) {
+        documentOf[docIDs[i] - firstDocID] = static_cast<uint32_t>(i);
+    }
+
+    // Collect term -> documents as the runs come, then turn it around
+    vector<uint32_t> termDocuments;
+    vector<uint64_t> termEnds;
+    ForwardIndex graph;
+    graph.offsets.assign(docIDs.size() + 1, 0);
+    mergeRuns(files, [&](const string& term, vector<Posting>& postings, vector<uint32_t>&) {
+        if (postings.size() < 2) {
+            return;
+        }
+        for (const auto& posting : postings) {
+            uint64_t slot = static_cast<uint64_t>(posting.docID - firstDocID);
+            if (slot >= documentOf.size() || documentOf[slot] == UINT32_MAX) {
+                throw runtime_error("DocID " + to_string(posting.docID) + " of term " + term + " is not in the page table");
+            }
+            termDocuments.push_back(documentOf[slot]);
+            graph.offsets[documentOf[slot] + 1]++;
+        }
+        termEnds.push_back(termDocuments.size());
+    });
+    graph.termCount = static_cast<uint32_t>(termEnds.size());
+
+    for (size_t i = 1; i < graph.offsets.size(); ++i) {
+        graph.offsets[i] += graph.offsets[i - 1];
+    }
+    graph.terms.resize(termDocuments.size());
+    vector<uint64_t> fill(graph.offsets.begin(), graph.offsets.end() - 1);
+    uint64_t start = 0;
+    for (uint32_t term = 0; term < graph.termCount; ++term) {
+        for (uint64_t i = start; i < termEnds[term]; ++i) {
+            graph.terms[fill[termDocuments[i]]++] = term;
+        }
+        start = termEnds[term];
+    }
+    return graph;
+}
+
+// Recursive graph bisection: each step splits a range of documents in two halves and
+// swaps documents between them while that lowers the estimated cost of the docID gaps
+// of every term, d * log2(n / (d + 1)) for a term in d of the n documents of a half,
+// then recurses on the halves. Documents sharing many terms end up close together.
+class GraphBisection {
+public:
+    explicit GraphBisection(const ForwardIndex& graph)
+        : graph(graph), leftDegree(graph.termCount, 0), rightDegree(graph.termCount, 0),
+          toRightGain(graph.termCount), toLeftGain(graph.termCount), log2Of(graph.offsets.size() + 1) {
+        for (size_t i = 1; i < log2Of.size(); ++i) {
+            log2Of[i] = log2f(static_cast<float>(i));
+        }
+    }
+
+    // Function to reorder documents[0, count) in place
+    void bisect(uint32_t* documents, size_t count) {
+        if (count <= BISECTION_LEAF) {
+            sort(documents, documents + count);
+            return;
+        }
+        uint32_t* left = documents;
+        size_t leftCount = count / 2;
+        uint32_t* right = documents + leftCount;
+        size_t rightCount = count - leftCount;
+
+        touched.clear();
+        addDegrees(left, leftCount, leftDegree);
+        addDegrees(right, rightCount, rightDegree);
+
+        vector<pair<float, uint32_t>> leftGains(leftCount);
+        vector<pair<float, uint32_t>> rightGains(rightCount);
+        for (int iteration = 0; iteration < BISECTION_ITERATIONS; ++iteration) {
+            for (uint32_t term : touched) {
+                float before = cost(leftDegree[term], leftCount) + cost(rightDegree[term], rightCount);
+                toRightGain[term] = leftDegree[term] == 0 ? 0 : before - cost(leftDegree[term] - 1, leftCount)
+                                                                - cost(rightDegree[term] + 1, rightCount);
+                toLeftGain[term] = rightDegree[term] == 0 ? 0 : before - cost(leftDegree[term] + 1, leftCount)
+                                                                - cost(rightDegree[term] - 1, rightCount);
+            }
+            moveGains(left, leftCount, toRightGain, leftGains);
+            moveGains(right, rightCount, toLeftGain, rightGains);
+
+            // Swap the best candidates of each side while a swap still lowers the cost
+            size_t swaps = 0;
+            while (swaps < min(leftCount, rightCount) && leftGains[swaps].first + rightGains[swaps].first > 0) {
+                swaps++;
+            }
+            if (swaps == 0) {
+                break;
+            }
+            for (size_t i = 0; i < swaps; ++i) {
+                uint32_t toRight = leftGains[i].second;
+                uint32_t toLeft = rightGains[i].second;
+                for (uint64_t t = graph.offsets[toRight]; t < graph.offsets[toRight + 1]; ++t) {
+                    leftDegree[graph.terms[t]]--;
+                    rightDegree[graph.terms[t]]++;
+                }
+                for (uint64_t t = graph.offsets[toLeft]; t < graph.offsets[toLeft + 1]; ++t) {
+                    rightDegree[graph.terms[t]]--;
+                    leftDegree[graph.terms[t]]++;
+                }
+                leftGains[i].second = toLeft;
+                rightGains[i].second = toRight;
+            }
+            for (size_t i = 0; i < leftCount; ++i) {
+                left[i] = leftGains[i].second;
+            }
+            for (size_t i = 0; i < rightCount; ++i) {
+                right[i] = rightGains[i].second;
+            }
+        }
+        for (uint32_t term : touched) {
+            leftDegree[term] = 0;
+            rightDegree[term] = 0;
+        }
+
+        bisect(left, leftCount);
+        bisect(right, rightCount);
+    }
+
+private:
+    float cost(uint32_t degree, size_t documents) const {
+        return degree * (log2Of[documents] - log2Of[degree + 1]);
+    }
 
-            // Validate docID and termFreq
-            if (docID < 0 || termFreq < 0) {
-                throw runtime_error("Invalid docID or termFreq in posting: " + postingStr);
+    void addDegrees(const uint32_t* documents, size_t count, vector<uint32_t>& degree) {
+        for (size_t i = 0; i < count; ++i) {
+            for (uint64_t t = graph.offsets[documents[i]]; t < graph.offsets[documents[i] + 1]; ++t) {
+                uint32_t term = graph.terms[t];
+                if (leftDegree[term] == 0 && rightDegree[term] == 0) {
+                    touched.push_back(term);
+                }
+                degree[term]++;
             }
+        }
+    }
 
-            currentPostings.emplace_back(Posting{docID, termFreq});
+    // Function to score moving each document to the other half, best first
+    void moveGains(const uint32_t* documents, size_t count, const vector<float>& termGain,
+                   vector<pair<float, uint32_t>>& gains) const {
+        for (size_t i = 0; i < count; ++i) {
+            float gain = 0;
+            for (uint64_t t = graph.offsets[documents[i]]; t < graph.offsets[documents[i] + 1]; ++t) {
+                gain += termGain[graph.terms[t]];
+            }
+            gains[i] = {gain, documents[i]};
         }
+        sort(gains.begin(), gains.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
     }
 
-private:
-    ifstream infile;
-    bool eof;
-    string currentLine;
-    string currentTerm;
-    vector<Posting> currentPostings;
+    const ForwardIndex& graph;
+    vector<uint32_t> leftDegree;
+    vector<uint32_t> rightDegree;
+    vector<float> toRightGain;
+    vector<float> toLeftGain;
+    vector<float> log2Of;
+    vector<uint32_t> touched; // Terms of the documents being split
 };
 
-// Comparator for the priority queue (min heap based on term lexicographical order)
-struct ComparePQNode {
-    bool operator()(const pair<string, size_t>& a, const pair<string, size_t>& b) {
-        // Min heap based on term, and then based on the file_index
-        if (a.first == b.first) {
-            return a.second > b.second;
-        }
-        return a.first > b.first; 
+// Function to order the documents of the runs, docIDs (increasing), by graph bisection.
+// Returns the order as indexes into docIDs.
+vector<uint32_t> bisectionOrder(const vector<string>& files, const vector<int>& docIDs) {
+    auto start = chrono::steady_clock::now();
+    vector<uint32_t> order(docIDs.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = static_cast<uint32_t>(i);
     }
-};
+    if (docIDs.empty()) {
+        return order;
+    }
+    ForwardIndex graph = buildForwardIndex(files, docIDs);
+    GraphBisection(graph).bisect(order.data(), order.size());
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << "Reordered " << docIDs.size() << " documents (" << graph.terms.size() << " postings of "
+         << graph.termCount << " terms) by graph bisection in " << elapsed.count() << " seconds." << endl;
+    return order;
+}
 
-// Function to list intermediate text files
-vector<string> listIntermediateFiles(const string& directory) {
-    vector<string> files;
-    for (const auto& entry : fs::directory_iterator(directory)) {
-        if (entry.is_regular_file() && entry.path().extension() == ".txt") {
-            files.push_back(entry.path().string());
+// Function to get the docID after the last document of the live segments, where the
+// documents of a new segment start. Only one ingest may run at a time per directory.
+int nextFreeDocID(const string& segmentsDir) {
+    FileLock lock(segmentsDir + "/manifest.lock");
+    int next = 0;
+    for (const auto& segment : readSegmentManifest(segmentsDir)) {
+        string segmentPath = segmentsDir + "/" + segment.name;
+        ifstream pageTable(segmentPath + "/pagetable.bin", ios::binary);
+        char magic[sizeof(PAGE_TABLE_MAGIC)];
+        uint64_t header[2]; // First docID and slot count
+        if (pageTable.read(magic, sizeof(magic)) && pageTable.read(reinterpret_cast<char*>(header), sizeof(header))) {
+            next = max<int64_t>(next, static_cast<int64_t>(header[0] + header[1]));
+        } else {
+            vector<int> docIDs = readPageTableDocIDs(segmentPath + "/pagetable.tsv");
+            next = docIDs.empty() ? next : max(next, docIDs.back() + 1);
         }
     }
-    // Sort files to ensure consistent merging order
-    sort(files.begin(), files.end());
-    return files;
+    return next;
 }
 
-// Function to write the Lexicon in text format
-void writeLexiconText(const string& lexiconFilePath, const vector<LexiconEntry>& lexicon) {
-    ofstream lexFile(lexiconFilePath);
-    if (!lexFile.is_open()) {
-        throw runtime_error("Failed to open lexicon file for writing: " + lexiconFilePath);
+// Function to rebuild segments [first, last) of the manifest into one new segment without
+// their deleted documents and swap it in for them. Callers hold the merge lock, so the
+// inputs stay in place; deletions that arrive during the rebuild are carried over to the
+// new segment when it is swapped in. Returns the new segment's name.
+string rebuildSegments(const string& segmentsDir, const vector<SegmentInfo>& segments,
+                       size_t first, size_t last) {
+    string name;
+    {
+        FileLock lock(segmentsDir + "/manifest.lock");
+        name = nextSegmentName(segmentsDir);
+        fs::create_directories(segmentsDir + "/" + name + ".tmp");
     }
-
-    for (const auto& entry : lexicon) {
-        // Write term, offset, length, and docFreq separated by spaces
-        lexFile << entry.term << " " << entry.offset << " " << entry.length << " " << entry.docFreq << "\n";
+    string builtDir = segmentsDir + "/" + name + ".tmp";
+
+    vector<string> inputs;
+    vector<string> pageTables;
+    DeletionBitmap deletions;
+    for (size_t i = first; i < last; ++i) {
+        inputs.push_back(segmentsDir + "/" + segments[i].name);
+        pageTables.push_back(inputs.back() + "/pagetable.tsv");
+        deletions.insertAll(DeletionBitmap::load(inputs.back()));
+    }
+    bool positional = fs::exists(inputs.front() + "/positions.bin");
+    writeFinalIndex(inputs, builtDir, positional, &deletions);
+    writeLivePageTable(pageTables, builtDir + "/pagetable.tsv", deletions);
+    writeBinaryPageTable(builtDir + "/pagetable.tsv", builtDir + "/pagetable.bin");
+
+    // Segments hold disjoint docID ranges, so the merged map is the union of theirs;
+    // documents of segments without a map keep their docIDs
+    vector<DocIDMap> docMaps;
+    bool mapped = false;
+    for (const auto& input : inputs) {
+        docMaps.push_back(DocIDMap::load(input));
+        mapped = mapped || !docMaps.back().empty();
+    }
+    if (mapped) {
+        DocIDMap docMap;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (docMaps[i].empty()) {
+                for (int docID : readPageTableDocIDs(pageTables[i])) {
+                    docMap.set(docID, docID);
+                }
+            }
+            docMap.insertAll(docMaps[i]);
+        }
+        docMap.save(builtDir);
     }
 
-    lexFile.close();
+    {
+        FileLock lock(segmentsDir + "/manifest.lock");
+        DeletionBitmap latest;
+        for (const auto& input : inputs) {
+            latest.insertAll(DeletionBitmap::load(input));
+        }
+        if (!(latest == deletions)) {
+            latest.save(builtDir);
+        }
+        vector<SegmentInfo> current = readSegmentManifest(segmentsDir);
+        fs::rename(builtDir, segmentsDir + "/" + name);
+        current.erase(current.begin() + first, current.begin() + last);
+        current.insert(current.begin() + first, describeSegment(name, segmentsDir + "/" + name));
+        writeSegmentManifest(segmentsDir, current);
+        // Queries hold the lock shared from reading the manifest until its segments are
+        // open, so none is still about to open the inputs
+        for (const auto& input : inputs) {
+            fs::remove_all(input);
+        }
+    }
+    return name;
 }
 
-// Function to turn int to bytes
-vector<uint8_t> intToVarByte(int num) {
-    vector<uint8_t> bytes;
+// Function to apply the size-tiered policy until no tier has enough segments to merge.
+// Merged segments are built aside and swapped into the manifest in one step, so queries
+// always see either the old segments or the merged one. Deleted documents are dropped
+// as a side effect. Returns the number of merges.
+int mergeSegments(const string& segmentsDir) {
+    FileLock mergeLock(segmentsDir + "/merge.lock", false);
+    if (!mergeLock.held()) {
+        cout << "Another segment merge is running in " << segmentsDir << endl;
+        return 0;
+    }
 
-    while (num > 0) {
-        // Extract the 7 least significant bits
-        uint8_t byte = num & 0x7F;
-        // Set the high bit to indicate more bytes if needed
-        if (num > 0x7F)
+    int merges = 0;
+    while (true) {
+        vector<SegmentInfo> segments;
         {
-            byte |= 0x80;
+            FileLock lock(segmentsDir + "/manifest.lock");
+            segments = readSegmentManifest(segmentsDir);
         }
-        bytes.push_back(byte);
-        // Shift the value to the right by 7 bits
-        num >>= 7;
+        auto [first, last] = pickSegmentMerge(segments);
+        if (first == last) {
+            return merges;
+        }
+        string name = rebuildSegments(segmentsDir, segments, first, last);
+        cout << "Merged " << last - first << " segments into " << name << endl;
+        merges++;
     }
-    return bytes;
 }
 
-//function to turn bytes to int
-int byteToInt(const vector<uint8_t>& bytes) {
-    int value = 0;
-    int shift = 0;
-
-    for (size_t i = 0; i < bytes.size(); ++i) {
-        value |= (bytes[i] & 0x7F) << shift; // Mask the highest bit
-        shift += 7;
-
-        if (bytes[i] & 0x80) {  // If the highest bit is 1, continue
-            continue;
+// Function to mark documents deleted. Each listed docID is set in the deletion bitmap of
+// the index whose page table holds it; queries skip it from their next open on. Returns
+// the number of documents newly deleted.
+size_t deleteDocuments(const vector<string>& indexDirs, const vector<string>& pageTables,
+                       const vector<int64_t>& docIDs) {
+    unordered_set<int64_t> requested(docIDs.begin(), docIDs.end());
+    size_t deleted = 0;
+    for (size_t i = 0; i < indexDirs.size(); ++i) {
+        DeletionBitmap bitmap = DeletionBitmap::load(indexDirs[i]);
+        DocIDMap docMap = DocIDMap::load(indexDirs[i]); // Listed docIDs are the collection's
+        size_t before = deleted;
+        ifstream pageTable(pageTables[i]);
+        string line;
+        while (getline(pageTable, line)) {
+            int docID = atoi(line.c_str());
+            if (requested.count(docMap.map(docID)) && bitmap.insert(docID)) {
+                deleted++;
+            }
+        }
+        if (deleted != before) {
+            bitmap.save(indexDirs[i]);
         }
-        break; // Exit if the highest bit is 0
     }
-
-    return value;
+    return deleted;
 }
-   
 
-// Function to perform k-way merge and build the final inverted index with Differential Encoding and Non-Interleaved Storage
-void mergePostingFiles(const vector<string>& files, const string& indexFilePath,
-                      const string& lexiconFilePath,
-                      vector<LexiconEntry>& lexicon,
-                      vector<BlockMetaData>& blockMetaData) {
-    // Initialize readers
-    vector<unique_ptr<PostingFileReader>> readers;
-    for (const auto& file : files) {
-        readers.emplace_back(make_unique<PostingFileReader>(file));
+// Function to read docIDs, one per line, from a file or from stdin for "-"
+vector<int64_t> readDocIDList(const string& path) {
+    ifstream file;
+    if (path != "-") {
+        file.open(path);
+        if (!file.is_open()) {
+            throw runtime_error("Failed to open docID list: " + path);
+        }
     }
+    istream& input = path == "-" ? cin : file;
+    vector<int64_t> docIDs;
+    int64_t docID;
+    while (input >> docID) {
+        docIDs.push_back(docID);
+    }
+    return docIDs;
+}
 
-    // Initialize priority queue
-    priority_queue<pair<string, size_t>,
-                        vector<pair<string, size_t>>,
-                        ComparePQNode> minHeap;
-
-    
-    // Insert the first term from each reader into the heap
-    for (size_t i = 0; i < readers.size(); ++i) {
-        if (readers[i]->hasNext()) {
-            minHeap.emplace(readers[i]->getCurrentTerm(), i);
+// Function to rewrite every segment that has deleted documents, each on its own, so its
+// blocks, lexicon and page table only describe live documents. Returns the number of
+// segments rewritten.
+int compactSegments(const string& segmentsDir) {
+    FileLock mergeLock(segmentsDir + "/merge.lock");
+    int compacted = 0;
+    while (true) {
+        vector<SegmentInfo> segments;
+        {
+            FileLock lock(segmentsDir + "/manifest.lock");
+            segments = readSegmentManifest(segmentsDir);
+        }
+        size_t next = 0;
+        while (next < segments.size() &&
+               DeletionBitmap::load(segmentsDir + "/" + segments[next].name).empty()) {
+            next++;
         }
+        if (next == segments.size()) {
+            return compacted;
+        }
+        uint64_t docsBefore = segments[next].docCount;
+        string name = rebuildSegments(segmentsDir, segments, next, next + 1);
+        cout << "Compacted " << segments[next].name << " into " << name << " ("
+             << docsBefore - describeSegment(name, segmentsDir + "/" + name).docCount
+             << " documents dropped)" << endl;
+        compacted++;
     }
+}
 
-    // Open final index file for writing in text format
-    ofstream indexFile(indexFilePath, ios::binary);
-    if (!indexFile.is_open()) {
-        throw runtime_error("Failed to open final index file for writing: " + indexFilePath);
+// Function to rewrite the single index in finalIndexDir, with its page table, without
+// its deleted documents. The new index is built next to the old one and renamed in.
+void compactIndex(const string& finalIndexDir, const string& pageTableFilePath) {
+    DeletionBitmap deletions = DeletionBitmap::load(finalIndexDir);
+    if (deletions.empty()) {
+        cout << "No deleted documents in " << finalIndexDir << endl;
+        return;
+    }
+    string builtDir = finalIndexDir + ".tmp";
+    fs::remove_all(builtDir);
+    fs::create_directories(builtDir);
+    bool positional = fs::exists(finalIndexDir + "/positions.bin");
+    writeFinalIndex({finalIndexDir}, builtDir, positional, &deletions);
+    // A page table kept inside the index moves with it
+    bool ownPageTable = fs::path(pageTableFilePath).parent_path() == fs::path(finalIndexDir);
+    string newPageTablePath = ownPageTable ? builtDir + "/pagetable.tsv" : pageTableFilePath + ".tmp";
+    writeLivePageTable({pageTableFilePath}, newPageTablePath, deletions);
+    writeBinaryPageTable(newPageTablePath, builtDir + "/pagetable.bin");
+    if (fs::exists(finalIndexDir + "/docmap.bin")) {
+        fs::copy_file(finalIndexDir + "/docmap.bin", builtDir + "/docmap.bin");
     }
 
-    uint64_t currentOffset = 0; // Byte offset in the index file
-
-    vector<uint8_t> combinedIndexBytes;
-    vector<int> combinedDocID;
-    vector<int> combinedFreq;
-
-    while (!minHeap.empty()) {
-        auto [smallestTerm, fileIdx] = minHeap.top();
-        minHeap.pop();
+    FileLock lock(finalIndexDir + ".lock");
+    DeletionBitmap latest = DeletionBitmap::load(finalIndexDir);
+    if (!(latest == deletions)) {
+        latest.save(builtDir);
+    }
+    fs::remove_all(finalIndexDir + ".old");
+    fs::rename(finalIndexDir, finalIndexDir + ".old");
+    fs::rename(builtDir, finalIndexDir);
+    if (!ownPageTable) {
+        fs::rename(newPageTablePath, pageTableFilePath);
+    }
+    fs::remove_all(finalIndexDir + ".old");
+    cout << "Compacted " << finalIndexDir << ": " << deletions.count() << " documents dropped" << endl;
+}
 
-        // Collect all postings for the smallest term from all readers
-        vector<Posting> mergedPostings = readers[fileIdx]->getCurrentPostings();
+// Function to run the segment merge in a child process, so adding a segment returns
+// as soon as the new segment is live. The child execs mergerPath --merge-segments
+// instead of running on in a copy of this process and its threads.
+void startBackgroundSegmentMerge(const string& mergerPath, const string& segmentsDir) {
+    if (pickSegmentMerge(readSegmentManifest(segmentsDir)).second == 0) {
+        return;
+    }
+    vector<char*> argv = {const_cast<char*>(mergerPath.c_str()), const_cast<char*>("--merge-segments"),
+                          const_cast<char*>(segmentsDir.c_str()), nullptr};
+    string execError = "Failed to run " + mergerPath + " for the background segment merge\n";
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw runtime_error("Failed to start background segment merge");
+    }
+    if (pid == 0) {
+        execvp(argv[0], argv.data());
+        // Only async-signal-safe calls such as write() are allowed before exec
+        ssize_t written = write(STDERR_FILENO, execError.data(), execError.size());
+        _exit(written < 0 ? EXIT_FAILURE : 127);
+    }
+    cout << "Merging segments in the background (pid " << pid << ")" << endl;
+}
 
-        // Advance the reader and add the next term to the heap
-        readers[fileIdx]->readNextTerm();
-        if (readers[fileIdx]->hasNext()) {
-            minHeap.emplace(readers[fileIdx]->getCurrentTerm(), fileIdx);
-        }
+// Function to parse a byte count such as 256M, 2G or 4096
+size_t parseByteSize(const string& text) {
+    char* end = nullptr;
+    double value = strtod(text.c_str(), &end);
+    size_t multiplier = 1;
+    if (*end == 'K' || *end == 'k') multiplier = size_t(1) << 10;
+    if (*end == 'M' || *end == 'm') multiplier = size_t(1) << 20;
+    if (*end == 'G' || *end == 'g') multiplier = size_t(1) << 30;
+    if (end == text.c_str() || value < 0) {
+        throw runtime_error("Invalid size: " + text);
+    }
+    return static_cast<size_t>(value * multiplier);
+}
 
-        // Check for other readers with the same term
-        while (!minHeap.empty() && minHeap.top().first == smallestTerm) {
-            auto [sameTerm, sameFileIdx] = minHeap.top();
-            minHeap.pop();
-            // Merge postings from the same term
-            const auto& samePostings = readers[sameFileIdx]->getCurrentPostings();
-            mergedPostings.insert(mergedPostings.end(), samePostings.begin(), samePostings.end());
+int main(int argc, char* argv[]) {
 
-            // Advance the reader and add the next term to the heap
-            readers[sameFileIdx]->readNextTerm();
-            if (readers[sameFileIdx]->hasNext()) {
-                minHeap.emplace(readers[sameFileIdx]->getCurrentTerm(), sameFileIdx);
+    size_t memoryBudget = 0; // 0 merges every run in one pass
+    string segmentsDir;      // Add the runs as a new segment of this directory
+    bool mergeSegmentsOnly = false;
+    string deleteListPath;   // Mark the docIDs listed here deleted instead of merging
+    bool compact = false;    // Rewrite indexes without their deleted documents instead of merging
+    bool reorder = false;    // Renumber documents by graph bisection before merging
+    bool resume = false;     // Continue an interrupted merge from its checkpoint
+    size_t mergeThreads = max(1u, thread::hardware_concurrency());
+    string intermediateDir = "src/temp";
+    string pageTableFilePath = "src/pagetable.tsv";
+    string metricsPath;            // Append JSON metric snapshots here
+    double metricsInterval = 1.0;  // Seconds between snapshots
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--memory-budget" && i + 1 < argc) {
+            try {
+                memoryBudget = parseByteSize(argv[++i]);
+            } catch (const exception& ex) {
+                cerr << "Error: " << ex.what() << endl;
+                return EXIT_FAILURE;
             }
+        } else if (arg == "--segments" && i + 1 < argc) {
+            segmentsDir = argv[++i];
+        } else if (arg == "--merge-segments" && i + 1 < argc) {
+            segmentsDir = argv[++i];
+            mergeSegmentsOnly = true;
+        } else if (arg == "--delete" && i + 1 < argc) {
+            deleteListPath = argv[++i];
+        } else if (arg == "--compact") {
+            compact = true;
+        } else if (arg == "--reorder") {
+            reorder = true;
+        } else if (arg == "--resume") {
+            resume = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            mergeThreads = max(1, atoi(argv[++i]));
+        } else if (arg == "--runs" && i + 1 < argc) {
+            intermediateDir = argv[++i];
+        } else if (arg == "--pagetable" && i + 1 < argc) {
+            pageTableFilePath = argv[++i];
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metricsPath = argv[++i];
+        } else if (arg == "--metrics-interval" && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            metricsInterval = atof(argv[++i]);
+        } else {
+            cerr << "Usage: ./merger [--memory-budget SIZE] [--runs DIR] [--pagetable FILE] [--reorder] [--resume]\n"
+                 << "                [--threads N]\n"
+                 << "                [--metrics FILE] [--metrics-interval SECONDS]\n"
+                 << "                [--segments DIR | --merge-segments DIR]\n"
+                 << "       ./merger [--segments DIR] --delete FILE|- | --compact" << endl;
+            return EXIT_FAILURE;
         }
+    }
 
-        // Differential Encoding for docIDs
-        int previousDocID = 0;
-        int currDocID;
-        int lastBlockID;
-        int postingCount = 0;
-
-        LexiconEntry lexEntry;
-        lexEntry.term = smallestTerm;
-        lexEntry.offset = currentOffset;
-        lexEntry.length = 0;
-        
-        for (auto& posting : mergedPostings) {
-            
-            currDocID = posting.docID;
-            //if the posting is more than POSTING_PER_BLOCK, we block them
-            if (postingCount % POSTING_PER_BLOCK == 0 && postingCount != 0) {
-                BlockMetaData currBlock;
-                currBlock.size = 0;
-                currBlock.lastDocID = lastBlockID;
-                for (const auto& docID : combinedDocID) {
-                    vector<uint8_t> varbytes = intToVarByte(docID);
-                    combinedIndexBytes.insert(combinedIndexBytes.end(), varbytes.begin(), varbytes.end());
-                }
-                for (const auto& freq : combinedFreq) {
-                    vector<uint8_t> varbytes = intToVarByte(freq);
-                    combinedIndexBytes.insert(combinedIndexBytes.end(), varbytes.begin(), varbytes.end());
-                }
-                indexFile.write(reinterpret_cast<char*>(combinedIndexBytes.data()), combinedIndexBytes.size());
-                
-                currBlock.size = static_cast<uint32_t>(combinedIndexBytes.size());
-                lexEntry.length += static_cast<uint32_t>(combinedIndexBytes.size());
-                if (postingCount == mergedPostings.size()-1) {
-                    lastBlockID = currDocID;
-                }
-                
-                blockMetaData.push_back(currBlock);
-                combinedIndexBytes.clear();
-                combinedDocID.clear();
-                combinedFreq.clear();
-            }
-            else if (postingCount % POSTING_PER_BLOCK == POSTING_PER_BLOCK - 1) {
-                lastBlockID = currDocID;
-            }
-
-            //take the difference of postings 
-            posting.docID -= previousDocID;
-            
-            previousDocID = currDocID;
-    
-            combinedDocID.push_back(posting.docID);
-            combinedFreq.push_back(posting.termFreq);
-            postingCount++;
-            
+    if (mergeSegmentsOnly) {
+        try {
+            int merges = mergeSegments(segmentsDir);
+            cout << "Segment merge completed: " << merges << " merges." << endl;
+            return EXIT_SUCCESS;
+        } catch (const exception& ex) {
+            cerr << "Error during segment merge: " << ex.what() << endl;
+            return EXIT_FAILURE;
         }
+    }
 
-        //write out remaining index
-        if (!combinedDocID.empty()) {
-            BlockMetaData currBlock;
-            currBlock.size = 0;
-            currBlock.lastDocID = previousDocID;
-            /*if (smallestTerm == "peacefully") {
-                cout << "currBlock.lastDocID" << currBlock.lastDocID << endl;
-            }*/
-            for (const auto& docID : combinedDocID) {
-                vector<uint8_t> varbytes = intToVarByte(docID);
-                combinedIndexBytes.insert(combinedIndexBytes.end(), varbytes.begin(), varbytes.end());
+    string finalIndexDir = "src/index_4";
+    // Indexes keep their page table inside, in their own docIDs; older ones use the indexer's
+    string indexPageTablePath = fs::exists(finalIndexDir + "/pagetable.tsv") ? finalIndexDir + "/pagetable.tsv"
+                                                                              : pageTableFilePath;
+
+    if (!deleteListPath.empty()) {
+        try {
+            vector<int64_t> docIDs = readDocIDList(deleteListPath);
+            vector<string> indexDirs;
+            vector<string> pageTables;
+            string lockPath = finalIndexDir + ".lock";
+            if (segmentsDir.empty()) {
+                indexDirs.push_back(finalIndexDir);
+                pageTables.push_back(indexPageTablePath);
+            } else {
+                lockPath = segmentsDir + "/manifest.lock";
             }
-            for (const auto& freq : combinedFreq) {
-                vector<uint8_t> varbytes = intToVarByte(freq);
-                combinedIndexBytes.insert(combinedIndexBytes.end(), varbytes.begin(), varbytes.end());
+            // Compaction swaps indexes under the same lock, so no deletion is lost
+            FileLock lock(lockPath);
+            if (!segmentsDir.empty()) {
+                for (const auto& segment : readSegmentManifest(segmentsDir)) {
+                    indexDirs.push_back(segmentsDir + "/" + segment.name);
+                    pageTables.push_back(indexDirs.back() + "/pagetable.tsv");
+                }
             }
-            indexFile.write(reinterpret_cast<char*>(combinedIndexBytes.data()), combinedIndexBytes.size());
-            
-            currBlock.size = static_cast<uint32_t>(combinedIndexBytes.size());
-            lexEntry.length += static_cast<uint32_t>(combinedIndexBytes.size());
-            blockMetaData.push_back(currBlock);
-            combinedIndexBytes.clear();
-            combinedDocID.clear();
-            combinedFreq.clear();
+            size_t deleted = deleteDocuments(indexDirs, pageTables, docIDs);
+            cout << "Deleted " << deleted << " of " << docIDs.size() << " listed documents." << endl;
+            return EXIT_SUCCESS;
+        } catch (const exception& ex) {
+            cerr << "Error during deletion: " << ex.what() << endl;
+            return EXIT_FAILURE;
         }
-
-        lexEntry.docFreq = mergedPostings.size();
-
-        // Add to lexicon
-        lexicon.emplace_back(lexEntry);
-
-        // Update the currentOffset
-        currentOffset += lexEntry.length;
-    }
-
-    
-
-    indexFile.close();
-}
-
-void writeBlockMetaData(const string& blockMetaDataFilePath, const vector<BlockMetaData>& blockMetaData) {
-    // Open block meta data file for writing in text format
-    ofstream metaFile(blockMetaDataFilePath);
-    if (!metaFile.is_open()) {
-        throw runtime_error("Failed to open block meta data file for writing: " + blockMetaDataFilePath);
     }
 
-    for (const auto& metaData : blockMetaData) {
-        //write block meata data
-        metaFile << metaData.size << " " << metaData.lastDocID << "\n";
+    if (compact) {
+        try {
+            if (segmentsDir.empty()) {
+                compactIndex(finalIndexDir, indexPageTablePath);
+            } else {
+                int compacted = compactSegments(segmentsDir);
+                cout << "Compaction completed: " << compacted << " segments rewritten." << endl;
+            }
+            return EXIT_SUCCESS;
+        } catch (const exception& ex) {
+            cerr << "Error during compaction: " << ex.what() << endl;
+            return EXIT_FAILURE;
+        }
     }
 
-    metaFile.close();
-    
-}
-
-int main() {
-
     // Start the timer
     auto start = chrono::high_resolution_clock::now();
 
-    string intermediateDir = "src/temp";
-    string finalIndexDir = "src/index_4";
+    // A new segment is built aside and only becomes visible once it is complete
+    if (!segmentsDir.empty()) {
+        try {
+            fs::create_directories(segmentsDir);
+            finalIndexDir = segmentsDir + "/incoming.tmp";
+            if (!resume) {
+                fs::remove_all(finalIndexDir);
+            }
+        } catch (const fs::filesystem_error& e) {
+            cerr << "Filesystem error: " << e.what() << endl;
+            return EXIT_FAILURE;
+        }
+    }
 
     // Check if intermediate directory exists
     if (!fs::exists(intermediateDir) || !fs::is_directory(intermediateDir)) {
@@ -378,53 +2985,132 @@ int main() {
         return EXIT_FAILURE;
     }
 
-    // List intermediate text files
+    // List intermediate files
     vector<string> intermediateFiles = listIntermediateFiles(intermediateDir);
     if (intermediateFiles.empty()) {
-        cerr << "No intermediate text files found in directory: " << intermediateDir << endl;
+        cerr << "No intermediate files found in directory: " << intermediateDir << endl;
         return EXIT_FAILURE;
     }
 
-    cout << "Found " << intermediateFiles.size() << " intermediate files." << endl;
+    // Runs written with --positions carry token positions into a separate section
+    bool positional = openPostingFileReader(intermediateFiles.front())->hasPositions();
 
-    // Merge posting files
-    string finalIndexPath = finalIndexDir + "/index.bin";
-    string lexiconPath = finalIndexDir + "/lexicon.txt";
-    string BlockMetaDataFilePath = finalIndexDir + "/blockMetaData.txt";
-    vector<LexiconEntry> lexicon;
-    vector<BlockMetaData> blockMetaData;
+    // A resumed merge reads the inputs its checkpoint was written for, which may be runs
+    // of intermediate merge passes; a fresh merge drops any old checkpoint
+    vector<string> checkpointInputs;
     try {
-        mergePostingFiles(intermediateFiles, finalIndexPath, lexiconPath, lexicon, blockMetaData);
-        cout << "Merged postings into final index file: " << finalIndexPath << endl;
+        if (resume) {
+            checkpointInputs = MergeCheckpoint::inputsOf(finalIndexDir);
+            if (!all_of(checkpointInputs.begin(), checkpointInputs.end(),
+                        [](const string& input) { return fs::exists(input); })) {
+                checkpointInputs.clear();
+            }
+            if (checkpointInputs.empty()) {
+                cout << "No merge checkpoint in " << finalIndexDir << ", merging from the beginning" << endl;
+            }
+        }
+        if (checkpointInputs.empty()) {
+            MergeCheckpoint(finalIndexDir).remove();
+        } else {
+            intermediateFiles = checkpointInputs;
+        }
     } catch (const exception& ex) {
-        cerr << "Error during merging: " << ex.what() << endl;
+        cerr << "Error: " << ex.what() << endl;
         return EXIT_FAILURE;
     }
-    
-    // Write lexicon in text format
+
+    if (!metricsPath.empty()) {
+        try {
+            metrics.startReporter(metricsPath, metricsInterval);
+        } catch (const exception& ex) {
+            cerr << ex.what() << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // A run reader keeps about READER_WINDOW resident; half of the budget
+    // goes to readers and the rest to the merged postings and output buffers
+    size_t fanIn = max<size_t>(2, memoryBudget / 2 / READER_WINDOW);
+    if (memoryBudget > 0 && checkpointInputs.empty()) {
+        if (intermediateFiles.size() > fanIn) {
+            cout << "Merging " << intermediateFiles.size() << " runs with fan-in " << fanIn << endl;
+            try {
+                intermediateFiles = reduceRunsToFanIn(intermediateFiles, fanIn, intermediateDir + "/merge", positional);
+            } catch (const exception& ex) {
+                cerr << "Error during merging: " << ex.what() << endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // Every merge thread opens every run, so the budget's readers are shared out
+    // by cutting threads, never the fan-in
+    if (memoryBudget > 0) {
+        size_t budgetThreads = max<size_t>(1, fanIn / intermediateFiles.size());
+        if (budgetThreads < mergeThreads) {
+            cout << "Merging on " << budgetThreads << " threads to stay within the memory budget" << endl;
+            mergeThreads = budgetThreads;
+        }
+    }
+
+    uintmax_t intermediateBytes = 0;
+    for (const auto& file : intermediateFiles) {
+        intermediateBytes += fs::file_size(file);
+    }
+    cout << "Found " << intermediateFiles.size() << " intermediate files (" << intermediateBytes << " bytes)." << endl;
+
     try {
-        writeLexiconText(lexiconPath, lexicon);
-        cout << "Written lexicon file: " << lexiconPath << endl;
+        // Documents get consecutive docIDs from where the index starts, after the live
+        // segments, in run order or in bisection order. The index keeps its own page table
+        // in those docIDs and, unless every document keeps its collection docID, a docID map.
+        vector<int> runDocIDs = readPageTableDocIDs(pageTableFilePath);
+        vector<uint32_t> order;
+        if (reorder) {
+            order = bisectionOrder(intermediateFiles, runDocIDs);
+        }
+        DocIDMap collectionDocIDs = DocIDMap::load(intermediateDir);
+        int firstDocID = segmentsDir.empty() ? 0 : nextFreeDocID(segmentsDir);
+        DocIDMap renumbering; // Run docID -> index docID
+        DocIDMap docMap;      // Index docID -> collection docID
+        bool renumbered = false;
+        bool mapped = false;
+        for (size_t i = 0; i < runDocIDs.size(); ++i) {
+            int runDocID = runDocIDs[reorder ? order[i] : i];
+            int docID = firstDocID + static_cast<int>(i);
+            int64_t collectionDocID = collectionDocIDs.map(runDocID);
+            renumbering.set(runDocID, docID);
+            docMap.set(docID, collectionDocID);
+            renumbered = renumbered || runDocID != docID;
+            mapped = mapped || collectionDocID != docID;
+        }
+        if (mapped) {
+            docMap.save(finalIndexDir);
+        } else {
+            fs::remove(finalIndexDir + "/docmap.bin");
+        }
+        writeRenumberedPageTable(pageTableFilePath, finalIndexDir + "/pagetable.tsv", renumbering);
+        writeFinalIndex(intermediateFiles, finalIndexDir, positional, nullptr, renumbered ? &renumbering : nullptr, true,
+                        mergeThreads);
+        writeBinaryPageTable(finalIndexDir + "/pagetable.tsv", finalIndexDir + "/pagetable.bin");
+        // Remove runs left by intermediate merge passes
+        fs::remove_all(intermediateDir + "/merge");
+        if (!segmentsDir.empty()) {
+            string name = commitSegment(segmentsDir, finalIndexDir);
+            cout << "Added segment " << name << " to " << segmentsDir << endl;
+            startBackgroundSegmentMerge(argv[0], segmentsDir);
+        }
     } catch (const exception& ex) {
-        cerr << "Error writing lexicon: " << ex.what() << endl;
+        cerr << "Error during merging: " << ex.what() << endl;
         return EXIT_FAILURE;
     }
 
+    metrics.stopReporter();
+    metrics.report(cout);
     cout << "Merger completed successfully." << endl;
     cout << "index.txt output format: " << endl;
     cout << "DocID1 gapDocID2 ... termFreq1 termFreq2 ..." << endl;
     cout << "loxicon.txt output format: " << endl;
     cout << "term offset length docFreq" << endl;
-
-    // Write block meta data in text format
-    try {
-        writeBlockMetaData(BlockMetaDataFilePath, blockMetaData);
-        cout << "Written block meta data file: " << BlockMetaDataFilePath << endl;
-    } catch (const exception& ex) {
-        cerr << "Error writing block meta data: " << ex.what() << endl;
-        return EXIT_FAILURE;
-    }
-
     cout << "blockMetaData.txt output format: " << endl;
     cout << "block1size block1lastDocID ... " << endl;
 
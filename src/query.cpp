@@ -5,6 +5,24 @@
 #include <chrono>
 #include <vector>
 #include <algorithm>
+#include <queue>
+#include <map>
+#include <functional>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <filesystem>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+namespace fs = std::filesystem;
 
 using namespace std;
 
@@ -64,31 +82,152 @@ unordered_map<string, LexiconEntry> loadLexicon(const string& filePath) {
     return lexiconMap;
 }
 
-unordered_map<int, int> loadPageTable(const string& filePath) {
-    unordered_map<int, int> pageMap;
-    ifstream pageTableFile(filePath);
+// Length in tokens of every document of one index, as a flat array indexed by docID.
+// The merger writes it as pagetable.bin: "WSEPAGE1", int64 first docID, uint64 slot
+// count, uint64 document count, uint64 total length, then a uint16 length per slot.
+// The file is mapped as is, so loading parses nothing and a lookup is one array read.
+class PageTable {
+public:
+    static constexpr uint16_t NO_DOCUMENT = 0xFFFF; // Slot of a docID without a document
+    static constexpr uint16_t MAX_LENGTH = 0xFFFE;  // Longer documents are stored with this length
+
+    PageTable() = default;
+    PageTable(PageTable&&) = default;
+    PageTable& operator=(PageTable&&) = default;
+    PageTable(const PageTable&) = delete;
+    PageTable& operator=(const PageTable&) = delete;
+
+    // Function to map binaryPath, or to read the docID\tlength lines of textPath for an
+    // index written before binary page tables
+    static PageTable load(const string& binaryPath, const string& textPath) {
+        PageTable table;
+        int fd = open(binaryPath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            ifstream pageTableFile(textPath);
+            if (!pageTableFile.is_open()) {
+                throw runtime_error("Failed to open page table file for reading: " + textPath);
+            }
+            // Lines may come in any docID order, so the array is sized once all are read
+            vector<pair<int, uint32_t>> documents;
+            int docID;
+            uint32_t length;
+            while (pageTableFile >> docID >> length) {
+                documents.emplace_back(docID, length);
+            }
+            if (!documents.empty()) {
+                auto [minIt, maxIt] = minmax_element(documents.begin(), documents.end());
+                table.base = minIt->first;
+                table.owned.assign(static_cast<size_t>(maxIt->first - table.base + 1), NO_DOCUMENT);
+            }
+            for (const auto& document : documents) {
+                table.owned[document.first - table.base] = static_cast<uint16_t>(min<uint32_t>(document.second, MAX_LENGTH));
+                table.total += document.second;
+            }
+            table.lengths = table.owned.data();
+            table.slots = table.owned.size();
+            table.documents = documents.size();
+            cout << "page table file loaded" << endl;
+            return table;
+        }
+        struct stat st;
+        size_t size = fstat(fd, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+        void* addr = size >= HEADER_BYTES ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw runtime_error("Failed to map page table file: " + binaryPath);
+        }
+        table.mapping = shared_ptr<void>(addr, [size](void* mapped) { munmap(mapped, size); });
+
+        const char* bytes = static_cast<const char*>(addr);
+        uint64_t header[4];
+        memcpy(header, bytes + 8, sizeof(header));
+        table.base = static_cast<int64_t>(header[0]);
+        table.slots = header[1];
+        table.documents = header[2];
+        table.total = header[3];
+        if (memcmp(bytes, "WSEPAGE1", 8) != 0 || size != HEADER_BYTES + table.slots * sizeof(uint16_t)) {
+            throw runtime_error("Corrupt page table file: " + binaryPath);
+        }
+        table.lengths = reinterpret_cast<const uint16_t*>(bytes + HEADER_BYTES);
+        return table;
+    }
 
-    if (!pageTableFile.is_open()) {
-        throw runtime_error("Failed to open page table file for reading: " + filePath);
+    // Function to add a document after every document already in the table
+    void add(int docID, uint32_t length) {
+        if (slots == 0) {
+            base = docID;
+        } else if (docID < base + static_cast<int64_t>(slots)) {
+            throw runtime_error("Page table documents must be added in increasing docID order");
+        }
+        owned.resize(static_cast<size_t>(docID - base + 1), NO_DOCUMENT);
+        owned.back() = static_cast<uint16_t>(min<uint32_t>(length, MAX_LENGTH));
+        lengths = owned.data();
+        slots = owned.size();
+        documents++;
+        total += length;
     }
 
-    string line;
-    while (getline(pageTableFile, line)) {
-        istringstream iss(line);
-        int docID;
-        int length; //length in words
+    // Length of docID, or NO_DOCUMENT
+    uint16_t length(int docID) const {
+        uint64_t slot = static_cast<uint64_t>(docID - base); // Wraps around below base
+        return slot < slots ? lengths[slot] : NO_DOCUMENT;
+    }
 
-        if (iss >> docID >> length) {
-            pageMap[docID] = length;
-        } else {
-            cerr << "Error parsing line in page table file: " << line << endl;
+    uint64_t documentCount() const {
+        return documents;
+    }
+
+    uint64_t totalLength() const {
+        return total;
+    }
+
+private:
+    static constexpr size_t HEADER_BYTES = 40;
+
+    shared_ptr<void> mapping;  // pagetable.bin, if loaded from it
+    vector<uint16_t> owned;    // Lengths built in memory otherwise
+    const uint16_t* lengths = nullptr;
+    int64_t base = 0;
+    uint64_t slots = 0;
+    uint64_t documents = 0;
+    uint64_t total = 0;
+};
+
+// DocIDs of an index mapped back to the docIDs of the collection, read from docmap.bin:
+// int64 first docID, uint64 count, then an int64 docID per docID from the first, -1
+// where there is none. Without one, docIDs map to themselves.
+class DocIDMap {
+public:
+    static DocIDMap load(const string& indexDir) {
+        DocIDMap docMap;
+        ifstream file(indexDir + "/docmap.bin", ios::binary);
+        if (!file.is_open()) {
+            return docMap;
         }
+        uint64_t count = 0;
+        file.read(reinterpret_cast<char*>(&docMap.base), sizeof(docMap.base));
+        file.read(reinterpret_cast<char*>(&count), sizeof(count));
+        docMap.ids.resize(count);
+        file.read(reinterpret_cast<char*>(docMap.ids.data()), count * sizeof(int64_t));
+        if (!file) {
+            throw runtime_error("Truncated docID map: " + indexDir + "/docmap.bin");
+        }
+        return docMap;
     }
 
-    pageTableFile.close();
-    cout << "page table file loaded" << endl;
-    return pageMap;
-}
+    bool empty() const {
+        return ids.empty();
+    }
+
+    int64_t map(int docID) const {
+        uint64_t slot = static_cast<uint64_t>(static_cast<int64_t>(docID) - base); // Wraps around below base
+        return slot < ids.size() && ids[slot] >= 0 ? ids[slot] : docID;
+    }
+
+private:
+    int64_t base = 0;
+    vector<int64_t> ids;
+};
 
 vector<BlockMetaData> loadBlockMetaData(const string& filePath) {
     vector<BlockMetaData> blockMetaDataVec;
@@ -118,7 +257,7 @@ vector<BlockMetaData> loadBlockMetaData(const string& filePath) {
     return blockMetaDataVec;
 }
 
-vector<uint8_t> openList(const string& term, const unordered_map<string, LexiconEntry> lexicon, ifstream& indexFile) {
+vector<uint8_t> openList(const string& term, const unordered_map<string, LexiconEntry>& lexicon, ifstream& indexFile) {
     auto it = lexicon.find(term);
     //check if the term exists in the lexicon
     if (it == lexicon.end()) {
@@ -328,7 +467,984 @@ pair<int,int> nextGEQ(const pair<string, vector<uint8_t>>& invertedList,
     }
 }
 
-int main() {
+// Function to load the start offset of each position block; the last entry is the file size
+vector<uint64_t> loadPositionBlockOffsets(const string& filePath) {
+    vector<uint64_t> offsets = {0};
+    ifstream metaDataFile(filePath);
+
+    if (!metaDataFile.is_open()) {
+        throw runtime_error("Failed to open position meta data file for reading: " + filePath
+                            + " (build the index with indexer --positions)");
+    }
+
+    uint32_t length;
+    while (metaDataFile >> length) {
+        offsets.push_back(offsets.back() + length);
+    }
+
+    metaDataFile.close();
+    cout << "position meta data file loaded" << endl;
+    return offsets;
+}
+
+// Deleted docIDs of one index, one bit per docID from base, read from deleted.bin
+// (uint64 base, uint64 wordCount, then the 64-bit words). Written by merger --delete.
+class DeletionBitmap {
+public:
+    // Function to load indexDir/deleted.bin; a missing file means nothing is deleted
+    static DeletionBitmap load(const string& indexDir) {
+        DeletionBitmap bitmap;
+        ifstream file(indexDir + "/deleted.bin", ios::binary);
+        if (!file.is_open()) {
+            return bitmap;
+        }
+        uint64_t base = 0, wordCount = 0;
+        file.read(reinterpret_cast<char*>(&base), sizeof(base));
+        file.read(reinterpret_cast<char*>(&wordCount), sizeof(wordCount));
+        bitmap.base = static_cast<int>(base);
+        bitmap.words.resize(wordCount);
+        file.read(reinterpret_cast<char*>(bitmap.words.data()), wordCount * sizeof(uint64_t));
+        if (!file) {
+            throw runtime_error("Truncated deletion bitmap: " + indexDir + "/deleted.bin");
+        }
+        return bitmap;
+    }
+
+    bool empty() const {
+        return words.empty();
+    }
+
+    bool contains(int docID) const {
+        if (docID < base) {
+            return false;
+        }
+        uint64_t bit = static_cast<uint64_t>(docID - base);
+        return bit / 64 < words.size() && (words[bit / 64] >> (bit % 64) & 1);
+    }
+
+    // True if no docID in [first, last] is deleted. ORs whole words over the range, a
+    // loop the compiler vectorizes, so a block without deletions is cleared at once.
+    bool noneInRange(int first, int last) const {
+        if (words.empty() || last < base) {
+            return true;
+        }
+        size_t firstWord = first < base ? 0 : static_cast<size_t>(first - base) / 64;
+        size_t lastWord = min(words.size() - 1, static_cast<size_t>(last - base) / 64);
+        uint64_t any = 0;
+        for (size_t w = firstWord; w <= lastWord; ++w) {
+            any |= words[w];
+        }
+        return any == 0;
+    }
+
+    // Function to call visit on every deleted docID, in increasing order
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (size_t w = 0; w < words.size(); ++w) {
+            for (uint64_t word = words[w]; word != 0; word &= word - 1) {
+                visit(base + static_cast<int>(w * 64 + __builtin_ctzll(word)));
+            }
+        }
+    }
+
+private:
+    int base = 0;
+    vector<uint64_t> words;
+};
+
+// Cursor over one term's list that the query algorithms walk: a finished list on disk
+// (PostingCursor) or a list still growing in memory (MemoryCursor)
+class ListCursor {
+public:
+    virtual ~ListCursor() = default;
+
+    // Moves to the first live posting with docID >= lookUpDocID; returns its docID or -1
+    virtual int nextGEQ(int lookUpDocID) = 0;
+
+    virtual int docID() const = 0;
+
+    virtual int freq() const = 0;
+
+    // Token positions of the current document
+    virtual vector<uint32_t> positions() = 0;
+};
+
+// Positions section of one on-disk index, opened for a positional query
+struct PositionsSection {
+    ifstream file;
+    vector<uint64_t> blockOffsets;
+};
+
+// Cursor over the docID/freq blocks of one term's list. Positions live in a separate
+// section with one position block per docID block, and are only read for the document
+// the cursor is on, so documents dropped by the docID intersection cost nothing.
+// Deleted documents are never returned: each decoded block gets a mask of its live
+// postings, and nextGEQ jumps to the next set bit.
+class PostingCursor : public ListCursor {
+public:
+    PostingCursor(const string& term, vector<uint8_t> list,
+                  const unordered_map<string, LexiconEntry>& lexiconMap,
+                  const vector<BlockMetaData>& blockMetaDataVec,
+                  const DeletionBitmap* deleted = nullptr,
+                  PositionsSection* positionsSection = nullptr)
+        : list(move(list)), blockMetaDataVec(blockMetaDataVec), deleted(deleted),
+          positionsSection(positionsSection), positionBlock(-1) {
+        const LexiconEntry& entry = lexiconMap.at(term);
+        docFreq = entry.docFreq;
+        firstBlock = searchBlockIndex(blockMetaDataVec, entry.offset);
+        if (firstBlock == -1) {
+            throw runtime_error("No block starts at the list of term: " + term);
+        }
+        endBlock = firstBlock + (docFreq + POSTINGS_PER_BLOCK - 1) / POSTINGS_PER_BLOCK;
+        currentBlock = -1;
+        index = 0;
+    }
+
+    int nextGEQ(int lookUpDocID) override {
+        int block = (currentBlock == -1) ? firstBlock : currentBlock;
+        while (true) {
+            while (block < endBlock && blockMetaDataVec[block].lastDocID < lookUpDocID) {
+                block++; // Skipped without decoding
+            }
+            if (block == endBlock) {
+                currentBlock = endBlock;
+                return -1;
+            }
+            if (block != currentBlock) {
+                decodeBlock(block);
+                index = 0;
+            }
+            while (docIDs[index] < lookUpDocID) {
+                index++;
+            }
+            uint64_t live = liveMask & (~uint64_t(0) << index);
+            if (live != 0) {
+                index = __builtin_ctzll(live);
+                return docIDs[index];
+            }
+            block++; // The rest of this block is deleted
+        }
+    }
+
+    int docID() const override {
+        return docIDs[index];
+    }
+
+    int freq() const override {
+        return freqs[index];
+    }
+
+    // Function to decode the positions of the current document from the positions section
+    vector<uint32_t> positions() override {
+        if (positionsSection == nullptr) {
+            throw runtime_error("Cursor was opened without the positions section");
+        }
+        ifstream& positionsFile = positionsSection->file;
+        const vector<uint64_t>& positionBlockOffsets = positionsSection->blockOffsets;
+        if (positionBlock != currentBlock) {
+            uint64_t start = positionBlockOffsets[currentBlock];
+            positionBytes.resize(positionBlockOffsets[currentBlock + 1] - start);
+            positionsFile.seekg(start);
+            positionsFile.read(reinterpret_cast<char*>(positionBytes.data()), positionBytes.size());
+            positionBlock = currentBlock;
+        }
+        // Step over the positions of earlier postings in the block by counting varbyte ends
+        size_t pos = 0;
+        int toSkip = 0;
+        for (size_t i = 0; i < index; ++i) {
+            toSkip += freqs[i];
+        }
+        while (toSkip > 0) {
+            if (!(positionBytes[pos++] & 0x80)) {
+                toSkip--;
+            }
+        }
+        vector<uint32_t> result;
+        uint32_t position = 0;
+        for (int i = 0; i < freqs[index]; ++i) {
+            uint32_t gap = 0;
+            int shift = 0;
+            while (positionBytes[pos] & 0x80) {
+                gap |= (positionBytes[pos++] & 0x7F) << shift;
+                shift += 7;
+            }
+            gap |= positionBytes[pos++] << shift;
+            position += gap;
+            result.push_back(position);
+        }
+        return result;
+    }
+
+private:
+    static const int POSTINGS_PER_BLOCK = 64;
+
+    void decodeBlock(int block) {
+        size_t start = blockMetaDataVec[block].offset - blockMetaDataVec[firstBlock].offset;
+        vector<uint8_t> listBlock = sliceVector(list, start, blockMetaDataVec[block].length);
+        vector<int> numbers = bytesToIntVec(listBlock);
+        size_t count = min<size_t>(POSTINGS_PER_BLOCK, docFreq - (block - firstBlock) * POSTINGS_PER_BLOCK);
+        if (numbers.size() + 1 == 2 * count) {
+            numbers.insert(numbers.begin(), 0); // A first docID of 0 is written as no bytes
+        }
+        int previousDocID = (block == firstBlock) ? 0 : blockMetaDataVec[block - 1].lastDocID;
+        docIDs.assign(numbers.begin(), numbers.begin() + count);
+        for (auto& docID : docIDs) {
+            docID += previousDocID;
+            previousDocID = docID;
+        }
+        freqs.assign(numbers.begin() + count, numbers.begin() + 2 * count);
+        currentBlock = block;
+
+        liveMask = (count == 64) ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+        if (deleted != nullptr && !deleted->noneInRange(docIDs.front(), docIDs.back())) {
+            for (size_t i = 0; i < count; ++i) {
+                if (deleted->contains(docIDs[i])) {
+                    liveMask &= ~(uint64_t(1) << i);
+                }
+            }
+        }
+    }
+
+    vector<uint8_t> list;
+    const vector<BlockMetaData>& blockMetaDataVec;
+    const DeletionBitmap* deleted; // Null when the index has no deletions
+    PositionsSection* positionsSection; // Null unless the query needs positions
+    uint32_t docFreq;
+    int firstBlock;
+    int endBlock;
+    int currentBlock;    // Decoded block, -1 before the first nextGEQ
+    size_t index;        // Current posting within the decoded block
+    vector<int> docIDs;
+    vector<int> freqs;
+    uint64_t liveMask;   // Bit i set if posting i of the decoded block is not deleted
+    int positionBlock;   // Position block held in positionBytes
+    vector<uint8_t> positionBytes;
+};
+
+// Function to check whether the terms occur in order at consecutive positions
+bool matchesPhrase(const vector<vector<uint32_t>>& positions) {
+    for (uint32_t start : positions[0]) {
+        bool match = true;
+        for (size_t i = 1; i < positions.size() && match; ++i) {
+            match = binary_search(positions[i].begin(), positions[i].end(), start + i);
+        }
+        if (match) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to check whether one occurrence of every term fits in a span of window tokens
+bool matchesWindow(const vector<vector<uint32_t>>& positions, uint32_t window) {
+    vector<size_t> next(positions.size(), 0);
+    while (true) {
+        // The span covers the current occurrence of each term; advance the leftmost one
+        size_t lowest = 0;
+        uint32_t highestPosition = 0;
+        for (size_t i = 0; i < positions.size(); ++i) {
+            if (positions[i][next[i]] < positions[lowest][next[lowest]]) {
+                lowest = i;
+            }
+            highestPosition = max(highestPosition, positions[i][next[i]]);
+        }
+        if (highestPosition - positions[lowest][next[lowest]] < window) {
+            return true;
+        }
+        if (++next[lowest] == positions[lowest].size()) {
+            return false;
+        }
+    }
+}
+
+// Function to answer a phrase query (window 0) or a window query over cursors of the
+// query terms, in query order. Documents are intersected on docIDs first, led by the
+// rarest term; positions are decoded only for documents that contain every term.
+vector<int> positionalQuery(vector<unique_ptr<ListCursor>>& cursors, const vector<uint32_t>& docFreqs,
+                            uint32_t window) {
+    vector<int> results;
+    size_t lead = 0;
+    for (size_t i = 1; i < cursors.size(); ++i) {
+        if (docFreqs[i] < docFreqs[lead]) {
+            lead = i;
+        }
+    }
+
+    int docID = cursors[lead]->nextGEQ(0);
+    while (docID != -1) {
+        int candidate = docID;
+        for (size_t i = 0; i < cursors.size() && docID == candidate; ++i) {
+            docID = cursors[i]->nextGEQ(candidate);
+        }
+        if (docID == -1) {
+            break;
+        }
+        if (docID != candidate) {
+            docID = cursors[lead]->nextGEQ(docID);
+            continue;
+        }
+
+        vector<vector<uint32_t>> positions;
+        for (auto& cursor : cursors) {
+            positions.push_back(cursor->positions());
+        }
+        if (window == 0 ? matchesPhrase(positions) : matchesWindow(positions, window)) {
+            results.push_back(docID);
+        }
+        docID = cursors[lead]->nextGEQ(docID + 1);
+    }
+    return results;
+}
+
+// Function to split a query string into lowercase terms the way the indexer tokenizes
+vector<string> splitQuery(const string& text) {
+    vector<string> terms;
+    string term;
+    for (char c : text) {
+        if (isalnum(static_cast<unsigned char>(c))) {
+            term += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        } else if (!term.empty()) {
+            terms.push_back(term);
+            term.clear();
+        }
+    }
+    if (!term.empty()) {
+        terms.push_back(term);
+    }
+    return terms;
+}
+
+// Writable segment of documents not yet flushed to disk. Documents are numbered in the
+// order they arrive, so appending keeps every list sorted and cursors can search it while
+// it grows; their docIDs in the collection are kept aside for results.
+class MemorySegment {
+public:
+    struct TermList {
+        vector<int> docIDs;
+        vector<int> freqs;
+        vector<uint32_t> positionStarts; // Start of each posting's positions in positions
+        vector<uint32_t> positions;
+    };
+
+    // Function to add one passage, tokenized the way the indexer tokenizes
+    void addDocument(int64_t externalID, const string& text) {
+        int docID = static_cast<int>(externalIDs.size());
+        vector<string> tokens = splitQuery(text);
+        unordered_map<string, vector<uint32_t>> occurrences;
+        for (uint32_t position = 0; position < tokens.size(); ++position) {
+            occurrences[tokens[position]].push_back(position);
+        }
+        for (const auto& [term, positions] : occurrences) {
+            auto [it, added] = lists.try_emplace(term);
+            TermList& list = it->second;
+            if (added) {
+                bytes += sizeof(TermList) + term.size() + 32; // Hash node and key
+            }
+            list.docIDs.push_back(docID);
+            list.freqs.push_back(static_cast<int>(positions.size()));
+            list.positionStarts.push_back(static_cast<uint32_t>(list.positions.size()));
+            list.positions.insert(list.positions.end(), positions.begin(), positions.end());
+            bytes += 3 * sizeof(int) + positions.size() * sizeof(uint32_t);
+        }
+        externalIDs.push_back(externalID);
+        tokenCounts.push_back(static_cast<uint32_t>(tokens.size()));
+        pageTable.add(docID, static_cast<uint32_t>(tokens.size()));
+        bytes += sizeof(int64_t) + sizeof(uint32_t) + sizeof(uint16_t);
+    }
+
+    int64_t externalID(int docID) const {
+        return externalIDs[docID];
+    }
+
+    const TermList* find(const string& term) const {
+        auto it = lists.find(term);
+        return it == lists.end() ? nullptr : &it->second;
+    }
+
+    const PageTable& documents() const {
+        return pageTable;
+    }
+
+    // Approximate heap bytes held by the postings, positions and page table
+    size_t memoryBytes() const {
+        return bytes;
+    }
+
+    // Function to write the segment as one binary run in the indexer's format (terms in
+    // sorted order, varbyte docID gaps and freqs, then position gaps if positional), its
+    // page table and its docID map, so the merger can turn it into an on-disk segment
+    void writeRun(const string& runPath, const string& pageTablePath, const string& docMapPath,
+                  bool positional) const {
+        vector<const pair<const string, TermList>*> sortedLists;
+        for (const auto& entry : lists) {
+            sortedLists.push_back(&entry);
+        }
+        sort(sortedLists.begin(), sortedLists.end(),
+             [](const auto* a, const auto* b) { return a->first < b->first; });
+
+        ofstream run(runPath, ios::binary);
+        run.write(positional ? "WSERUNP1" : "WSERUN01", 8);
+        vector<uint8_t> payload;
+        auto writeUint32 = [&](uint32_t value) {
+            run.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        };
+        for (const auto* entry : sortedLists) {
+            const TermList& list = entry->second;
+            payload.clear();
+            int previousDocID = 0;
+            for (size_t i = 0; i < list.docIDs.size(); ++i) {
+                appendVarByte(payload, list.docIDs[i] - previousDocID);
+                appendVarByte(payload, list.freqs[i]);
+                previousDocID = list.docIDs[i];
+            }
+            writeUint32(entry->first.size());
+            run.write(entry->first.data(), entry->first.size());
+            writeUint32(list.docIDs.size());
+            writeUint32(payload.size());
+            run.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+            if (positional) {
+                payload.clear();
+                for (size_t i = 0; i < list.docIDs.size(); ++i) {
+                    uint32_t previousPosition = 0;
+                    for (int j = 0; j < list.freqs[i]; ++j) {
+                        uint32_t position = list.positions[list.positionStarts[i] + j];
+                        appendVarByte(payload, position - previousPosition);
+                        previousPosition = position;
+                    }
+                }
+                writeUint32(payload.size());
+                run.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+            }
+        }
+        run.close();
+
+        ofstream pageTableFile(pageTablePath);
+        for (size_t docID = 0; docID < externalIDs.size(); ++docID) {
+            pageTableFile << docID << '\t' << tokenCounts[docID] << '\n';
+        }
+        pageTableFile.close();
+
+        ofstream docMapFile(docMapPath, ios::binary);
+        uint64_t header[2] = {0, externalIDs.size()};
+        docMapFile.write(reinterpret_cast<const char*>(header), sizeof(header));
+        docMapFile.write(reinterpret_cast<const char*>(externalIDs.data()), externalIDs.size() * sizeof(int64_t));
+        docMapFile.close();
+        if (run.fail() || pageTableFile.fail() || docMapFile.fail()) {
+            throw runtime_error("Failed to write in-memory segment to " + runPath);
+        }
+    }
+
+private:
+    static void appendVarByte(vector<uint8_t>& bytes, uint32_t value) {
+        while (value > 0x7F) {
+            bytes.push_back(static_cast<uint8_t>(value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<uint8_t>(value));
+    }
+
+    unordered_map<string, TermList> lists;
+    vector<int64_t> externalIDs; // DocID in the collection of each document
+    vector<uint32_t> tokenCounts; // Exact length of each document; pageTable caps them
+    PageTable pageTable;
+    size_t bytes = 0;
+};
+
+// Cursor over one list of a memory segment. It only sees the postings that were there
+// when it was opened, so documents added during a query do not change its answer.
+class MemoryCursor : public ListCursor {
+public:
+    MemoryCursor(const MemorySegment::TermList& list) : list(list), count(list.docIDs.size()), index(0) {}
+
+    int nextGEQ(int lookUpDocID) override {
+        // Binary search the rest of the list from the current posting
+        index = lower_bound(list.docIDs.begin() + index, list.docIDs.begin() + count, lookUpDocID)
+                - list.docIDs.begin();
+        return index < count ? list.docIDs[index] : -1;
+    }
+
+    int docID() const override {
+        return list.docIDs[index];
+    }
+
+    int freq() const override {
+        return list.freqs[index];
+    }
+
+    vector<uint32_t> positions() override {
+        auto start = list.positions.begin() + list.positionStarts[index];
+        return vector<uint32_t>(start, start + list.freqs[index]);
+    }
+
+private:
+    const MemorySegment::TermList& list;
+    size_t count;
+    size_t index;
+};
+
+// One index the query runs over: a live segment, the single src/index_4 index, or the
+// in-memory segment of query --serve, which has no files. The index and positions files
+// are opened on load, so a segment merged away meanwhile can still be read.
+struct Segment {
+    string dir;
+    unordered_map<string, LexiconEntry> lexiconMap;
+    vector<BlockMetaData> blockMetaDataVec;
+    PageTable pageTable;
+    DeletionBitmap deleted;
+    DocIDMap docMap; // To the collection's docIDs, for results
+    shared_ptr<ifstream> indexFile;
+    shared_ptr<PositionsSection> positionsSection; // Null if built without positions
+    shared_ptr<const MemorySegment> memory;
+};
+
+Segment loadSegment(const string& dir, const string& pageTableFilePath) {
+    Segment segment;
+    segment.dir = dir;
+    segment.lexiconMap = loadLexicon(dir + "/lexicon.txt");
+    segment.blockMetaDataVec = loadBlockMetaData(dir + "/blockMetaData.txt");
+    segment.pageTable = PageTable::load(dir + "/pagetable.bin", pageTableFilePath);
+    segment.deleted = DeletionBitmap::load(dir);
+    segment.docMap = DocIDMap::load(dir);
+    segment.indexFile = make_shared<ifstream>(dir + "/index.bin", ios::binary);
+    if (!segment.indexFile->is_open()) {
+        throw runtime_error("Failed to open inverted index file for reading: " + dir + "/index.bin");
+    }
+    auto positionsSection = make_shared<PositionsSection>();
+    positionsSection->file.open(dir + "/positions.bin", ios::binary);
+    if (positionsSection->file.is_open()) {
+        positionsSection->blockOffsets = loadPositionBlockOffsets(dir + "/positionMetaData.txt");
+        segment.positionsSection = positionsSection;
+    }
+    return segment;
+}
+
+// Function to get the number of documents of the segment that contain term
+uint32_t termDocFreq(const Segment& segment, const string& term) {
+    if (segment.memory) {
+        const MemorySegment::TermList* list = segment.memory->find(term);
+        return list ? static_cast<uint32_t>(list->docIDs.size()) : 0;
+    }
+    auto it = segment.lexiconMap.find(term);
+    return it == segment.lexiconMap.end() ? 0 : it->second.docFreq;
+}
+
+// Function to get the length in tokens of every document of the segment
+const PageTable& documentLengths(const Segment& segment) {
+    return segment.memory ? segment.memory->documents() : segment.pageTable;
+}
+
+// Function to open a cursor per term over one segment, in term order; terms missing from
+// the segment get a null cursor
+vector<unique_ptr<ListCursor>> openCursors(const vector<string>& terms, const Segment& segment) {
+    vector<unique_ptr<ListCursor>> cursors(terms.size());
+    if (segment.memory) {
+        for (size_t i = 0; i < terms.size(); ++i) {
+            if (const MemorySegment::TermList* list = segment.memory->find(terms[i])) {
+                cursors[i] = make_unique<MemoryCursor>(*list);
+            }
+        }
+        return cursors;
+    }
+
+    for (size_t i = 0; i < terms.size(); ++i) {
+        if (segment.lexiconMap.count(terms[i])) {
+            cursors[i] = make_unique<PostingCursor>(terms[i], openList(terms[i], segment.lexiconMap, *segment.indexFile),
+                                                    segment.lexiconMap, segment.blockMetaDataVec, &segment.deleted,
+                                                    segment.positionsSection.get());
+        }
+    }
+    return cursors;
+}
+
+// Function to map a docID of the segment to the collection's docID
+int64_t collectionDocID(const Segment& segment, int docID) {
+    return segment.memory ? segment.memory->externalID(docID) : segment.docMap.map(docID);
+}
+
+// Function to answer a phrase query (window 0) or a window query in one segment, as
+// docIDs of the collection in increasing order
+vector<int64_t> positionalQuery(const vector<string>& terms, uint32_t window, const Segment& segment) {
+    vector<uint32_t> docFreqs;
+    for (const string& term : terms) {
+        docFreqs.push_back(termDocFreq(segment, term));
+        if (docFreqs.back() == 0) {
+            return {};
+        }
+    }
+    if (!segment.memory && !segment.positionsSection) {
+        throw runtime_error("No positions in " + segment.dir + " (build the index with indexer --positions)");
+    }
+    vector<unique_ptr<ListCursor>> cursors = openCursors(terms, segment);
+    vector<int64_t> matches;
+    for (int docID : positionalQuery(cursors, docFreqs, window)) {
+        matches.push_back(collectionDocID(segment, docID));
+    }
+    sort(matches.begin(), matches.end());
+    return matches;
+}
+
+// Shared flock on the manifest lock of a segments directory. Held from reading the
+// manifest until its segments are open, so a segment merge cannot delete them between
+// the two; the merger deletes replaced segments under the exclusive lock.
+class ManifestReadLock {
+public:
+    explicit ManifestReadLock(const string& segmentsDir) {
+        string path = segmentsDir + "/manifest.lock";
+        fd = open(path.c_str(), O_RDONLY | O_CREAT, 0644);
+        if (fd < 0 || flock(fd, LOCK_SH) != 0) {
+            throw runtime_error("Failed to lock segment manifest: " + path);
+        }
+    }
+
+    ~ManifestReadLock() {
+        close(fd); // Also drops the lock
+    }
+
+    ManifestReadLock(const ManifestReadLock&) = delete;
+    ManifestReadLock& operator=(const ManifestReadLock&) = delete;
+
+private:
+    int fd;
+};
+
+// Function to list the live segments of a segmented index from its manifest
+vector<string> readSegmentManifest(const string& segmentsDir) {
+    ifstream manifest(segmentsDir + "/segments.txt");
+    if (!manifest.is_open()) {
+        throw runtime_error("Failed to open segment manifest: " + segmentsDir + "/segments.txt");
+    }
+    vector<string> dirs;
+    string name;
+    uint64_t docCount;
+    uint64_t indexBytes;
+    while (manifest >> name >> docCount >> indexBytes) {
+        dirs.push_back(segmentsDir + "/" + name);
+    }
+    return dirs;
+}
+
+// Result order of ranked queries: higher score first, ties to the lower docID
+bool betterResult(const pair<double, int64_t>& a, const pair<double, int64_t>& b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+}
+
+// Function to rank documents by BM25 over all segments and return the k best as
+// (score, docID). Collection statistics are summed over the segments so scores are
+// comparable. They leave out deleted documents, except in document frequencies, which
+// only drop once the postings are compacted away. Each segment is scored
+// document-at-a-time and keeps its own top k, and the per-segment lists are merged in
+// the collection's docIDs.
+vector<pair<double, int64_t>> topKQuery(const vector<string>& terms, size_t k,
+                                        const vector<const Segment*>& segments) {
+    const double k1 = 1.2;
+    const double b = 0.75;
+
+    double docCount = 0;
+    double totalLength = 0;
+    unordered_map<string, double> docFreqs;
+    for (const Segment* segmentPointer : segments) {
+        const Segment& segment = *segmentPointer;
+        const PageTable& lengths = documentLengths(segment);
+        docCount += lengths.documentCount();
+        totalLength += lengths.totalLength();
+        segment.deleted.forEach([&](int docID) {
+            uint16_t length = lengths.length(docID);
+            if (length != PageTable::NO_DOCUMENT) {
+                docCount--;
+                totalLength -= length;
+            }
+        });
+        for (const string& term : terms) {
+            docFreqs[term] += termDocFreq(segment, term);
+        }
+    }
+    double averageLength = totalLength / max(docCount, 1.0);
+
+    vector<pair<double, int64_t>> candidates;
+    for (const Segment* segmentPointer : segments) {
+        const Segment& segment = *segmentPointer;
+        vector<unique_ptr<ListCursor>> termCursors = openCursors(terms, segment);
+        vector<unique_ptr<ListCursor>> cursors;
+        vector<double> idf;
+        vector<int> current;
+        for (size_t i = 0; i < terms.size(); ++i) {
+            if (termCursors[i]) {
+                double df = docFreqs[terms[i]];
+                cursors.push_back(move(termCursors[i]));
+                idf.push_back(log((docCount - df + 0.5) / (df + 0.5) + 1.0));
+                current.push_back(cursors.back()->nextGEQ(0));
+            }
+        }
+        const PageTable& lengths = documentLengths(segment);
+
+        // Best k documents of this segment, worst on top
+        priority_queue<pair<double, int64_t>, vector<pair<double, int64_t>>, decltype(&betterResult)> best(betterResult);
+        while (true) {
+            int docID = -1;
+            for (int next : current) {
+                if (next != -1 && (docID == -1 || next < docID)) {
+                    docID = next;
+                }
+            }
+            if (docID == -1) {
+                break;
+            }
+            uint16_t length = lengths.length(docID);
+            double norm = k1 * (1 - b + b * (length == PageTable::NO_DOCUMENT ? averageLength : length) / averageLength);
+            double score = 0;
+            for (size_t i = 0; i < cursors.size(); ++i) {
+                if (current[i] == docID) {
+                    double tf = cursors[i]->freq();
+                    score += idf[i] * tf * (k1 + 1) / (tf + norm);
+                    current[i] = cursors[i]->nextGEQ(docID + 1);
+                }
+            }
+            if (best.size() < k) {
+                best.emplace(score, docID);
+            } else if (betterResult({score, docID}, best.top())) {
+                best.pop();
+                best.emplace(score, docID);
+            }
+        }
+        while (!best.empty()) {
+            candidates.emplace_back(best.top().first, collectionDocID(segment, static_cast<int>(best.top().second)));
+            best.pop();
+        }
+    }
+
+    // Merge the per-segment top k lists
+    size_t keep = min(k, candidates.size());
+    partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), betterResult);
+    candidates.resize(keep);
+    return candidates;
+}
+
+// Function to answer one --phrase, --window or --top query over the segments and print it
+void runQuery(const string& mode, uint32_t window, size_t topK, const string& queryText,
+              const vector<const Segment*>& segments) {
+    vector<string> terms = splitQuery(queryText);
+    if (terms.empty()) {
+        throw runtime_error("Query has no terms: " + queryText);
+    }
+    auto queryStart = chrono::high_resolution_clock::now();
+    if (mode == "--top") {
+        vector<pair<double, int64_t>> results = topKQuery(terms, topK, segments);
+        chrono::duration<double> queryTime = chrono::high_resolution_clock::now() - queryStart;
+        cout << "Top " << results.size() << " documents in " << queryTime.count() << " seconds:" << endl;
+        for (const auto& [score, docID] : results) {
+            cout << docID << " " << score << endl;
+        }
+    } else {
+        vector<int64_t> results;
+        for (const Segment* segment : segments) {
+            vector<int64_t> matches = positionalQuery(terms, window, *segment);
+            results.insert(results.end(), matches.begin(), matches.end());
+        }
+        chrono::duration<double> queryTime = chrono::high_resolution_clock::now() - queryStart;
+        cout << results.size() << " documents match in " << queryTime.count() << " seconds:";
+        for (size_t i = 0; i < results.size() && i < 20; ++i) {
+            cout << " " << results[i];
+        }
+        cout << endl;
+    }
+}
+
+// A segmented index plus a writable in-memory segment, for query --serve. Added
+// documents are searchable from the next query on. Once the memory segment passes
+// its limit it is frozen, and a background thread writes it as a run and has the
+// merger add it to the segments directory; the frozen segment stays searchable until
+// then, and a fresh memory segment takes the documents that arrive meanwhile.
+class LiveIndex {
+public:
+    LiveIndex(const string& segmentsDir, const string& mergerPath, size_t memoryLimit)
+        : segmentsDir(segmentsDir), mergerPath(mergerPath), memoryLimit(memoryLimit),
+          active(make_shared<MemorySegment>()), flushState(IDLE) {
+        fs::create_directories(segmentsDir);
+        {
+            ManifestReadLock lock(segmentsDir);
+            vector<string> dirs = fs::exists(segmentsDir + "/segments.txt") ? readSegmentManifest(segmentsDir)
+                                                                             : vector<string>();
+            // Flushed segments must match the existing ones, or the merger could not merge them
+            positional = dirs.empty() || fs::exists(dirs.front() + "/positions.bin");
+        }
+        refresh();
+    }
+
+    ~LiveIndex() {
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+    }
+
+    void addDocument(int64_t docID, const string& text) {
+        active->addDocument(docID, text);
+        if (active->memoryBytes() >= memoryLimit) {
+            startFlush();
+        }
+    }
+
+    // Function to freeze the memory segment and start flushing it in the background.
+    // Only one flush runs at a time; until it is done the memory segment keeps growing.
+    void startFlush() {
+        refresh();
+        if (flushState != IDLE) {
+            return;
+        }
+        if (!frozen) {
+            if (active->documents().documentCount() == 0) {
+                return;
+            }
+            frozen = active;
+            active = make_shared<MemorySegment>();
+        }
+        // A frozen segment left by a failed flush is retried before the next one is frozen
+        flushState = FLUSHING;
+        flusher = thread(&LiveIndex::flush, this, frozen);
+    }
+
+    // Function to flush everything still in memory and wait for it, before exiting
+    void finish() {
+        for (int attempt = 0; attempt < 2 && (frozen || active->documents().documentCount() > 0); ++attempt) {
+            if (flusher.joinable()) {
+                flusher.join();
+            }
+            startFlush();
+            if (flusher.joinable()) {
+                flusher.join();
+            }
+            refresh();
+        }
+        if (frozen || active->documents().documentCount() > 0) {
+            throw runtime_error("Documents still in memory could not be flushed to " + segmentsDir);
+        }
+    }
+
+    // Function to get the segments to query: the on-disk segments, then the frozen and
+    // the writable memory segments
+    vector<const Segment*> segments() {
+        refresh();
+        vector<const Segment*> result;
+        for (const string& dir : liveDirs) {
+            result.push_back(&loaded.at(dir));
+        }
+        if (frozen) {
+            frozenView.memory = frozen;
+            result.push_back(&frozenView);
+        }
+        activeView.memory = active;
+        result.push_back(&activeView);
+        return result;
+    }
+
+private:
+    enum { IDLE, FLUSHING, DONE, FAILED };
+
+    // Function to bring the view up to date. A finished flush drops the frozen segment in
+    // the same step that loads the new manifest, so its documents are never seen twice
+    // or not at all. While a flush runs the manifest is not reread.
+    void refresh() {
+        int state = flushState;
+        if (state == DONE || state == FAILED) {
+            if (flusher.joinable()) {
+                flusher.join();
+            }
+            if (state == DONE) {
+                cout << "Flushed " << frozen->documents().documentCount() << " in-memory documents to " << segmentsDir << endl;
+                frozen.reset();
+            }
+            flushState = IDLE;
+        }
+        // merger --delete replaces a segment's bitmap while it stays in the manifest
+        for (auto& [dir, segment] : loaded) {
+            error_code error;
+            auto modified = fs::last_write_time(dir + "/deleted.bin", error);
+            if (!error && modified != deletedTimes[dir]) {
+                segment.deleted = DeletionBitmap::load(dir);
+                deletedTimes[dir] = modified;
+            }
+        }
+
+        if (flushState != IDLE || frozen) {
+            return;
+        }
+
+        ManifestReadLock lock(segmentsDir);
+        ifstream manifest(segmentsDir + "/segments.txt");
+        string text((istreambuf_iterator<char>(manifest)), istreambuf_iterator<char>());
+        if (text == manifestText) {
+            return;
+        }
+        vector<string> dirs = text.empty() ? vector<string>() : readSegmentManifest(segmentsDir);
+        map<string, Segment> nextLoaded;
+        for (const string& dir : dirs) {
+            auto it = loaded.find(dir);
+            nextLoaded.emplace(dir, it != loaded.end() ? move(it->second) : loadSegment(dir, dir + "/pagetable.tsv"));
+        }
+        loaded.swap(nextLoaded);
+        liveDirs = dirs;
+        manifestText = text;
+    }
+
+    // Function to write a frozen segment as a run and page table and run the merger on
+    // them, which adds it to the segments directory; runs on the flusher thread
+    void flush(shared_ptr<const MemorySegment> segment) {
+        string workDir = segmentsDir + "/memory.tmp";
+        try {
+            fs::remove_all(workDir);
+            fs::create_directories(workDir + "/runs");
+            segment->writeRun(workDir + "/runs/intermediate_0.bin", workDir + "/pagetable.tsv",
+                              workDir + "/runs/docmap.bin", positional);
+            runMerger({"--segments", segmentsDir, "--runs", workDir + "/runs",
+                       "--pagetable", workDir + "/pagetable.tsv"});
+            fs::remove_all(workDir);
+            flushState = DONE;
+        } catch (const exception& ex) {
+            cerr << "Error flushing in-memory segment: " << ex.what() << endl;
+            flushState = FAILED;
+        }
+    }
+
+    // Function to run the merger with args and wait for it; its log is discarded
+    void runMerger(const vector<string>& args) {
+        vector<char*> argv = {const_cast<char*>(mergerPath.c_str())};
+        for (const string& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw runtime_error("Failed to start merger");
+        }
+        if (pid == 0) {
+            int devNull = open("/dev/null", O_WRONLY);
+            dup2(devNull, STDOUT_FILENO);
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            throw runtime_error("Merger failed: " + mergerPath);
+        }
+    }
+
+    string segmentsDir;
+    string mergerPath;
+    size_t memoryLimit;
+    bool positional;
+    map<string, Segment> loaded;   // On-disk segments by directory
+    vector<string> liveDirs;       // Directories of the manifest, in order
+    string manifestText;           // Manifest the view was loaded from
+    map<string, fs::file_time_type> deletedTimes; // Last loaded deleted.bin of each segment
+    shared_ptr<MemorySegment> active;
+    shared_ptr<const MemorySegment> frozen; // Being flushed, or left by a failed flush
+    Segment activeView;
+    Segment frozenView;
+    atomic<int> flushState;
+    thread flusher;
+};
+
+int main(int argc, char* argv[]) {
 
     // Start the timer
     auto start = chrono::high_resolution_clock::now();
@@ -336,6 +1452,119 @@ int main() {
     string pageTableFilePath = "src/pagetable.tsv";
     string blockMetaDataFilePath = "src/index_4/blockMetaData.txt";
     string indexFilePath = "src/index_4/index.bin";
+
+    // --phrase TEXT finds the terms as an exact phrase, --window N TEXT finds them within
+    // N tokens, --top K TEXT ranks by BM25; --segments DIR searches every live segment of DIR.
+    // --serve reads documents and queries from stdin over DIR and an in-memory segment.
+    string queryText;
+    string mode;
+    uint32_t window = 0;
+    size_t topK = 0;
+    string segmentsDir;
+    bool serve = false;
+    size_t memoryLimit = 16 * 1024 * 1024; // In-memory segment size that triggers a flush
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--segments" && i + 1 < argc) {
+            segmentsDir = argv[++i];
+        } else if (arg == "--serve") {
+            serve = true;
+        } else if (arg == "--memory-limit" && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            memoryLimit = static_cast<size_t>(atof(argv[++i]) * 1024 * 1024);
+        } else if (arg == "--phrase" && i + 1 < argc) {
+            mode = arg;
+            queryText = argv[++i];
+        } else if ((arg == "--window" || arg == "--top") && i + 2 < argc && atoi(argv[i + 1]) > 0) {
+            mode = arg;
+            if (arg == "--window") {
+                window = atoi(argv[++i]);
+            } else {
+                topK = atoi(argv[++i]);
+            }
+            queryText = argv[++i];
+        } else {
+            cerr << "Usage: ./query [--segments DIR] [--phrase TEXT | --window N TEXT | --top K TEXT]\n"
+                 << "       ./query --segments DIR --serve [--memory-limit MB]" << endl;
+            return 1;
+        }
+    }
+
+    if (serve) {
+        if (segmentsDir.empty()) {
+            cerr << "--serve needs --segments DIR" << endl;
+            return 1;
+        }
+        // The merger that flushes the memory segment sits next to this program
+        fs::path programDir = fs::path(argv[0]).parent_path();
+        string mergerPath = programDir.empty() ? "merger" : (programDir / "merger").string();
+        try {
+            LiveIndex live(segmentsDir, mergerPath, memoryLimit);
+            cout << "search engine is ready; commands: add DOCID TEXT | flush | top K TEXT | phrase TEXT | window N TEXT" << endl;
+            string line;
+            while (getline(cin, line)) {
+                istringstream command(line);
+                string verb;
+                command >> verb;
+                try {
+                    if (verb == "add") {
+                        int64_t docID;
+                        string text;
+                        if (!(command >> docID)) {
+                            throw runtime_error("add needs a docID: " + line);
+                        }
+                        getline(command, text);
+                        live.addDocument(docID, text);
+                    } else if (verb == "flush") {
+                        live.startFlush();
+                    } else if (verb == "top" || verb == "window") {
+                        size_t number = 0;
+                        command >> number;
+                        getline(command, queryText);
+                        if (number == 0) {
+                            throw runtime_error(verb + " needs a positive number: " + line);
+                        }
+                        runQuery("--" + verb, verb == "window" ? number : 0, number, queryText, live.segments());
+                    } else if (verb == "phrase") {
+                        getline(command, queryText);
+                        runQuery("--phrase", 0, 0, queryText, live.segments());
+                    } else if (!verb.empty()) {
+                        throw runtime_error("Unknown command: " + verb);
+                    }
+                } catch (const exception& e) {
+                    cerr << e.what() << endl;
+                }
+            }
+            live.finish();
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!mode.empty()) {
+        try {
+            vector<Segment> segments;
+            if (segmentsDir.empty()) {
+                segments.push_back(loadSegment("src/index_4", pageTableFilePath));
+            } else {
+                ManifestReadLock lock(segmentsDir);
+                for (const string& dir : readSegmentManifest(segmentsDir)) {
+                    segments.push_back(loadSegment(dir, dir + "/pagetable.tsv"));
+                }
+            }
+            cout << "search engine is ready (" << segments.size() << " segments)" << endl;
+            vector<const Segment*> segmentPointers;
+            for (const auto& segment : segments) {
+                segmentPointers.push_back(&segment);
+            }
+            runQuery(mode, window, topK, queryText, segmentPointers);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
     
     try {
         
@@ -351,12 +1580,12 @@ int main() {
             count++;
         }*/
         
-        unordered_map<int, int> pageMap = loadPageTable(pageTableFilePath);
+        PageTable pageTable = PageTable::load("src/index_4/pagetable.bin", pageTableFilePath);
 
         /*int count = 0;
 
-        for (const auto& entry : pageMap) {
-            cout << entry.first << " " << entry.second << endl;
+        for (int docID = 0; docID < 100; ++docID) {
+            cout << docID << " " << pageTable.length(docID) << endl;
             if (count > 100) {
                 break;
             }